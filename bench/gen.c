@@ -0,0 +1,169 @@
+/* Deterministic corpora for the benchmarks.
+ *
+ *   gen prose|logs|csv|patho MB [seed]	text of about MB megabytes
+ *   gen rules N				N pairs word:WORD, one per line
+ *
+ * The same kind, size and seed give the same bytes on any machine. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+
+static uint64_t rng_state;
+
+/* xorshift64* */
+uint64_t rng(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+unsigned pick(unsigned n) {
+    return (unsigned)(rng() >> 33) % n;
+}
+
+static const char *words[] = {
+    "the", "a", "and", "of", "to", "in", "was", "he", "she", "it", "that", "his", "her",
+    "with", "for", "on", "at", "by", "not", "but", "had", "said", "all", "from", "were",
+    "they", "one", "there", "what", "when", "who", "would", "been", "their", "into",
+    "vodka", "samovar", "doctor", "village", "officer", "colour", "centre", "theatre",
+    "cat", "dog", "fox", "horse", "house", "garden", "river", "letter", "evening",
+    "morning", "window", "table", "station", "student", "teacher", "mother", "father",
+    "quickly", "slowly", "quietly", "suddenly", "again", "always", "never", "still",
+    "looked", "walked", "answered", "thought", "laughed", "waited", "remembered",
+    "old", "young", "little", "great", "white", "black", "cold", "warm", "long", "short",
+};
+#define N_WORDS	(sizeof words / sizeof words[0])
+
+/* sentences wrapped at 72 columns */
+void gen_prose(size_t size) {
+    size_t n = 0, col = 0;
+    int first = 1, len;
+    char w[32];
+
+    while (n < size) {
+	strcpy(w, words[pick(N_WORDS)]);
+	if (first)
+	    w[0] = toupper((unsigned char)w[0]);
+	first = 0;
+	len = strlen(w);
+	if (pick(8) == 0) {
+	    w[len++] = pick(3) ? '.' : (pick(2) ? '?' : '!');
+	    w[len] = '\0';
+	    first = 1;
+	} else if (pick(10) == 0) {
+	    w[len++] = ',';
+	    w[len] = '\0';
+	}
+	if (col && col + 1 + len > 72) {
+	    putchar('\n');
+	    n++;
+	    col = 0;
+	} else if (col) {
+	    putchar(' ');
+	    n++;
+	    col++;
+	}
+	fputs(w, stdout);
+	n += len;
+	col += len;
+    }
+    putchar('\n');
+}
+
+void gen_logs(size_t size) {
+    static const char *level[] = { "INFO", "INFO", "INFO", "DEBUG", "WARN", "ERROR" };
+    static const char *path[] = { "/api/v1/items", "/api/v1/users", "/login", "/static/app.js", "/health" };
+    size_t n = 0;
+    unsigned t = 0;
+
+    while (n < size) {
+	t += pick(1000);
+	n += printf("2024-%02u-%02u %02u:%02u:%02u.%03u %s [worker-%u] %s from %u.%u.%u.%u took %ums path=%s/%u\n",
+		    1 + t / 2678400 % 12, 1 + t / 86400 % 28, t / 3600 % 24, t / 60 % 60, t % 60, pick(1000),
+		    level[pick(6)], pick(16), pick(4) ? "GET" : "POST",
+		    10 + pick(200), pick(256), pick(256), 1 + pick(254), pick(2000), path[pick(5)], pick(10000));
+    }
+}
+
+void gen_csv(size_t size) {
+    static const char *name[] = { "Anton", "Olga", "Masha", "Irina", "Ivan", "Nikolai", "Vera", "Pyotr" };
+    size_t n = 0;
+    unsigned id = 0;
+
+    n += printf("id,name,email,amount,date\n");
+    while (n < size) {
+	const char *nm = name[pick(8)];
+	id++;
+	n += printf("%u,%s,%c%s%u@example.com,%u.%02u,2023-%02u-%02u\n", id, nm,
+		    tolower((unsigned char)nm[0]), nm + 1, pick(100), pick(10000), pick(100),
+		    1 + pick(12), 1 + pick(28));
+    }
+}
+
+/* runs of 'a' cut off by a 'c' before the 'b', so that a backtracker
+ * fails every way to split a run, from every position of it */
+void gen_patho(size_t size) {
+    size_t n = 0;
+    unsigned len;
+
+    while (n < size) {
+	len = 16 + pick(16);
+	for (unsigned i = 0; i < len; i++)
+	    putchar('a');
+	fputs("cb\n", stdout);
+	n += len + 3;
+    }
+}
+
+/* the words of the prose first, then made up ones */
+void gen_rules(size_t count) {
+    static const char *syl[] = { "ka", "ro", "mi", "ne", "tu", "sha", "lo", "vi", "da", "ze" };
+    char w[32];
+
+    for (size_t i = 0; i < count; i++) {
+	if (i < N_WORDS)
+	    strcpy(w, words[i]);
+	else {
+	    w[0] = '\0';
+	    for (size_t k = i; k; k /= 10)
+		strcat(w, syl[k % 10]);
+	}
+	printf("%s:", w);
+	for (char *p = w; *p; p++)
+	    putchar(toupper((unsigned char)*p));
+	putchar('\n');
+    }
+}
+
+int main(int argc, char **argv) {
+    double mb;
+
+    if (argc < 3) {
+	fprintf(stderr, "Usage: %s prose|logs|csv|patho MB [seed]\n"
+			"       %s rules N\n", argv[0], argv[0]);
+	return EXIT_FAILURE;
+    }
+    rng_state = argc > 3 ? strtoull(argv[3], NULL, 10) : 0;
+    rng_state = rng_state * 0x9e3779b97f4a7c15ULL + 1;	/* never 0 */
+    mb = atof(argv[2]);
+
+    if (strcmp(argv[1], "prose") == 0)
+	gen_prose(mb * (1 << 20));
+    else if (strcmp(argv[1], "logs") == 0)
+	gen_logs(mb * (1 << 20));
+    else if (strcmp(argv[1], "csv") == 0)
+	gen_csv(mb * (1 << 20));
+    else if (strcmp(argv[1], "patho") == 0)
+	gen_patho(mb * (1 << 20));
+    else if (strcmp(argv[1], "rules") == 0)
+	gen_rules(atoi(argv[2]));
+    else {
+	fprintf(stderr, "error: unknown corpus %s\n", argv[1]);
+	return EXIT_FAILURE;
+    }
+    return 0;
+}
@@ -0,0 +1,75 @@
+/* Run a command with stdin from a file and stdout to /dev/null and
+ * print its wall time in seconds, its peak RSS in kilobytes and its
+ * exit status on one line; the status is "timeout" if it was killed.
+ *
+ *   measure [-t seconds] input command [args...] */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+static pid_t child;
+
+void on_alarm(int sig) {
+    (void)sig;
+    kill(child, SIGKILL);
+}
+
+int main(int argc, char **argv) {
+    struct timespec t0, t1;
+    struct rusage ru;
+    int status, fd, arg = 1;
+    unsigned timeout = 0;
+
+    if (argc > 2 && strcmp(argv[1], "-t") == 0) {
+	timeout = atoi(argv[2]);
+	arg = 3;
+    }
+    if (argc - arg < 2) {
+	fprintf(stderr, "Usage: %s [-t seconds] input command [args...]\n", argv[0]);
+	return EXIT_FAILURE;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    child = fork();
+    if (child < 0) {
+	perror("fork");
+	return EXIT_FAILURE;
+    }
+    if (child == 0) {
+	if ((fd = open(argv[arg], O_RDONLY)) < 0 || dup2(fd, STDIN_FILENO) < 0) {
+	    perror(argv[arg]);
+	    _exit(127);
+	}
+	if ((fd = open("/dev/null", O_WRONLY)) < 0 || dup2(fd, STDOUT_FILENO) < 0)
+	    _exit(127);
+	execvp(argv[arg + 1], argv + arg + 1);
+	perror(argv[arg + 1]);
+	_exit(127);
+    }
+
+    signal(SIGALRM, on_alarm);
+    alarm(timeout);
+    while (wait4(child, &status, 0, &ru) < 0)
+	if (errno != EINTR) {
+	    perror("wait4");
+	    return EXIT_FAILURE;
+	}
+    alarm(0);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    printf("%.6f %ld ", (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9, ru.ru_maxrss);
+    if (WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL && timeout)
+	printf("timeout\n");
+    else
+	printf("%d\n", WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+    return 0;
+}
@@ -0,0 +1,87 @@
+#!/bin/bash
+
+# Benchmarks of trre, trre_dft and a sed or tr baseline on generated
+# corpora. Every run prints one JSON object on a line:
+#
+#   case, corpus, tool	what ran
+#   bytes, lines		the size of the corpus
+#   seconds		the best wall time of BENCH_RUNS runs
+#   mb_s, lines_s		the throughput of the best run
+#   rss_kb		the peak resident set of the best run
+#   compile_ms		the best wall time on an empty input: the start
+#			up and the compilation of the expression
+#   status		the exit status, or "timeout"
+#
+# BENCH_MB sets the corpus size, BENCH_TIMEOUT the limit of a run in
+# seconds; TRRE and TRRE_DFT point to other builds to compare.
+
+set -e
+cd "$(dirname "$0")"
+
+MB=${BENCH_MB:-16}
+RUNS=${BENCH_RUNS:-3}
+TIMEOUT=${BENCH_TIMEOUT:-30}
+TRRE=${TRRE:-../trre}
+TRRE_DFT=${TRRE_DFT:-../trre_dft}
+DATA=data
+
+mkdir -p $DATA
+for c in prose logs csv patho; do
+    [ -s $DATA/$c-$MB.txt ] || ./gen $c $MB > $DATA/$c-$MB.txt
+done
+[ -s $DATA/rules.txt ] || ./gen rules 1000 > $DATA/rules.txt
+sed 's#^\(.*\):\(.*\)$#s/\1/\2/g#' $DATA/rules.txt > $DATA/rules.sed
+
+# best of the runs: seconds, rss_kb and status
+best() {
+    local input=$1 runs=$2
+    shift 2
+    for ((k = 0; k < runs; k++)); do
+	r=$(./measure -t $TIMEOUT "$input" "$@")
+	echo "$r"
+	[[ $r == *timeout ]] && break
+    done | sort -n | awk '
+	$3 == "timeout" { t = $0 } $3 != "timeout" && !b { b = $0 }
+	END { print b ? b : t }'
+}
+
+run() {
+    local case=$1 corpus=$2 tool=$3
+    local input=$DATA/$corpus-$MB.txt
+    shift 3
+
+    read bytes lines < <(wc -c -l < $input | awk '{ print $2, $1 }')
+    read seconds rss status < <(best $input $RUNS "$@")
+    read compile _ _ < <(best /dev/null $RUNS "$@")
+    awk -v c=$case -v k=$corpus -v t=$tool -v b=$bytes -v l=$lines \
+	-v s=$seconds -v r=$rss -v m=$compile -v st=$status 'BEGIN {
+	printf "{\"case\": \"%s\", \"corpus\": \"%s\", \"tool\": \"%s\", ", c, k, t
+	printf "\"bytes\": %d, \"lines\": %d, \"seconds\": %.4f, ", b, l, s
+	printf "\"mb_s\": %.2f, \"lines_s\": %.0f, ", b / 1048576 / s, l / s
+	printf "\"rss_kb\": %d, \"compile_ms\": %.2f, ", r, 1000 * m
+	printf "\"status\": %s}\n", st == "timeout" ? "\"timeout\"" : st
+    }'
+}
+
+# a case: the same rewrite by the three tools
+bench() {
+    local case=$1 corpus=$2 expr=$3
+    shift 3
+
+    run $case $corpus trre $TRRE "$expr"
+    run $case $corpus trre_dft $TRRE_DFT "$expr"
+    run $case $corpus "$1" "$@"
+}
+
+bench literal-swap	prose	'vodka:VODKA'		sed 's/vodka/VODKA/g'
+bench case-map		prose	'[a:A-z:Z]'		tr a-z A-Z
+bench deletion		prose	'(the ):'		sed 's/the //g'
+bench wildcard		logs	'(took .*ms):'		sed 's/took .*ms//g'
+bench ip-mask		logs	'[0-9]+\.[0-9]+\.[0-9]+\.[0-9]+:IP'	sed -E 's/[0-9]+\.[0-9]+\.[0-9]+\.[0-9]+/IP/g'
+bench counted-repeat	csv	'[0-9]{4}-[0-9]{2}-[0-9]{2}:DATE'	sed -E 's/[0-9]{4}-[0-9]{2}-[0-9]{2}/DATE/g'
+bench backtracking	patho	'(a|aa)*b:X'		sed -E 's/(a|aa)*b/X/g'
+
+# a thousand literal pairs, as a rules file and a sed script
+run alternation prose trre $TRRE -f $DATA/rules.txt
+run alternation prose trre_dft $TRRE_DFT -f $DATA/rules.txt
+run alternation prose sed sed -f $DATA/rules.sed
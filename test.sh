@@ -2,6 +2,19 @@
 
 cmd_scan="./trre"
 cmd_match="./trre -ma"
+cmd_pike="./trre -p"
+cmd_dft="./trre_dft"
+cmd_dft_budget="./trre_dft -M 1"
+cmd_twins="./trre_dft -t"
+cmd_dft_match="./trre_dft -m"
+cmd_dft_all="./trre_dft -ma"
+cmd_compiled="run_compiled"
+cmd_rules="run_rules"
+cmd_many_rules="run_many_rules"
+cmd_raw="run_raw"
+cmd_jobs="run_jobs"
+cmd_lib="run_lib"
+cmd_stats="run_stats"
 
 test_cmd() {
     local inp=$1
@@ -25,6 +38,189 @@ S() {
     test_cmd "$1" "$2" "$3" "$cmd_scan"
 }
 
+P() {
+    test_cmd "$1" "$2" "$3" "$cmd_pike"
+}
+
+D() {
+    test_cmd "$1" "$2" "$3" "$cmd_dft"
+}
+
+# dft with a cache flushed on every new state
+B() {
+    test_cmd "$1" "$2" "$3" "$cmd_dft_budget"
+}
+
+# dft in the match mode: the whole line
+W() {
+    test_cmd "$1" "$2" "$3" "$cmd_dft_match"
+}
+
+# dft in the match mode, every distinct output
+A() {
+    test_cmd "$1" "$2" "$3" "$cmd_dft_all"
+}
+
+# twins property test
+T() {
+    test_cmd "" "$1" "$2" "$cmd_twins"
+}
+
+# compile to a file, then run both binaries from it
+run_compiled() {
+    local fn=$(mktemp)
+    local inp=$(cat)
+
+    ./trre -c "$fn" "$1" && echo "$inp" | ./trre -C "$fn"
+    ./trre_dft -c "$fn" "$1" && echo "$inp" | ./trre_dft -C "$fn"
+    rm -f "$fn"
+}
+
+C() {
+    test_cmd "$1" "$2" "$3" "$cmd_compiled"
+}
+
+# compile, clear the instruction count of the file, then load it
+run_no_inst() {
+    local fn=$(mktemp)
+
+    for b in ./trre ./trre_dft; do
+	$b -c "$fn" "$1"
+	printf '\0\0\0\0' | dd of="$fn" bs=1 seek=16 conv=notrunc 2>/dev/null
+	$b -C "$fn" < /dev/null 2>&1 | sed "s|$fn|FILE|"
+    done
+    rm -f "$fn"
+}
+
+E() {
+    test_cmd "$1" "$2" "$3" "run_no_inst"
+}
+
+# write the rules, one per line, and run both binaries on the file
+run_rules() {
+    local fn=$(mktemp)
+    local inp=$(cat)
+
+    echo -e "$1" > "$fn"
+    echo "$inp" | ./trre -f "$fn"
+    echo "$inp" | ./trre_dft -f "$fn"
+    rm -f "$fn"
+}
+
+# the input as printf takes it: no final newline, NUL bytes; NUL is
+# shown as @ in the output of both binaries
+run_raw() {
+    local inp=$(cat)
+
+    printf "$inp" | ./trre "$1" | tr '\0' '@'
+    printf "$inp" | ./trre_dft "$1" | tr '\0' '@'
+}
+
+N() {
+    test_cmd "$1" "$2" "$3" "$cmd_raw"
+}
+
+# both binaries on worker threads, a batch per line
+run_jobs() {
+    local inp=$(cat)
+
+    echo "$inp" | ./trre -j 3 -l "$1"
+    echo "$inp" | ./trre_dft -j 3 -l "$1"
+}
+
+J() {
+    test_cmd "$1" "$2" "$3" "$cmd_jobs"
+}
+
+R() {
+    test_cmd "$1" "$2" "$3" "$cmd_rules"
+}
+
+# generate n literal rules wK:rK, all chained off one instruction, and
+# run the scan, the pike vm and the dft on the file
+run_many_rules() {
+    local fn=$(mktemp)
+    local inp=$(cat)
+
+    seq "$1" | awk '{ print "w" $1 ":r" $1 }' > "$fn"
+    echo "$inp" | ./trre -f "$fn"
+    echo "$inp" | ./trre -p -f "$fn"
+    echo "$inp" | ./trre_dft -f "$fn"
+    rm -f "$fn"
+}
+
+G() {
+    test_cmd "$1" "$2" "$3" "$cmd_many_rules"
+}
+
+# -s of both binaries: the output, then the counts of the input and
+# the output without the timings
+run_stats() {
+    local inp=$(cat)
+
+    echo "$inp" | ./trre -s "$1" 2>&1 | grep -v -E '^(parse|nft|analyze|run|backtrack|pike|dict):' | cut -d, -f1,2
+    echo "$inp" | ./trre_dft -s -j 2 "$1" 2>&1 | grep -E '^(in|out):' | cut -d, -f1,2
+}
+
+Z() {
+    test_cmd "$1" "$2" "$3" "$cmd_stats"
+}
+
+# libtrre: a client scans every line, then matches it, into a buffer
+# too small at first, so that it is grown on TRRE_ESPACE
+lib_client=$(mktemp)
+trap 'rm -f "$lib_client"' EXIT
+cc -std=c99 -I. -x c - -x none libtrre.a -pthread -o "$lib_client" <<'EOF'
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "trre.h"
+
+int run(struct trre *re, char *line, size_t len, int flags) {
+    size_t cap = 1, n;
+    char *buf = malloc(cap);
+    int ret;
+
+    while ((ret = trre_exec_buf(re, line, len, flags, buf, cap, &n)) == TRRE_ESPACE)
+	buf = realloc(buf, cap = n);
+    if (ret >= 0)
+	fwrite(buf, 1, n, stdout);
+    free(buf);
+    return ret;
+}
+
+int main(int argc, char **argv) {
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    struct trre *re;
+    int err;
+
+    if (argc < 2 || (re = trre_compile(argv[1], &err)) == NULL) {
+	printf("error: %s\n", trre_strerror(argc < 2 ? TRRE_EINVAL : err));
+	return 1;
+    }
+    while ((len = getline(&line, &cap, stdin)) > 0) {
+	if (line[len - 1] == '\n')
+	    len--;
+	run(re, line, len, 0);
+	printf(" %d\n", run(re, line, len, TRRE_MATCH));
+    }
+    trre_free(re);
+    free(line);
+    return 0;
+}
+EOF
+
+run_lib() {
+    "$lib_client" "$1"
+}
+
+L() {
+    test_cmd "$1" "$2" "$3" "$cmd_lib"
+}
+
 	# input		# trre			# expected
 # basics
 M 	"a"		"a:x" 			"x"
@@ -49,6 +245,13 @@ M 	"a"		"a|b|c"			"a"
 M 	"b"		"a|b|c"			"b"
 M 	"c"		"a|b|c"			"c"
 
+# -a lists each path, also through bytes covered twice
+M	"a"		"a|a"			"a\na"
+M	"a"		"[aa]"			"a\na"
+M	"a"		"(a|a):x"		"x\nx"
+M	"a"		".|a"			"a\na"
+M	"c"		"[a-cb-d]"		"c\nc"
+
 # star
 S	"a"		"a*"			"a"
 S	"aaa"		"a*"			"aaa"
@@ -75,6 +278,17 @@ M	"b"		"[a:x-c:z]"		"y"
 M	"c"		"[a:x-c:z]"		"z"
 M	"d"		"[a:x-c:z]"		""
 
+# byte mappings
+S	"abc"		"[a:bb:c]"		"bcc"
+S	"caesar cipher"	"[a:b-y:zz:a]"		"dbftbs djqifs"
+M	"a"		"[a:xa:y]"		"x\ny"
+
+# long literals, one frame of nft() per byte
+long=$(head -c 40000 /dev/zero | tr '\0' a)
+S	"xay"		"${long}:z"		"xay"
+D	"xay"		"${long}:z"		"xay"
+S	"x${long}y"	"${long}:z"		"xzy"
+
 # any char
 M	"a"		"."			"a"
 M	"b"		"."			"b"
@@ -131,7 +345,129 @@ S 	"<cat><dog>" 	"<(.:)*?>"		"<><>"
 S 	"<cat><dog>" 	"<(.:)+>"		"<>"
 S 	"<cat><dog>" 	"<(.:)+?>"		"<><>"
 
+# pike vm
+P	"cat"		"cat:dog"		"dog"
+P 	"xor" 		"x:"			"or"
+P 	'or' 		':='			"=o=r="
+P	"aaa"		"(.:x)*.*"		"xxx"
+P	"aaa"		"(.:x)*?.*"		"aaa"
+P 	"<cat><dog>" 	"<(.:)*>"		"<>"
+P 	"<cat><dog>" 	"<(.:)*?>"		"<><>"
+P	"aaaaaaaaaaaaaaaaaaaaaaaac"	"(a*)*b:x"	"aaaaaaaaaaaaaaaaaaaaaaaac"
+P	"aaab"		"(a*)*b:x"		"x"
+P	"accbcc"	"(a(c|d)*b):X|c:Y"	"XYY"
+P	"cccbx"		"(ac*b):X|(cc):Y"	"Ycbx"
+P	"xccax"		"x:X|(c*[ab]x):X"	"XX"
+
+# bit-state backtracking
+S	"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaacb"	"(a|aa)*b:X"	"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaacX"
+S	"aaaaaaaaaaaaaaaaaaaaaaaac aab"	"(a*)*b:x"	"aaaaaaaaaaaaaaaaaaaaaaaac x"
+S	"aab cab"	"((a)?)*b:Q"		"Q cQ"
+
+# dft cache budget
+B	"cat dog cat"	"cat:dog"		"dog dog dog"
+B  	"Mary had a little lamb"	"a:"	"Mry hd  little lmb"
+B	"hello"		"[a:A-z:Z]"		"HELLO"
+B	"abcabcabc"	"(abc):x"		"xxx"
+B	"aaab"		"(a|b)*b:x"		"x"
+
+# determinizability
+T			"cat:dog"		"determinizable"
+T			"(a:x|a:y)*"		"determinizable"
+T			"(a:x)*b|(a:y)*c"	"not determinizable"
+T			"(a:x)*a|a*b"		"not determinizable"
+T			"((:a)?(:b)?(:c)?(:d)?(:e)?(:f)?(:g)?(:h)?)(ab|ac)"	"determinizable"
+D	"aaab"		"(a:x)*b|(a:y)*c"	"xxxb"
+D	"aaac"		"(a:x)*b|(a:y)*c"	"yyyc"
+D	"aaab"		"(a*)*b:x"		"x"
+
+# match mode on the dft
+W	"cat"		"cat:dog"		"dog"
+W	"cow"		"cat:dog"		""
+W	""		":a{,3}"		"aaa"
+W	"aaac"		"(a:x)*b|(a:y)*c"	"yyyc"
+
+# every output on the dft
+A	""		":a{,3}"		"aaa\naa\na"
+A	""		":(0|1){2}"		"00\n01\n10\n11"
+A	"aaa"		"(.:x)*.*"		"xxx\nxxa\nxaa\naaa"
+A	"aaa"		"(.:x)*?.*"		"aaa\nxaa\nxxa\nxxx"
+A	"abc"		".*(b:B)?.*"		"abc\naBc"
+A	"aaab"		"(a:x)*b|(a:y)*b"	"xxxb\nyyyb"
+A	"ab"		"(a*)*(a:x)?b"		"ab\nxb"
+A	"cow"		"cat:dog"		""
+
+# compiled files
+C	"cat dog cat"	"cat:dog"		"dog dog dog\ndog dog dog"
+C	"hello"		"[a:A-z:Z]"		"HELLO\nHELLO"
+C	"aaab aaac"	"(a:x)*b|(a:y)*c"	"xxxb yyyc\nxxxb yyyc"
+E	""		"a:b"			"error: FILE is corrupted\nerror: FILE is corrupted"
+
+# skipping to the literal prefix or the first byte set
+S	"a vodka, vodkas"	"vodka:VODKA"	"a VODKA, VODKAs"
+D	"a vodka, vodkas"	"vodka:VODKA"	"a VODKA, VODKAs"
+S	"cat cow dog"	"(cat|dog):x"		"x cow x"
+D	"cat cow dog"	"(cat|dog):x"		"x cow x"
+S	"aab ab"	"(ab|aab):x"		"x x"
+
+# one pass scan over overlapping candidates
+D	"accbcc"	"(a(c|d)*b):X|c:Y"	"XYY"
+D	"cccbx"		"(ac*b):X|(cc):Y"	"Ycbx"
+D	"xccax"		"x:X|(c*[ab]x):X"	"XX"
+B	"xccax"		"x:X|(c*[ab]x):X"	"XX"
+B	"acccbcc"	"(ac*b):X|(cc):Y"	"XY"
+
+# lines without the required literal or out of the length bounds
+S	"user 42@example.com"	"[0-9]+(@example.com:@corp)"	"user 42@corp"
+S	"no mail here"	"[0-9]+(@example.com:@corp)"	"no mail here"
+D	"no mail here"	"[0-9]+(@example.com:@corp)"	"no mail here"
+S	"xay xaay"	"x(a:b){2,5}y"		"xay xbby"
+M	"xay"		"x(a:b){2,5}y"		""
+M	"xaaay"		"x(a:b){2,5}y"		"xbbby"
+M	"xaaaaaay"	"x(a:b){2,5}y"		""
+C	"cat dog"	"(c|d)(at:AT)"		"cAT dog\ncAT dog"
+
+# literal dictionaries
+S	"colour centre"	"colour:color|centre:center"	"color center"
+S	"abc"		"ab:x|abc:y"		"xc"
+S	"abc"		"abc:y|ab:x"		"y"
+S	"xabcd"		"bcd:z|ab:x"		"xxcd"
+S	"aab"		"a:1|aa:2|aab:3"	"11b"
+S	"a cab"		"(a:x|b:y)|(ca:)"	"x y"
+C	"colour centre"	"colour:color|centre:center"	"color center\ncolor center"
+S	"cab"		"[a:x-c:z]:xy"		"zxyxxyyxy"
+S	"cab"		"([a:x-c:z]a:x)"	"zxb"
+S	"cab"		"[a:x-c:z]:"		"zxy"
+
+# rules files
+R	"colour centre 42@example.com"	"# spelling\ncolour:color\n\ncentre:center\n[0-9]+(@example.com:@corp)"	"color center 42@corp\ncolor center 42@corp"
+R	"cat dog"	"cat:dog\ndog:cat"	"dog cat\ndog cat"
+R	"abc"		"ab:x\nabc:y"		"xc\nxc"
+G	"w7 w99999 x"	100000			"r7 r99999 x\nr7 r99999 x\nr7 r99999 x"
+
+# input spans
+N	"cat dog\ncat"	"cat:CAT"		"CAT dog\nCAT\nCAT dog\nCAT"
+N	"a\000cat\000b"	"cat:X"		"a@X@b\na@X@b"
+N	"a\000b"	".:x"			"xxx\nxxx"
+N	"xbb"		"[a-b].:"		"x\nx"
+N	"xbbab"		"b*.:"			""
+
+# worker threads
+J	$'cat\ndog\n\ncat'	"cat:x"			"x\ndog\n\nx\nx\ndog\n\nx"
+J	$'abc\nxyz\nab'	"[a:A-z:Z]"		"ABC\nXYZ\nAB\nABC\nXYZ\nAB"
+
+# statistics
+Z	$'cat dog\ncat'	"cat:x"			"x dog\nx\nin: 12 bytes, 2 lines\nout: 8 bytes\nin: 12 bytes, 2 lines\nout: 8 bytes"
+Z	"vodka"		"vodka:VODKA|x:"	"VODKA\nin: 6 bytes, 1 lines\nout: 6 bytes\nin: 6 bytes, 1 lines\nout: 6 bytes"
 
+# library
+L	$'cat dog\ncat'	"(cat|dog):x"		"x x 0\nxx 1"
+L	"abc"		"[a:A-z:Z]+"		"ABCABC 1"
+L	"cat dog cow"	"cat:dog|dog:cat|cow:pig"	"dog cat pig 0"
+L	"cab"		"[a:x-c:z]:"		"zxy 0"
+L	"xbb"		"[a-b].:"		"x 0"
+L	"a"		"a|"			"error: malformed expression"
+L	"a"		""			"error: malformed expression"
 
 # epsilon
 # generators
@@ -0,0 +1,56 @@
+/* libtrre: transductive regular expressions as a library.
+ *
+ * A compiled expression is immutable: it can be shared by threads,
+ * each trre_exec() call keeps its scratch state to itself. Nothing
+ * is written to stderr and nothing exits; errors are returned as the
+ * negative codes below. */
+
+#ifndef TRRE_H
+#define TRRE_H
+
+#include <stddef.h>
+
+#if defined(__GNUC__)
+#define TRRE_API	__attribute__((visibility("default")))
+#else
+#define TRRE_API
+#endif
+
+enum trre_error {
+    TRRE_OK = 0,
+    TRRE_ESYNTAX = -1,		/* malformed expression */
+    TRRE_ENOMEM = -2,		/* out of memory */
+    TRRE_ELIMIT = -3,		/* backtracking stack limit reached */
+    TRRE_ESPACE = -4,		/* the output does not fit the buffer */
+    TRRE_EINVAL = -5,		/* bad argument */
+};
+
+/* trre_exec() flags */
+#define TRRE_MATCH	1	/* transform the whole input, else scan it */
+#define TRRE_PIKE	2	/* run the linear-time Pike VM */
+
+struct trre;
+
+/* receives the output in pieces, in order */
+typedef void (*trre_write_fn)(void *arg, const char *p, size_t n);
+
+/* compile a NUL terminated expression; NULL and *err on error */
+TRRE_API struct trre * trre_compile(const char *expr, int *err);
+
+/* Run the expression over input[0, len). In the scan mode every match
+ * is replaced by its output and the rest is copied; with TRRE_MATCH
+ * the output of the whole input is written if it matches. Returns 1
+ * if it matched, 0 if not or in the scan mode, or an error. */
+TRRE_API int trre_exec(const struct trre *re, const char *input, size_t len, int flags,
+		       trre_write_fn write, void *arg);
+
+/* trre_exec() into buf; *n is the length of the whole output, and if
+ * it is over cap only cap bytes are written and TRRE_ESPACE returned */
+TRRE_API int trre_exec_buf(const struct trre *re, const char *input, size_t len, int flags,
+			   char *buf, size_t cap, size_t *n);
+
+TRRE_API void trre_free(struct trre *re);
+
+TRRE_API const char * trre_strerror(int err);
+
+#endif
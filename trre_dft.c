@@ -7,6 +7,13 @@
 #include <assert.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <pthread.h>
 
 
 /* precendence table */
@@ -37,22 +44,281 @@ struct node {
 
 #define STACK_MAX_CAPACITY	1000000
 
-static unsigned char operators[1024];
-static struct node *operands[1024];
+#define PARSE_STACK_INIT	1024
 
-static unsigned char *opr = operators;
-static struct node **opd = operands;
+/* parser stacks, grown with the nesting of the expression */
+static unsigned char *operators;
+static struct node **operands;
+static size_t operators_cap, operands_cap;
 
-static char* output;
-static size_t output_capacity=32;
+static unsigned char *opr;
+static struct node **opd;
 
+void opr_push(unsigned char op) {
+    size_t n = opr - operators;
 
-struct node * create_node(unsigned char type, struct node *l, struct node *r) {
-    struct node *node = malloc(sizeof(struct node));
-    if (!node) {
-	fprintf(stderr, "error: node memory allocation failed\n");
+    if (n == operators_cap) {
+	operators_cap = operators_cap ? 2 * operators_cap : PARSE_STACK_INIT;
+	operators = realloc(operators, operators_cap);
+	if (operators == NULL) {
+	    fprintf(stderr, "error: parser memory allocation failed\n");
+	    exit(EXIT_FAILURE);
+	}
+	opr = operators + n;
+    }
+    *opr++ = op;
+}
+
+void opd_push(struct node *node) {
+    size_t n = opd - operands;
+
+    if (n == operands_cap) {
+	operands_cap = operands_cap ? 2 * operands_cap : PARSE_STACK_INIT;
+	operands = realloc(operands, operands_cap * sizeof(struct node*));
+	if (operands == NULL) {
+	    fprintf(stderr, "error: parser memory allocation failed\n");
+	    exit(EXIT_FAILURE);
+	}
+	opd = operands + n;
+    }
+    *opd++ = node;
+}
+
+/* the runtime state is per thread for the -j workers */
+static __thread char* output;
+static __thread size_t output_capacity=32;
+
+
+/* Counters of -s. They are per thread and bumped without atomics,
+ * the byte loops keep theirs in locals and add them once per call; a
+ * -j worker adds its counters to the pool when it is done. */
+struct stats {
+    size_t nft_steps;		/* nft_step and groups_step calls */
+    size_t lookups;		/* dft transitions looked up */
+    size_t misses;		/* of them not explored yet */
+};
+
+static __thread struct stats stats;
+
+void stats_add(struct stats *to, struct stats *from) {
+    to->nft_steps += from->nft_steps;
+    to->lookups += from->lookups;
+    to->misses += from->misses;
+}
+
+/* monotonic time in seconds */
+double now(void) {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+
+/* Buffered writer for stdout. Spans of the input and the outputs are
+ * copied into one block that goes out with write() when full; a span
+ * longer than the block is written along with it by one writev(). In
+ * the line buffered mode the block goes out at every end of line.
+ * What is buffered is also written on exit, errors included. A -j
+ * worker has a writer of its own that grows in memory instead. */
+
+#define OUT_BLOCK	(1 << 16)
+
+struct writer {
+    char *p;
+    size_t n, capacity;
+    int line;			/* flush at every end of line */
+    int mem;			/* grow, never write */
+    size_t written;		/* bytes written to stdout */
+};
+
+static __thread struct writer out;
+
+void out_writev(struct iovec *iov, int cnt) {
+    ssize_t n;
+
+    while (cnt) {
+	n = writev(STDOUT_FILENO, iov, cnt);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n < 0) {			/* may run at exit, so no exit() */
+	    fprintf(stderr, "error: can not write the output\n");
+	    _exit(EXIT_FAILURE);
+	}
+	out.written += n;
+	for (; cnt && (size_t)n >= iov->iov_len; iov++, cnt--)
+	    n -= iov->iov_len;
+	if (cnt) {			/* partial write */
+	    iov->iov_base = (char*)iov->iov_base + n;
+	    iov->iov_len -= n;
+	}
+    }
+}
+
+void out_flush(void) {
+    struct iovec v = { out.p, out.n };
+
+    if (out.mem)
+	return;
+    out.n = 0;
+    if (v.iov_len)
+	out_writev(&v, 1);
+}
+
+void out_init(int line) {
+    out.capacity = OUT_BLOCK;
+    out.p = malloc(out.capacity);
+    if (out.p == NULL) {
+	fprintf(stderr, "error: memory allocation failed\n");
+	exit(EXIT_FAILURE);
+    }
+    out.line = line;
+    atexit(out_flush);
+}
+
+void out_grow(size_t n) {
+    out.capacity = out.capacity ? out.capacity : OUT_BLOCK;
+    while (out.capacity < n)
+	out.capacity *= 2;
+    out.p = realloc(out.p, out.capacity);
+    if (out.p == NULL) {
+	fprintf(stderr, "error: output re-allocation failed\n");
 	exit(EXIT_FAILURE);
     }
+}
+
+void out_write(const void *p, size_t n) {
+    if (n == 0)
+	return;
+    if (out.n + n > out.capacity) {
+	if (out.mem)
+	    out_grow(out.n + n);
+	else if (n >= out.capacity) {
+	    struct iovec v[2] = { { out.p, out.n }, { (void*)p, n } };
+	    out.n = 0;
+	    out_writev(v, 2);
+	    return;
+	} else
+	    out_flush();
+    }
+    memcpy(out.p + out.n, p, n);
+    out.n += n;
+}
+
+void out_byte(char c) {
+    if (out.n == out.capacity && out.mem)
+	out_grow(out.n + 1);
+    else if (out.n == out.capacity)
+	out_flush();
+    out.p[out.n++] = c;
+}
+
+/* the end of an output line */
+void out_newline(void) {
+    out_byte('\n');
+    if (out.line)
+	out_flush();
+}
+
+
+/* bump allocator; owns the AST and the NFT of one compiled expression */
+
+#define ARENA_CHUNK_SIZE	(64*1024)
+#define ARENA_ALIGN		16
+#define ALIGN_UP(n, a)		(((n) + (a) - 1) & ~((size_t)(a) - 1))
+
+struct achunk {
+    struct achunk *next;
+    size_t size;
+    size_t used;
+};
+
+struct arena {
+    struct achunk *head;
+    size_t used;		/* bytes handed out */
+    size_t allocated;		/* bytes requested from malloc */
+};
+
+static struct arena arena;
+
+void * arena_bump(struct arena *a, size_t size, size_t align) {
+    struct achunk *ch = a->head;
+    size_t hdr = ALIGN_UP(sizeof(struct achunk), ARENA_ALIGN);
+    size_t off = ch ? ALIGN_UP(ch->used, align) : 0;
+
+    if (ch == NULL || off + size > ch->size) {
+	size_t csize = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+	ch = malloc(hdr + csize);
+	if (ch == NULL) {
+	    fprintf(stderr, "error: arena memory allocation failed\n");
+	    exit(EXIT_FAILURE);
+	}
+	ch->next = a->head;
+	ch->size = csize;
+	a->head = ch;
+	a->allocated += hdr + csize;
+	off = 0;
+    }
+    ch->used = off + size;
+    a->used += size;
+    return (char*)ch + hdr + off;
+}
+
+void * arena_alloc(struct arena *a, size_t size) {
+    return arena_bump(a, size, ARENA_ALIGN);
+}
+
+/* unaligned allocation for byte strings */
+unsigned char * arena_bytes(struct arena *a, size_t size) {
+    return arena_bump(a, size, 1);
+}
+
+/* grow the last allocation, ending at 'end', in place; 0 if impossible */
+int arena_extend(struct arena *a, void *end, size_t size) {
+    struct achunk *ch = a->head;
+    size_t hdr = ALIGN_UP(sizeof(struct achunk), ARENA_ALIGN);
+
+    if (ch == NULL || (char*)end != (char*)ch + hdr + ch->used || ch->used + size > ch->size)
+	return 0;
+    ch->used += size;
+    a->used += size;
+    return 1;
+}
+
+/* drop everything but keep the newest chunk for reuse */
+void arena_reset(struct arena *a) {
+    struct achunk *ch = a->head, *next;
+    size_t hdr = ALIGN_UP(sizeof(struct achunk), ARENA_ALIGN);
+
+    if (ch == NULL)
+	return;
+    for (next = ch->next; next != NULL; next = ch->next) {
+	ch->next = next->next;
+	free(next);
+    }
+    ch->used = 0;
+    a->used = 0;
+    a->allocated = hdr + ch->size;
+}
+
+void arena_free(struct arena *a) {
+    struct achunk *ch, *next;
+
+    for (ch = a->head; ch != NULL; ch = next) {
+	next = ch->next;
+	free(ch);
+    }
+    a->head = NULL;
+    a->used = a->allocated = 0;
+}
+
+size_t arena_used(struct arena *a) {
+    return a->used;
+}
+
+
+struct node * create_node(unsigned char type, struct node *l, struct node *r) {
+    struct node *node = arena_alloc(&arena, sizeof(struct node));
     node->type = type;
     node->val = 0;
     node->l = l;
@@ -82,7 +348,7 @@ void reduce_postfix(char op, int ng) {
 	    l = pop(opd);
 	    r = create_node(op, l, NULL);
 	    r->val = ng;
-	    push(opd, r);
+	    opd_push(r);
 	    break;
 	default:
 	    fprintf(stderr, "error: unexpected postfix operator\n");
@@ -100,7 +366,7 @@ void reduce() {
 	case '|': case '.': case ':': case '-':
 	    r = pop(opd);
 	    l = pop(opd);
-	    push(opd, create_node(op, l, r));
+	    opd_push(create_node(op, l, r));
 	    break;
 	case '(':
 	    fprintf(stderr, "error: unmached parenthesis\n");
@@ -112,7 +378,7 @@ void reduce() {
 void reduce_op(char op) {
     while(opr != operators && prec(top(opr)) >= prec(op))
         reduce();
-    push(opr, op);
+    opr_push(op);
 }
 
 char* parse_curly_brackets(char *expr) {
@@ -143,7 +409,7 @@ char* parse_curly_brackets(char *expr) {
 	    r = create_nodev(lv, count);
 	    l = create_node('I', pop(opd), r);
 	    l->val = ng;
-	    push(opd, l);
+	    opd_push(l);
 
             return expr;
         } else {
@@ -167,7 +433,7 @@ char* parse_square_brackets(char *expr) {
 		    fprintf(stderr, "error: unexpected symbol in square brackets: %c", c);
 		    exit(EXIT_FAILURE);
 		default:
-		    push(opd, create_nodev('c', c));       // push operand
+		    opd_push(create_nodev('c', c));       // push operand
 		    state = 1;
 	    }
 	} else {                       		   	   // expect operator
@@ -202,31 +468,31 @@ struct node * parse(char *expr) {
         if (state == 0) {                     	// expect operand
             switch(c) {
 		case '(':
-		    push(opr, c);
+		    opr_push(c);
 		    break;
 		case '[':
-		    push(opr, c);
+		    opr_push(c);
 		    expr = parse_square_brackets(expr+1);
 		    state = 1;
 		    break;
 		case '\\':
-		    push(opd, create_nodev('c', *++expr));
+		    opd_push(create_nodev('c', *++expr));
 		    state = 1;
 		    break;
 		case '.':
-		    push(opd, create_node('-',
+		    opd_push(create_node('-',
 		    		create_nodev('c', 0),
 		    		create_nodev('c', 255)));
 		    state = 1;
 		    break;
 		case ':':					// epsilon as an implicit left operand
-		    push(opd, create_nodev('e', c));
+		    opd_push(create_nodev('e', c));
 		    state = 1;
 		    continue;					// stay in the same position in expr
 		case '|': case '*': case '+': case '?':
 		case ')': case '{': case '}':
 		    if (opr != operators && top(opr) == ':') { 	// epsilon as an implicit right operand
-			push(opd, create_nodev('e', c));
+			opd_push(create_nodev('e', c));
 			state = 1;
 			continue;				// stay in the same position in expr
 		    } else {
@@ -234,7 +500,7 @@ struct node * parse(char *expr) {
 			exit(EXIT_FAILURE);
 		    }
 		default:
-		    push(opd, create_nodev('c', c));
+		    opd_push(create_nodev('c', c));
 		    state = 1;
             }
 	} else {               					// expect postfix or binary operator
@@ -252,10 +518,10 @@ struct node * parse(char *expr) {
                 state = 0;
                 break;
             case ':':
+		reduce_op(c);
                 if (*(expr+1) == '\0') {		// implicit epsilon as a right operand
-                    push(opd, create_nodev('e', c));
+                    opd_push(create_nodev('e', c));
                 }
-		reduce_op(c);
 		state = 0;
 		break;
             case '{':
@@ -325,9 +591,15 @@ enum nstate_type {
     SPLIT,
     SPLITNG,
     JOIN,
-    FINAL
+    FINAL,
+    CONS_CLASS,
+    MAP
 };
 
+#define BIT_SET(set, c)		((set)[(unsigned char)(c) >> 3] |= 1 << ((unsigned char)(c) & 7))
+#define BIT_TEST(set, c)	((set)[(unsigned char)(c) >> 3] & (1 << ((unsigned char)(c) & 7)))
+
+
 
 // nft state
 struct nstate {
@@ -336,24 +608,25 @@ struct nstate {
     unsigned char mode;
     struct nstate *nexta;
     struct nstate *nextb;
-    uint8_t visited;
+    uint8_t *set;		/* CONS_CLASS, MAP: 256-bit byte set */
+    uint8_t *map;		/* MAP: output byte for each input byte */
+    size_t id;			/* dense index, used by compile() */
 };
 
+static size_t n_states = 0;
+
 
 struct nstate* create_nstate(enum nstate_type type, struct nstate *nexta, struct nstate *nextb) {
     struct nstate *state;
 
-    state = malloc(sizeof(struct nstate));
-    if (state == NULL) {
-        fprintf(stderr, "error: nft state memory allocation failed\n");
-        exit(EXIT_FAILURE);
-    }
-
+    state = arena_alloc(&arena, sizeof(struct nstate));
     state->type = type;
     state->nexta = nexta;
     state->nextb = nextb;
+    state->set = NULL;
+    state->map = NULL;
     state->val = 0;
-    state->visited = 0;
+    state->id = n_states++;
 
     return state;
 }
@@ -373,6 +646,117 @@ struct nchunk chunk(struct nstate *head, struct nstate *tail) {
 }
 
 
+/* collect the bytes of a single-byte expression: a char, a range or
+ * an alternation of those; return 0 if the node is anything else or
+ * if a byte is covered twice, so that -a still lists every path */
+int node_class(struct node *n, uint8_t *set) {
+    switch (n->type) {
+	case 'c':
+	    if (BIT_TEST(set, n->val))
+		return 0;
+	    BIT_SET(set, n->val);
+	    return 1;
+	case '-':
+	    if (n->l->type != 'c' || n->r->type != 'c')
+		return 0;
+	    for (int c = n->l->val; c <= n->r->val; c++) {
+		if (BIT_TEST(set, c))
+		    return 0;
+		BIT_SET(set, c);
+	    }
+	    return 1;
+	case '|':
+	    return node_class(n->l, set) && node_class(n->r, set);
+    }
+    return 0;
+}
+
+/* single state for a byte set; in mode 0 the byte is copied to the output */
+struct nchunk nft_class(uint8_t *set, char mode) {
+    struct nstate *state = create_nstate(CONS_CLASS, NULL, NULL);
+    state->set = arena_alloc(&arena, 32);
+    memcpy(state->set, set, 32);
+    state->val = (mode == 0);
+    return chunk(state, state);
+}
+
+
+/* collect a byte-to-byte transduction: pairs like a:x, ranges of pairs
+ * like a:A-z:Z, plain bytes (copied as is) and alternations of those;
+ * return 0 if the node is anything else or if a byte is covered twice */
+int node_map(struct node *n, uint8_t *set, uint8_t *map) {
+    int lo, hi, out;
+
+    switch (n->type) {
+	case 'c':
+	    lo = hi = out = n->val;
+	    break;
+	case ':':
+	    if (n->l->type != 'c' || n->r->type != 'c')
+		return 0;
+	    lo = hi = n->l->val;
+	    out = n->r->val;
+	    break;
+	case '-':
+	    if (n->l->type == 'c' && n->r->type == 'c') {
+		lo = out = n->l->val;
+		hi = n->r->val;
+	    } else if (n->l->type == ':' && n->r->type == ':'
+		    && n->l->l->type == 'c' && n->l->r->type == 'c'
+		    && n->r->l->type == 'c') {
+		lo = n->l->l->val;
+		out = n->l->r->val;
+		hi = n->r->l->val;
+	    } else
+		return 0;
+	    break;
+	case '|':
+	    return node_map(n->l, set, map) && node_map(n->r, set, map);
+	default:
+	    return 0;
+    }
+
+    for (int c = lo; c <= hi; c++, out++) {
+	if (BIT_TEST(set, c))
+	    return 0;
+	BIT_SET(set, c);
+	map[c] = out;
+    }
+    return 1;
+}
+
+/* single state for a byte-to-byte transduction */
+struct nchunk nft_map(uint8_t *set, uint8_t *map) {
+    struct nstate *state = create_nstate(MAP, NULL, NULL);
+    state->set = arena_alloc(&arena, 32);
+    state->map = arena_alloc(&arena, 256);
+    memcpy(state->set, set, 32);
+    memcpy(state->map, map, 256);
+    return chunk(state, state);
+}
+
+
+/* scratch for nft_bytes(); kept out of the frame of the recursive nft()
+ * so that long expressions do not run out of stack */
+static uint8_t bytes_set[32], bytes_map[256];
+
+/* build a single byte set or byte map state for n if it has that shape */
+int nft_bytes(struct node *n, char mode, struct nchunk *c) {
+    /* byte sets are consumed by one state, they can not be generated */
+    memset(bytes_set, 0, sizeof bytes_set);
+    if (mode != 2 && node_class(n, bytes_set)) {
+	*c = nft_class(bytes_set, mode);
+	return 1;
+    }
+    memset(bytes_set, 0, sizeof bytes_set);
+    if (mode == 0 && node_map(n, bytes_set, bytes_map)) {
+	*c = nft_map(bytes_set, bytes_map);
+	return 1;
+    }
+    return 0;
+}
+
+
 struct nchunk nft(struct node *n, char mode) {
     struct nstate *split, *psplit, *join;
     struct nstate *cstate, *pstate, *state, *head, *tail, *final;
@@ -383,6 +767,9 @@ struct nchunk nft(struct node *n, char mode) {
     if (n == NULL)
     	return chunk(NULL, NULL);
 
+    if ((n->type == '|' || n->type == '-') && nft_bytes(n, mode, &l))
+	return l;
+
     switch(n->type) {
 	case '.':
 	    l = nft(n->l, mode);
@@ -522,781 +909,3662 @@ struct nstate* create_nft(struct node *root) {
     return init;
 }
 
-struct sitem {
-    struct nstate *s;
-    size_t i;
-    size_t o;
+/* Rules file: one expression per line, empty lines and lines starting
+ * with '#' are skipped. The rules are joined as alternatives in file
+ * order, so an earlier rule wins over a later one, and the input is
+ * scanned once for all of them. */
+struct nstate* create_nft_rules(char *fn, int debug) {
+    struct nstate *final = create_nstate(FINAL, NULL, NULL);
+    struct nstate *join = create_nstate(JOIN, final, NULL);
+    struct nstate **heads = NULL, *head;
+    size_t n = 0, cap = 0, lineno = 0, len = 0, states;
+    struct timespec t0, t1;
+    struct nchunk ch;
+    char *line = NULL;
+    ssize_t read;
+    FILE *fp;
+
+    fp = fopen(fn, "r");
+    if (fp == NULL) {
+	fprintf(stderr, "error: can not open file %s\n", fn);
+	exit(EXIT_FAILURE);
+    }
+    while ((read = getline(&line, &len, fp)) != -1) {
+	lineno++;
+	if (read > 0 && line[read-1] == '\n')
+	    line[--read] = '\0';
+	if (read == 0 || line[0] == '#')
+	    continue;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	states = n_states;
+	ch = nft(parse(line), 0);
+	ch.tail->nexta = join;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	if (debug)
+	    fprintf(stderr, "rule %zu (line %zu): %zu states, %.3f ms\n", n + 1, lineno,
+		    n_states - states, (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+
+	if (n == cap) {
+	    cap = cap ? 2 * cap : 64;
+	    heads = realloc(heads, cap * sizeof(struct nstate*));
+	    if (heads == NULL) {
+		fprintf(stderr, "error: memory allocation failed\n");
+		exit(EXIT_FAILURE);
+	    }
+	}
+	heads[n++] = ch.head;
+    }
+    fclose(fp);
+    free(line);
+    if (n == 0) {
+	fprintf(stderr, "error: no rules in %s\n", fn);
+	exit(EXIT_FAILURE);
+    }
+
+    /* the first rule is the first alternative of every split */
+    head = heads[n - 1];
+    for (size_t i = n - 1; i > 0; i--)
+	head = create_nstate(SPLITNG, heads[i - 1], head);
+    free(heads);
+    return create_nstate(JOIN, head, NULL);
+}
+
+/* Compiled NFT: the state graph flattened into a contiguous array of
+ * instructions. Transitions are 32-bit indices, states are stored in
+ * depth-first order following nexta first, so most of the time the
+ * next instruction is the adjacent one. The program holds no pointers
+ * and can be copied or written to a file as is. */
+
+#define NIL	UINT32_MAX	/* no transition */
+
+struct inst {
+    uint8_t op;			/* enum nstate_type */
+    uint8_t val;
+    uint32_t x;			/* nexta */
+    uint32_t y;			/* nextb */
 };
 
-struct sstack {
-    struct sitem *items;
-    size_t n_items;
-    size_t capacity;
+struct prog {
+    struct inst *inst;
+    uint32_t n;			/* the start instruction is 0 */
+    uint8_t *sets;		/* CONS_CLASS byte sets, 32 bytes each */
+    uint32_t n_sets;
+    uint8_t *maps;		/* MAP byte sets followed by output tables */
+    uint32_t n_maps;
 };
 
-struct sstack * screate(size_t capacity) {
-    struct sstack *stack;
+#define MAP_SIZE	(32 + 256)
 
-    stack = (struct sstack*)malloc(sizeof(struct sstack));
-    stack->items = malloc(capacity * sizeof(struct sitem));
-    if (stack == NULL || stack->items == NULL) {
-	fprintf(stderr, "error: stack memory allocation failed\n");
+struct prog * compile(struct nstate *start) {
+    struct prog *prog = arena_alloc(&arena, sizeof(struct prog));
+    struct nstate **order, **stack, **sp, *s;
+    uint32_t *map;
+
+    map = malloc(n_states * sizeof(uint32_t));
+    order = malloc(n_states * sizeof(struct nstate*));
+    stack = malloc((2 * n_states + 1) * sizeof(struct nstate*));
+    if (!map || !order || !stack) {
+	fprintf(stderr, "error: compile memory allocation failed\n");
 	exit(EXIT_FAILURE);
     }
-    stack->n_items = 0;
-    stack->capacity = capacity;
-    return stack;
-}
+    memset(map, 0xff, n_states * sizeof(uint32_t));
 
-void sresize(struct sstack *stack, size_t new_capacity) {
-    stack->items = realloc(stack->items, new_capacity * sizeof(struct sitem));
-    if (stack->items == NULL) {
-	fprintf(stderr, "error: stack memory re-allocation failed\n");
-	exit(EXIT_FAILURE);
+    prog->n = 0;
+    sp = stack;
+    push(sp, start);
+    while (sp != stack) {
+	s = pop(sp);
+	if (map[s->id] != NIL)
+	    continue;
+	map[s->id] = prog->n;
+	order[prog->n++] = s;
+	if (s->nextb)
+	    push(sp, s->nextb);
+	if (s->nexta)
+	    push(sp, s->nexta);
     }
-    stack->capacity = new_capacity;
-}
 
-void spush(struct sstack *stack, struct nstate *s, size_t i, size_t o) {
-    struct sitem *it;
-    if (stack->n_items == stack->capacity) {
-        if (stack->capacity * 2 > STACK_MAX_CAPACITY) {
-	    fprintf(stderr, "error: stack max capacity reached\n");
-	    exit(EXIT_FAILURE);
+    prog->inst = arena_alloc(&arena, prog->n * sizeof(struct inst));
+    prog->n_sets = prog->n_maps = 0;
+    for (uint32_t i = 0; i < prog->n; i++)
+	if (order[i]->type == CONS_CLASS)
+	    prog->n_sets++;
+	else if (order[i]->type == MAP)
+	    prog->n_maps++;
+    prog->sets = arena_alloc(&arena, prog->n_sets * 32);
+    prog->maps = arena_alloc(&arena, prog->n_maps * MAP_SIZE);
+
+    prog->n_sets = prog->n_maps = 0;
+    for (uint32_t i = 0; i < prog->n; i++) {
+	s = order[i];
+	prog->inst[i].op = s->type;
+	prog->inst[i].val = s->val;
+	prog->inst[i].x = s->nexta ? map[s->nexta->id] : NIL;
+	prog->inst[i].y = s->nextb ? map[s->nextb->id] : NIL;
+	if (s->type == CONS_CLASS) {		/* y holds the set index */
+	    memcpy(prog->sets + 32 * prog->n_sets, s->set, 32);
+	    prog->inst[i].y = prog->n_sets++;
+	} else if (s->type == MAP) {		/* y holds the map index */
+	    memcpy(prog->maps + MAP_SIZE * prog->n_maps, s->set, 32);
+	    memcpy(prog->maps + MAP_SIZE * prog->n_maps + 32, s->map, 256);
+	    prog->inst[i].y = prog->n_maps++;
 	}
-	sresize(stack, stack->capacity * 2);
     }
-    it = &stack->items[stack->n_items];
-    it->s = s;
-    it->i = i;
-    it->o = o;
 
-    stack->n_items++;
+    free(stack);
+    free(order);
+    free(map);
+    return prog;
 }
 
-size_t spop(struct sstack *stack, struct nstate **s, size_t *i, size_t *o) {
-    struct sitem *it;
-    if (stack->n_items == 0) {
-	fprintf(stderr, "error: stack underflow\n");
-        exit(EXIT_FAILURE);
-    }
-    stack->n_items--;
-    it = &stack->items[stack->n_items];
-    *s = it->s;
-    *i = it->i;
-    *o = it->o;
-
-    return stack->n_items;
-}
+/* Compiled program files. All the sections are addressed by offsets
+ * from the start of the file, so a file is mapped and used in place;
+ * the instruction layout is checked against this build. */
+
+#define TRREB_MAGIC	"TRRB"
+#define TRREB_VERSION	1
+#define TRREB_NFT	1		/* kind: compiled by trre */
+#define TRREB_DFT	2		/* kind: compiled by trre_dft */
+#define TRREB_ALIGN	8
+
+struct trreb_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t kind;
+    uint32_t inst_size;		/* sizeof(struct inst) */
+    uint32_t n_inst, n_sets, n_maps;
+    uint32_t flags;		/* kind specific */
+    uint64_t inst_off, sets_off, maps_off;
+    uint64_t ext_off;		/* kind specific section, 0 if none */
+};
 
+void trreb_pad(FILE *fp) {
+    static const char pad[TRREB_ALIGN];
+    long off = ftell(fp);
 
-// Function to dynamically resize the output array
-char* resize_output(char *output, size_t *capacity) {
-    *capacity *= 2; // Double the capacity
-    output = realloc(output, *capacity * sizeof(char));
-    if (!output) {
-        fprintf(stderr, "error: memory reallocation failed for output\n");
-        exit(EXIT_FAILURE);
+    if (off < 0 || (off % TRREB_ALIGN && fwrite(pad, 1, TRREB_ALIGN - off % TRREB_ALIGN, fp) == 0)) {
+	fprintf(stderr, "error: can not write the compiled file\n");
+	exit(EXIT_FAILURE);
     }
-    return output;
 }
 
-// Main NFT traversal function (depth-first)
-ssize_t infer_backtrack(struct nstate *start, char *input, struct sstack *stack, enum infer_mode mode) {
-    size_t i = 0, o = 0;
-    struct nstate *s = start;
+/* write a section padded to TRREB_ALIGN; returns its offset */
+uint64_t trreb_write(FILE *fp, const void *p, size_t size) {
+    long off = ftell(fp);
 
-    while (stack->n_items || s) {
-        if (!s) {
-	    spop(stack, &s, &i, &o);
-            if (!s) {
-                continue;
-            }
-        }
-        // Resize output array if necessary
-        if (o >= output_capacity - 1) {
-            output = resize_output(output, &output_capacity);
-        }
+    if (off < 0 || (size && fwrite(p, 1, size, fp) != size)) {
+	fprintf(stderr, "error: can not write the compiled file\n");
+	exit(EXIT_FAILURE);
+    }
+    trreb_pad(fp);
+    return (uint64_t)off;
+}
 
-        switch (s->type) {
-            case CONS:
-                if (input[i] != '\0' && s->val == input[i]) {
-                    i++;
-                    s = s->nexta;
-                } else {
-                    s = NULL;
-                }
-                break;
-            case PROD:
-                output[o++] = s->val;
-                s = s->nexta;
-                break;
-            case SPLIT:
-                spush(stack, s->nexta, i, o);
-                s = s->nextb;
-                break;
-            case SPLITNG:
-                spush(stack, s->nextb, i, o);
-                s = s->nexta;
-                break;
-            case JOIN:
-                s = s->nexta;
-                break;
-            case FINAL:
-            	if (mode == MATCH) {
-		    if (input[i] == '\0') {
-			output[o] = '\0'; // Null-terminate the output string
-			fputs(output, stdout);
-			fputs("\n", stdout);
-		    }
-		    s = NULL;
-		} else {
-		    output[o] = '\0'; // Null-terminate the output string
-		    fputs(output, stdout);
-		    return i;
-		}
-                break;
-            default:
-                fprintf(stderr, "error: unknown state type\n");
-                exit(1);
-        }
+/* write the header and the program; the header is rewritten once
+ * the offsets are known */
+void trreb_save_prog(FILE *fp, struct prog *prog, struct trreb_header *h, uint32_t kind) {
+    struct inst t;
+
+    memset(h, 0, sizeof *h);
+    memcpy(h->magic, TRREB_MAGIC, 4);
+    h->version = TRREB_VERSION;
+    h->kind = kind;
+    h->inst_size = sizeof(struct inst);
+    h->n_inst = prog->n;
+    h->n_sets = prog->n_sets;
+    h->n_maps = prog->n_maps;
+    trreb_write(fp, h, sizeof *h);
+
+    h->inst_off = ftell(fp);
+    for (uint32_t i = 0; i < prog->n; i++) {
+	memset(&t, 0, sizeof t);		/* no garbage in the padding */
+	t.op = prog->inst[i].op;
+	t.val = prog->inst[i].val;
+	t.x = prog->inst[i].x;
+	t.y = prog->inst[i].y;
+	if (fwrite(&t, sizeof t, 1, fp) != 1) {
+	    fprintf(stderr, "error: can not write the compiled file\n");
+	    exit(EXIT_FAILURE);
+	}
     }
-    return -1;
+    trreb_pad(fp);
+    h->sets_off = trreb_write(fp, prog->sets, prog->n_sets * 32);
+    h->maps_off = trreb_write(fp, prog->maps, prog->n_maps * MAP_SIZE);
 }
 
-int stack_lookup(struct nstate **b, struct nstate **e, struct nstate *v) {
-    while(b != e)
-	if (v == *(--e)) return 1;
-    return 0;
+void trreb_finish(FILE *fp, struct trreb_header *h, char *fn) {
+    if (fseek(fp, 0, SEEK_SET) != 0 || fwrite(h, sizeof *h, 1, fp) != 1 || fclose(fp) != 0) {
+	fprintf(stderr, "error: can not write %s\n", fn);
+	exit(EXIT_FAILURE);
+    }
 }
 
+FILE * trreb_create(char *fn) {
+    FILE *fp = fopen(fn, "wb");
 
+    if (fp == NULL) {
+	fprintf(stderr, "error: can not open file %s\n", fn);
+	exit(EXIT_FAILURE);
+    }
+    return fp;
+}
 
-void plot_nft(struct nstate *start) {
-    struct nstate *stack[1024];
-    struct nstate *visited[1024];
+/* check that [off, off + size) lies in the file */
+void * trreb_at(char *base, size_t len, uint64_t off, uint64_t size, char *fn) {
+    if (off > len || size > len - off || off % TRREB_ALIGN) {
+	fprintf(stderr, "error: %s is corrupted\n", fn);
+	exit(EXIT_FAILURE);
+    }
+    return base + off;
+}
 
-    struct nstate **sp = stack;
-    struct nstate **vp = visited;
-    struct nstate *s = start;
-    char l,m;
+/* map a compiled file privately, so that the tables stay writable */
+struct trreb_header * trreb_map(char *fn, uint32_t kind, size_t *len) {
+    struct trreb_header *h;
+    struct stat st;
+    void *base;
+    int fd;
+
+    fd = open(fn, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+	fprintf(stderr, "error: can not open file %s\n", fn);
+	exit(EXIT_FAILURE);
+    }
+    if ((size_t)st.st_size < sizeof *h) {
+	fprintf(stderr, "error: %s is not a compiled trre file\n", fn);
+	exit(EXIT_FAILURE);
+    }
+    base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+	fprintf(stderr, "error: can not map file %s\n", fn);
+	exit(EXIT_FAILURE);
+    }
+    h = base;
+    if (memcmp(h->magic, TRREB_MAGIC, 4) != 0) {
+	fprintf(stderr, "error: %s is not a compiled trre file\n", fn);
+	exit(EXIT_FAILURE);
+    }
+    if (h->version != TRREB_VERSION || h->inst_size != sizeof(struct inst)) {
+	fprintf(stderr, "error: %s was compiled by another version\n", fn);
+	exit(EXIT_FAILURE);
+    }
+    if (h->kind != kind) {
+	fprintf(stderr, "error: %s was compiled by %s\n", fn, h->kind == TRREB_DFT ? "trre_dft" : "trre");
+	exit(EXIT_FAILURE);
+    }
+    *len = st.st_size;
+    return h;
+}
+
+/* the program points into the mapping */
+struct prog * trreb_load_prog(struct trreb_header *h, size_t len, char *fn) {
+    struct prog *prog = arena_alloc(&arena, sizeof(struct prog));
+    char *base = (char*)h;
+
+    if (h->n_inst == 0) {		/* no start instruction */
+	fprintf(stderr, "error: %s is corrupted\n", fn);
+	exit(EXIT_FAILURE);
+    }
+    prog->n = h->n_inst;
+    prog->n_sets = h->n_sets;
+    prog->n_maps = h->n_maps;
+    prog->inst = trreb_at(base, len, h->inst_off, (uint64_t)h->n_inst * sizeof(struct inst), fn);
+    prog->sets = trreb_at(base, len, h->sets_off, (uint64_t)h->n_sets * 32, fn);
+    prog->maps = trreb_at(base, len, h->maps_off, (uint64_t)h->n_maps * MAP_SIZE, fn);
+
+    for (uint32_t i = 0; i < prog->n; i++) {
+	struct inst *s = &prog->inst[i];
+	if (s->op > MAP || (s->x != NIL && s->x >= prog->n)
+	    || (s->op == CONS_CLASS && s->y >= prog->n_sets)
+	    || (s->op == MAP && s->y >= prog->n_maps)
+	    || (s->op != CONS_CLASS && s->op != MAP && s->y != NIL && s->y >= prog->n)) {
+	    fprintf(stderr, "error: %s is corrupted\n", fn);
+	    exit(EXIT_FAILURE);
+	}
+    }
+    return prog;
+}
+
+/* Scan acceleration. If the expression can not match the empty
+ * string, a match can only start at a byte of its first set and, if
+ * every match starts with the same bytes, at an occurrence of that
+ * literal prefix. The scan loop copies the positions in between in
+ * one write instead of running the engine on each of them. The
+ * analysis runs on the program, so precompiled files get it too. */
+
+#define PREFIX_MAX	64
+
+struct skip {
+    int enabled;		/* 0 if nothing can be skipped */
+    uint8_t first[32];		/* bytes a match can start with */
+    int n_first;
+    unsigned char prefix[PREFIX_MAX];
+    size_t prefix_len;
+};
+
+/* push an unseen instruction on a walk stack */
+void walk_push(uint32_t *stack, uint32_t *sp, uint8_t *seen, uint32_t pc) {
+    if (pc == NIL || seen[pc])
+	return;
+    seen[pc] = 1;
+    stack[(*sp)++] = pc;
+}
+
+/* the consuming instructions reachable from pc by epsilon moves;
+ * returns 1 if a final state is reachable too. The walk has its own
+ * stack of prog->n instructions: a rules file chains every rule off
+ * one instruction. */
+int skip_closure(struct prog *prog, uint32_t pc, uint8_t *seen, uint32_t *list, uint32_t *n, uint32_t *stack) {
+    struct inst *s;
+    uint32_t sp = 0;
+    int final = 0;
+
+    walk_push(stack, &sp, seen, pc);
+
+    while (sp) {
+	pc = stack[--sp];
+	s = &prog->inst[pc];
+	switch (s->op) {
+	    case SPLIT:
+	    case SPLITNG:
+		walk_push(stack, &sp, seen, s->y);
+		walk_push(stack, &sp, seen, s->x);
+		break;
+	    case JOIN:
+	    case PROD:
+		walk_push(stack, &sp, seen, s->x);
+		break;
+	    case CONS:
+	    case CONS_CLASS:
+	    case MAP:
+		list[(*n)++] = pc;
+		break;
+	    default:		/* FINAL */
+		final = 1;
+	}
+    }
+    return final;
+}
+
+/* clear the marks skip_closure() left from pc, so that a walk costs
+ * the instructions it reached and not prog->n */
+void skip_unmark(struct prog *prog, uint32_t pc, uint8_t *seen, uint32_t *stack) {
+    struct inst *s;
+    uint32_t sp = 0;
+
+    if (pc == NIL || !seen[pc])
+	return;
+    seen[pc] = 0;
+    stack[sp++] = pc;
+    while (sp) {
+	s = &prog->inst[stack[--sp]];
+	if (s->op == CONS || s->op == CONS_CLASS || s->op == MAP || s->op == FINAL)
+	    continue;
+	if ((s->op == SPLIT || s->op == SPLITNG) && s->y != NIL && seen[s->y]) {
+	    seen[s->y] = 0;
+	    stack[sp++] = s->y;
+	}
+	if (s->x != NIL && seen[s->x]) {
+	    seen[s->x] = 0;
+	    stack[sp++] = s->x;
+	}
+    }
+}
+
+/* the bytes accepted by a consuming instruction */
+void skip_accept(struct prog *prog, struct inst *s, uint8_t *set) {
+    if (s->op == CONS)
+	BIT_SET(set, s->val);
+    else
+	for (int k = 0; k < 32; k++)
+	    set[k] |= s->op == CONS_CLASS ? prog->sets[32 * s->y + k] : prog->maps[MAP_SIZE * s->y + k];
+}
+
+void skip_analyze(struct prog *prog, struct skip *sk) {
+    uint8_t *seen, set[32];
+    uint32_t *list, *stack, n = 0, m;
+    int final, n_set, b = 0;
+
+    memset(sk, 0, sizeof *sk);
+    seen = calloc(prog->n, sizeof(uint8_t));
+    list = malloc(2 * prog->n * sizeof(uint32_t));
+    stack = malloc(prog->n * sizeof(uint32_t));
+    if (!seen || !list || !stack) {
+	fprintf(stderr, "error: memory allocation failed\n");
+	exit(EXIT_FAILURE);
+    }
+
+    final = skip_closure(prog, 0, seen, list, &n, stack);
+    for (uint32_t k = 0; k < n; k++)
+	skip_accept(prog, &prog->inst[list[k]], sk->first);
+    for (int c = 0; c < 256; c++)
+	sk->n_first += BIT_TEST(sk->first, c) ? 1 : 0;
+    sk->enabled = !final && sk->n_first < 256;
+
+    /* extend the prefix while all the threads consume the same byte */
+    while (sk->enabled && !final && n && sk->prefix_len < PREFIX_MAX) {
+	memset(set, 0, sizeof set);
+	for (uint32_t k = 0; k < n; k++)
+	    skip_accept(prog, &prog->inst[list[k]], set);
+	n_set = 0;
+	for (int c = 0; c < 256; c++)
+	    if (BIT_TEST(set, c)) {
+		n_set++;
+		b = c;
+	    }
+	if (n_set != 1)
+	    break;
+	sk->prefix[sk->prefix_len++] = b;
+
+	memset(seen, 0, prog->n);
+	m = n;
+	n = 0;
+	final = 0;
+	for (uint32_t k = 0; k < m; k++)	/* the list is consumed in place */
+	    final |= skip_closure(prog, prog->inst[list[k]].x, seen, list + m, &n, stack);
+	memmove(list, list + m, n * sizeof(uint32_t));
+    }
+
+    free(seen);
+    free(list);
+    free(stack);
+}
+
+/* the first position at or after p where a match can start */
+char * skip_next(struct skip *sk, char *p, char *end) {
+    char *q;
+
+    if (sk->prefix_len > 1) {
+	q = memmem(p, end - p, sk->prefix, sk->prefix_len);
+	return q ? q : end;
+    }
+    if (sk->prefix_len == 1) {
+	q = memchr(p, sk->prefix[0], end - p);
+	return q ? q : end;
+    }
+    while (p < end && !BIT_TEST(sk->first, *p))
+	p++;
+    return p;
+}
+
+/* Line prefilter. Every match of the expression consumes a literal,
+ * the longest run of single bytes that lies on all the paths to the
+ * final state, and between min_len and max_len bytes. A line without
+ * the literal, or too short, holds no match and is copied as is; in
+ * the match mode a line must also fit max_len. The single bytes on
+ * all the paths are the consuming dominators of the final state. */
+
+#define LITERAL_MAX	64
+#define LEN_INF		SIZE_MAX
+
+struct filter {
+    unsigned char lit[LITERAL_MAX];
+    size_t lit_len;
+    size_t min_len, max_len;
+};
+
+/* the single byte accepted by a consuming instruction, -1 if more */
+int filter_byte(struct prog *prog, struct inst *s) {
+    uint8_t set[32];
+    int n = 0, b = -1;
+
+    memset(set, 0, sizeof set);
+    skip_accept(prog, s, set);
+    for (int c = 0; c < 256; c++)
+	if (BIT_TEST(set, c)) {
+	    n++;
+	    b = c;
+	}
+    return n == 1 ? b : -1;
+}
+
+/* depth-first numbering from the start for the dominators, on the
+ * explicit stack; while an instruction is on it, num holds the
+ * number of its successors entered so far */
+void filter_dfs(struct prog *prog, uint32_t *num, uint32_t *order, uint32_t *n, uint32_t *stack) {
+    uint32_t sp = 0, pc, w;
+    struct inst *s;
+
+    num[0] = 0;
+    stack[sp++] = 0;
+    while (sp) {
+	pc = stack[sp - 1];
+	s = &prog->inst[pc];
+	if (num[pc] < 2) {
+	    w = num[pc]++ ? ((s->op == SPLIT || s->op == SPLITNG) ? s->y : NIL) : s->x;
+	    if (w != NIL && num[w] == NIL) {
+		num[w] = 0;
+		stack[sp++] = w;
+	    }
+	    continue;
+	}
+	sp--;
+	order[*n] = pc;		/* postorder */
+	num[pc] = (*n)++;
+    }
+}
+
+uint32_t filter_intersect(uint32_t *idom, uint32_t *num, uint32_t a, uint32_t b) {
+    while (a != b) {
+	while (num[a] < num[b])
+	    a = idom[a];
+	while (num[b] < num[a])
+	    b = idom[b];
+    }
+    return a;
+}
+
+/* Tarjan over the instructions; each component gets the longest
+ * consumption to the final state, LEN_INF if unbounded, and
+ * LEN_INF - 1 when it can not reach the final state */
+struct fscc {
+    uint32_t *index, *low, *stack, *comp;
+    uint32_t *call;		/* the instructions being visited */
+    uint8_t *edge;		/* successors of each entered so far */
+    size_t *len;
+    uint32_t sp, n_index, n_comp;
+};
+
+/* pop the component of the root v and combine the exits of its members */
+void filter_scc_close(struct prog *prog, struct fscc *g, uint32_t v) {
+    struct inst *s;
+    uint32_t succ[2], w, top = g->sp;
+    size_t len = LEN_INF - 1, l;	/* LEN_INF - 1: can not reach the final */
+    int cyclic, consumes = 0;
+
+    do
+	g->comp[g->stack[--g->sp]] = g->n_comp;
+    while (g->stack[g->sp] != v);
+    cyclic = top - g->sp > 1;
+    for (uint32_t m = g->sp; m < top; m++) {
+	s = &prog->inst[g->stack[m]];
+	if (s->op == CONS || s->op == CONS_CLASS || s->op == MAP)
+	    consumes = 1;
+	if (s->op == FINAL && len == LEN_INF - 1)
+	    len = 0;
+	succ[0] = s->x;
+	succ[1] = (s->op == SPLIT || s->op == SPLITNG) ? s->y : NIL;
+	for (int k = 0; k < 2; k++) {
+	    if ((w = succ[k]) == NIL)
+		continue;
+	    if (g->comp[w] == g->n_comp) {
+		cyclic = 1;
+		continue;
+	    }
+	    l = g->len[g->comp[w]];
+	    if (l == LEN_INF - 1)
+		continue;
+	    if (len == LEN_INF - 1 || l > len)
+		len = l;
+	}
+    }
+    if (len != LEN_INF - 1 && len != LEN_INF && consumes)
+	len = cyclic ? LEN_INF : len + 1;
+    g->len[g->n_comp++] = len;
+}
+
+void filter_scc_enter(struct fscc *g, uint32_t v) {
+    g->index[v] = g->low[v] = g->n_index++;
+    g->stack[g->sp++] = v;
+    g->edge[v] = 0;
+}
+
+/* Tarjan from v with the call stack in g->call */
+void filter_scc(struct prog *prog, struct fscc *g, uint32_t v) {
+    struct inst *s;
+    uint32_t depth = 0, w, u;
+
+    filter_scc_enter(g, v);
+    g->call[depth++] = v;
+    while (depth) {
+	v = g->call[depth - 1];
+	s = &prog->inst[v];
+	if (g->edge[v] < 2) {
+	    w = g->edge[v]++ ? ((s->op == SPLIT || s->op == SPLITNG) ? s->y : NIL) : s->x;
+	    if (w == NIL)
+		continue;
+	    if (g->index[w] == NIL) {
+		filter_scc_enter(g, w);
+		g->call[depth++] = w;
+	    } else if (g->comp[w] == NIL && g->index[w] < g->low[v])
+		g->low[v] = g->index[w];
+	    continue;
+	}
+	depth--;
+	if (depth && g->low[v] < g->low[u = g->call[depth - 1]])
+	    g->low[u] = g->low[v];
+	if (g->low[v] == g->index[v])
+	    filter_scc_close(prog, g, v);
+    }
+}
+
+void filter_analyze(struct prog *prog, struct filter *f) {
+    uint32_t *num, *order, *idom, *dist, *queue, *list, *seen_list, *pred_off, *preds;
+    uint32_t n = 0, final = NIL, head, tail, pc, w, m, cnt;
+    uint8_t *seen, set[32];
+    struct inst *s;
+    struct fscc g;
+    int changed, b, at_final;
+    size_t len;
+
+    memset(f, 0, sizeof *f);
+    f->max_len = LEN_INF;
+
+    num = malloc(prog->n * sizeof(uint32_t));
+    order = malloc(prog->n * sizeof(uint32_t));
+    idom = malloc(prog->n * sizeof(uint32_t));
+    dist = malloc(prog->n * sizeof(uint32_t));
+    queue = malloc(2 * prog->n * sizeof(uint32_t));
+    list = malloc(2 * prog->n * sizeof(uint32_t));
+    seen = calloc(prog->n, sizeof(uint8_t));
+    if (!num || !order || !idom || !dist || !queue || !list || !seen) {
+	fprintf(stderr, "error: memory allocation failed\n");
+	exit(EXIT_FAILURE);
+    }
+
+    /* min_len: 0-1 breadth-first search, consuming edges cost 1 */
+    for (pc = 0; pc < prog->n; pc++)
+	dist[pc] = NIL;
+    head = tail = prog->n;
+    queue[tail++] = 0;
+    dist[0] = 0;
+    while (head < tail) {
+	pc = queue[head++];
+	s = &prog->inst[pc];
+	if (s->op == FINAL) {
+	    final = pc;
+	    continue;
+	}
+	for (int k = 0; k < 2; k++) {
+	    w = k ? ((s->op == SPLIT || s->op == SPLITNG) ? s->y : NIL) : s->x;
+	    cnt = (s->op == CONS || s->op == CONS_CLASS || s->op == MAP);
+	    if (w == NIL || dist[w] <= dist[pc] + cnt)
+		continue;
+	    dist[w] = dist[pc] + cnt;
+	    if (cnt)
+		queue[tail++] = w;
+	    else
+		queue[--head] = w;
+	}
+    }
+    if (final == NIL)
+	goto done;
+    f->min_len = dist[final];
+
+    /* max_len: the longest path over the components */
+    g.index = num;
+    g.low = idom;
+    g.stack = order;
+    g.comp = dist;
+    g.call = list;
+    g.edge = seen;
+    g.len = malloc(prog->n * sizeof(size_t));
+    if (g.len == NULL) {
+	fprintf(stderr, "error: memory allocation failed\n");
+	exit(EXIT_FAILURE);
+    }
+    for (pc = 0; pc < prog->n; pc++)
+	num[pc] = dist[pc] = NIL;
+    g.sp = g.n_index = g.n_comp = 0;
+    filter_scc(prog, &g, 0);
+    len = g.len[dist[0]];
+    f->max_len = len == LEN_INF - 1 ? 0 : len;
+    free(g.len);
+
+    /* predecessors, in place of the dist and queue arrays */
+    pred_off = dist;
+    preds = queue;
+    memset(pred_off, 0, prog->n * sizeof(uint32_t));
+    for (pc = 0; pc < prog->n; pc++) {
+	s = &prog->inst[pc];
+	if (s->x != NIL)
+	    pred_off[s->x]++;
+	if ((s->op == SPLIT || s->op == SPLITNG) && s->y != NIL)
+	    pred_off[s->y]++;
+    }
+    for (pc = 0, cnt = 0; pc < prog->n; pc++) {
+	cnt += pred_off[pc];
+	pred_off[pc] = cnt;		/* the end, moved back below */
+    }
+    for (pc = 0; pc < prog->n; pc++) {
+	s = &prog->inst[pc];
+	if (s->x != NIL)
+	    preds[--pred_off[s->x]] = pc;
+	if ((s->op == SPLIT || s->op == SPLITNG) && s->y != NIL)
+	    preds[--pred_off[s->y]] = pc;
+    }
+
+    /* dominators (Cooper, Harvey, Kennedy) over the postorder */
+    for (pc = 0; pc < prog->n; pc++)
+	num[pc] = idom[pc] = NIL;
+    filter_dfs(prog, num, order, &n, list);
+    idom[0] = 0;
+    do {
+	changed = 0;
+	for (uint32_t i = n; i-- > 0; ) {	/* reverse postorder */
+	    uint32_t v = order[i], d = NIL;
+	    uint32_t end = v + 1 < prog->n ? pred_off[v + 1] : cnt;
+	    if (v == 0)
+		continue;
+	    for (uint32_t k = pred_off[v]; k < end; k++)
+		if (idom[preds[k]] != NIL)
+		    d = d == NIL ? preds[k] : filter_intersect(idom, num, preds[k], d);
+	    if (d != idom[v]) {
+		idom[v] = d;
+		changed = 1;
+	    }
+	}
+    } while (changed);
+
+    /* the dominators of the final state, from the start on */
+    for (pc = idom[final], n = 0; ; pc = idom[pc]) {
+	order[n++] = pc;
+	if (pc == 0)
+	    break;
+    }
+
+    /* extend each single byte dominator into a literal; the closures
+     * walk on the dist array, the predecessors are done with. A
+     * dominator that a literal reached as its only thread is marked in
+     * num: its own literal is a suffix of that one. */
+    memset(seen, 0, prog->n);
+    memset(num, 0, prog->n * sizeof(uint32_t));
+    while (n--) {
+	pc = order[n];
+	s = &prog->inst[pc];
+	if (!num[pc] && (s->op == CONS || s->op == CONS_CLASS || s->op == MAP) && (b = filter_byte(prog, s)) >= 0) {
+	    unsigned char lit[LITERAL_MAX];
+	    size_t lit_len = 0;
+
+	    lit[lit_len++] = b;
+	    list[0] = pc;
+	    m = 1;
+	    seen_list = list + prog->n;
+	    while (lit_len < LITERAL_MAX) {
+		cnt = 0;
+		at_final = 0;
+		for (uint32_t k = 0; k < m; k++)
+		    at_final |= skip_closure(prog, prog->inst[list[k]].x, seen, seen_list, &cnt, dist);
+		for (uint32_t k = 0; k < m; k++)
+		    skip_unmark(prog, prog->inst[list[k]].x, seen, dist);
+		if (at_final || cnt == 0)
+		    break;
+		memset(set, 0, sizeof set);
+		for (uint32_t k = 0; k < cnt; k++)
+		    skip_accept(prog, &prog->inst[seen_list[k]], set);
+		b = -1;
+		for (int c = 0; c < 256; c++)
+		    if (BIT_TEST(set, c))
+			b = b == -1 ? c : -2;
+		if (b < 0)
+		    break;
+		lit[lit_len++] = b;
+		memmove(list, seen_list, cnt * sizeof(uint32_t));
+		m = cnt;
+		if (m == 1)
+		    num[list[0]] = 1;
+	    }
+	    if (lit_len >= f->lit_len) {	/* on a tie, the later one */
+		memcpy(f->lit, lit, lit_len);
+		f->lit_len = lit_len;
+	    }
+	}
+    }
+
+done:
+    free(num);
+    free(order);
+    free(idom);
+    free(dist);
+    free(queue);
+    free(list);
+    free(seen);
+}
+
+/* 0 if the line can hold no match; in the match mode the whole line
+ * has to be one */
+int filter_pass(struct filter *f, char *line, size_t len, int whole) {
+    if (len < f->min_len || (whole && len > f->max_len))
+	return 0;
+    return f->lit_len == 0 || memmem(line, len, f->lit, f->lit_len) != NULL;
+}
+
+void filter_print(struct filter *f) {
+    fprintf(stderr, "filter: literal \"");
+    for (size_t i = 0; i < f->lit_len; i++)
+	fprintf(stderr, f->lit[i] >= 0x20 && f->lit[i] < 0x7f ? "%c" : "\\x%02x", f->lit[i]);
+    fprintf(stderr, "\", length %zu..", f->min_len);
+    if (f->max_len == LEN_INF)
+	fprintf(stderr, "inf\n");
+    else
+	fprintf(stderr, "%zu\n", f->max_len);
+}
+
+
+struct sitem {
+    uint32_t pc;
+    size_t i;
+    size_t o;
+};
+
+struct sstack {
+    struct sitem *items;
+    size_t n_items;
+    size_t capacity;
+};
+
+struct sstack * screate(size_t capacity) {
+    struct sstack *stack;
+
+    stack = (struct sstack*)malloc(sizeof(struct sstack));
+    stack->items = malloc(capacity * sizeof(struct sitem));
+    if (stack == NULL || stack->items == NULL) {
+	fprintf(stderr, "error: stack memory allocation failed\n");
+	exit(EXIT_FAILURE);
+    }
+    stack->n_items = 0;
+    stack->capacity = capacity;
+    return stack;
+}
+
+void sresize(struct sstack *stack, size_t new_capacity) {
+    stack->items = realloc(stack->items, new_capacity * sizeof(struct sitem));
+    if (stack->items == NULL) {
+	fprintf(stderr, "error: stack memory re-allocation failed\n");
+	exit(EXIT_FAILURE);
+    }
+    stack->capacity = new_capacity;
+}
+
+void spush(struct sstack *stack, uint32_t pc, size_t i, size_t o) {
+    struct sitem *it;
+    if (stack->n_items == stack->capacity) {
+        if (stack->capacity * 2 > STACK_MAX_CAPACITY) {
+	    fprintf(stderr, "error: stack max capacity reached\n");
+	    exit(EXIT_FAILURE);
+	}
+	sresize(stack, stack->capacity * 2);
+    }
+    it = &stack->items[stack->n_items];
+    it->pc = pc;
+    it->i = i;
+    it->o = o;
+
+    stack->n_items++;
+}
+
+size_t spop(struct sstack *stack, uint32_t *pc, size_t *i, size_t *o) {
+    struct sitem *it;
+    if (stack->n_items == 0) {
+	fprintf(stderr, "error: stack underflow\n");
+        exit(EXIT_FAILURE);
+    }
+    stack->n_items--;
+    it = &stack->items[stack->n_items];
+    *pc = it->pc;
+    *i = it->i;
+    *o = it->o;
+
+    return stack->n_items;
+}
+
+
+// Function to dynamically resize the output array
+char* resize_output(char *output, size_t *capacity) {
+    *capacity *= 2; // Double the capacity
+    output = realloc(output, *capacity * sizeof(char));
+    if (!output) {
+        fprintf(stderr, "error: memory reallocation failed for output\n");
+        exit(EXIT_FAILURE);
+    }
+    return output;
+}
+
+// Main NFT traversal function (depth-first)
+ssize_t infer_backtrack(struct prog *prog, char *input, size_t n, struct sstack *stack, enum infer_mode mode) {
+    size_t i = 0, o = 0;
+    uint32_t pc = 0;
+    struct inst *s;
+
+    while (stack->n_items || pc != NIL) {
+        if (pc == NIL) {
+	    spop(stack, &pc, &i, &o);
+            if (pc == NIL) {
+                continue;
+            }
+        }
+        // Resize output array if necessary
+        if (o >= output_capacity - 1) {
+            output = resize_output(output, &output_capacity);
+        }
+
+        s = &prog->inst[pc];
+        switch (s->op) {
+            case CONS:
+                if (i < n && s->val == (unsigned char)input[i]) {
+                    i++;
+                    pc = s->x;
+                } else {
+                    pc = NIL;
+                }
+                break;
+            case CONS_CLASS:
+                if (i < n && BIT_TEST(prog->sets + 32 * s->y, input[i])) {
+                    if (s->val)
+                        output[o++] = input[i];
+                    i++;
+                    pc = s->x;
+                } else {
+                    pc = NIL;
+                }
+                break;
+            case MAP:
+                if (i < n && BIT_TEST(prog->maps + MAP_SIZE * s->y, input[i])) {
+                    output[o++] = prog->maps[MAP_SIZE * s->y + 32 + (unsigned char)input[i]];
+                    i++;
+                    pc = s->x;
+                } else {
+                    pc = NIL;
+                }
+                break;
+            case PROD:
+                output[o++] = s->val;
+                pc = s->x;
+                break;
+            case SPLIT:
+                spush(stack, s->x, i, o);
+                pc = s->y;
+                break;
+            case SPLITNG:
+                spush(stack, s->y, i, o);
+                pc = s->x;
+                break;
+            case JOIN:
+                pc = s->x;
+                break;
+            case FINAL:
+            	if (mode == MATCH) {
+		    if (i == n) {
+			out_write(output, o);
+			out_newline();
+		    }
+		    pc = NIL;
+		} else {
+		    out_write(output, o);
+		    return i;
+		}
+                break;
+            default:
+                fprintf(stderr, "error: unknown state type\n");
+                exit(1);
+        }
+    }
+    return -1;
+}
+
+void plot_nft(struct prog *prog) {
+    struct inst *s;
+    char l,m;
 
     printf("digraph G {\n\tsplines=true; rankdir=LR;\n");
 
-    push(sp, s);
-    while (sp != stack) {
-        s = pop(sp);
-        push(vp, s);
+    for (uint32_t pc = 0; pc < prog->n; pc++) {
+        s = &prog->inst[pc];
 
-        if (s->type == FINAL)
-            printf("\t\"%p\" [peripheries=2, label=\"\"];\n", (void*)s);
+        if (s->op == FINAL)
+            printf("\t\"%u\" [peripheries=2, label=\"\"];\n", pc);
         else {
-            switch(s->type) {
+            switch(s->op) {
 		case PROD: 	l=s->val; m='+'; break;
 		case CONS: 	l=s->val; m='-'; break;
+		case CONS_CLASS: l='C'; m=s->val ? '+' : '-'; break;
+		case MAP:	l='M'; m='+'; break;
 		case SPLITNG: 	l='S'; m='n'; break;
 		case SPLIT: 	l='S'; m=' '; break;
 		case JOIN: 	l='J'; m=' '; break;
 		default:	l=' '; m=' ';break;
 	    }
-            printf("\t\"%p\" [label=\"%c%c\"];\n", (void*)s, l, m);
+            printf("\t\"%u\" [label=\"%c%c\"];\n", pc, l, m);
         }
 
-        if (s->nexta) {
-            printf("\t\"%p\" -> \"%p\";\n", (void*)s, (void*)s->nexta);
-            if (!stack_lookup(visited, vp, s->nexta))
-                push(sp, s->nexta);
-        }
+        if (s->x != NIL)
+            printf("\t\"%u\" -> \"%u\";\n", pc, s->x);
 
-        if (s->nextb) {
-            printf("\t\"%p\" -> \"%p\" [label=\"%c\"];\n", (void*)s, (void*)s->nextb, '*');
-            if (!stack_lookup(visited, vp, s->nextb))
-                push(sp, s->nextb);
-        }
+        if (s->y != NIL && s->op != CONS_CLASS && s->op != MAP)
+            printf("\t\"%u\" -> \"%u\" [label=\"%c\"];\n", pc, s->y, '*');
     }
     printf("}\n");
 }
 
-struct str_item {
-    unsigned char c;
-    struct str_item *next;
+/* Pending outputs are byte strings held as spans of an arena. Appending
+ * to a span that ends at the top of the arena grows it in place; any
+ * other append copies the span first. Threads forked in nft_step_ share
+ * their span until they diverge, so common prefixes are stored once. */
+
+struct str {
+    unsigned char *p;
+    uint32_t len;
+};
+
+static __thread struct arena scratch;	/* outputs of the current nft_step */
+
+struct str str_append(struct arena *a, struct str s, unsigned char c) {
+    unsigned char *p;
+
+    if (s.len && arena_extend(a, s.p + s.len, 1)) {
+	s.p[s.len++] = c;
+	return s;
+    }
+    p = arena_bytes(a, s.len + 1);
+    if (s.len)
+	memcpy(p, s.p, s.len);
+    p[s.len++] = c;
+    s.p = p;
+    return s;
+}
+
+struct str str_dup(struct arena *a, struct str s) {
+    struct str d;
+
+    d.len = s.len;
+    d.p = s.len ? arena_bytes(a, s.len) : NULL;
+    if (s.len)
+	memcpy(d.p, s.p, s.len);
+    return d;
+}
+
+/* a copy of n strings and their bytes, NULL if n is 0 */
+struct str * strs_dup(struct arena *a, struct str *s, uint32_t n) {
+    struct str *d;
+
+    if (n == 0)
+	return NULL;
+    d = arena_alloc(a, n * sizeof(struct str));
+    for (uint32_t k = 0; k < n; k++)
+	d[k] = str_dup(a, s[k]);
+    return d;
+}
+
+void str_print(struct str s) {
+    out_write(s.p, s.len);
+}
+
+/* lexicographic comparison */
+int str_cmp(struct str a, struct str b) {
+    uint32_t n = a.len < b.len ? a.len : b.len;
+    int sign = n ? memcmp(a.p, b.p, n) : 0;
+
+    if (sign != 0)
+	return sign < 0 ? -1 : 1;
+    if (a.len != b.len)
+	return a.len < b.len ? -1 : 1;
+    return 0;
+}
+
+
+
+struct slitem {
+    uint32_t pc;
+    struct str suffix;
+};
+
+struct slist {
+    struct slitem *items;
+    uint32_t n;
+    uint32_t capacity;		/* 0 for the lists owned by DFT states */
+};
+
+void slist_append(struct slist *sl, uint32_t pc, struct str suffix) {
+    if (sl->n == sl->capacity) {
+	sl->capacity = sl->capacity ? sl->capacity * 2 : 16;
+	sl->items = realloc(sl->items, sl->capacity * sizeof(struct slitem));
+	if (sl->items == NULL) {
+	    fprintf(stderr, "error: state list re-allocation failed\n");
+	    exit(EXIT_FAILURE);
+	}
+    }
+    sl->items[sl->n].pc = pc;
+    sl->items[sl->n].suffix = suffix;
+    sl->n++;
+}
+
+
+/* the step argument of the final states closure; not a byte, as NUL
+ * may occur in the input */
+#define STEP_FINAL	256
+
+/* per-instruction generation marks; every instruction is entered at
+ * most once per nft_step, so epsilon cycles are cut and the first
+ * (highest priority) thread to reach a state wins */
+static __thread unsigned *visited;
+static __thread unsigned visit_gen;
+
+/* -a: every output of the match mode, not the first one */
+static int all;
+
+/* With -a the threads are not cut at the first visit of a state but
+ * at the first visit with the same pending output: the later ones
+ * have the same future, so the first one stands for them and every
+ * distinct output stays once, in the order it was first reached.
+ * visited then marks the states on the path only, to cut the epsilon
+ * cycles. The (state, output) pairs of one nft_step are kept in an
+ * open addressing table, cleared by a generation like visited. */
+
+struct tslot {
+    uint32_t pc, gen, hash;
+    struct str o;
+};
+
+static __thread struct tslot *tset;
+static __thread uint32_t tset_capacity, tset_n, tset_gen;
+
+/* the walk of nft_step_all_; leave entries take a state off the path
+ * once everything entered from it is done */
+struct twalk {
+    uint32_t pc, oh;
+    struct str o;
+    int leave;
+};
+
+static __thread struct twalk *twalk;
+static __thread uint32_t twalk_capacity;
+
+/* FNV-1a of the output; nft_step_ extends it byte by byte along
+ * with the output, so a pair is hashed in constant time */
+#define FNV_BASIS		2166136261u
+#define FNV(h, c)		(((h) ^ (c)) * 16777619u)
+
+uint32_t str_hash(struct str o) {
+    uint32_t h = FNV_BASIS;
+
+    for (uint32_t i = 0; i < o.len; i++)
+	h = FNV(h, o.p[i]);
+    return h;
+}
+
+void tset_clear(void) {
+    tset_n = 0;
+    if (++tset_gen == 0) {		/* wrapped around, clear the slots */
+	for (uint32_t i = 0; i < tset_capacity; i++)
+	    tset[i].gen = 0;
+	tset_gen = 1;
+    }
+}
+
+void tset_grow(void) {
+    struct tslot *old = tset;
+    uint32_t n = tset_capacity, mask, i;
+
+    tset_capacity = n ? 2 * n : 64;
+    tset = calloc(tset_capacity, sizeof(struct tslot));
+    if (tset == NULL) {
+	fprintf(stderr, "error: thread set allocation failed\n");
+	exit(EXIT_FAILURE);
+    }
+    mask = tset_capacity - 1;
+    for (uint32_t k = 0; k < n; k++)
+	if (old[k].gen == tset_gen) {
+	    for (i = old[k].hash & mask; tset[i].gen == tset_gen; i = (i + 1) & mask)
+		;
+	    tset[i] = old[k];
+	}
+    free(old);
+}
+
+/* 0 if the state was entered with the output o in this step; oh is
+ * str_hash(o) */
+int tset_add(uint32_t pc, struct str o, uint32_t oh) {
+    uint32_t h = FNV(oh, pc), mask, i;
+
+    if (2 * (tset_n + 1) > tset_capacity)
+	tset_grow();
+    mask = tset_capacity - 1;
+    for (i = h & mask; tset[i].gen == tset_gen; i = (i + 1) & mask)
+	if (tset[i].hash == h && tset[i].pc == pc && tset[i].o.len == o.len
+	    && (tset[i].o.p == o.p || str_cmp(tset[i].o, o) == 0))
+	    return 0;
+    tset[i].pc = pc;
+    tset[i].gen = tset_gen;
+    tset[i].hash = h;
+    tset[i].o = o;
+    tset_n++;
+    return 1;
+}
+
+/* the last branch of a state is a loop rather than a call, so the
+ * depth does not follow the chain of rules a rules file makes */
+void nft_step_(struct prog *prog, uint32_t pc, struct str o, int c, struct slist *sl) {
+    struct inst *s;
+
+    for (;;) {
+	if (pc == NIL || visited[pc] == visit_gen) return;
+	visited[pc] = visit_gen;
+
+	s = &prog->inst[pc];
+	switch(s->op) {
+	    case SPLIT:
+		nft_step_(prog, s->y, o, c, sl);
+		pc = s->x;
+		continue;
+	    case SPLITNG:
+		nft_step_(prog, s->x, o, c, sl);
+		pc = s->y;
+		continue;
+	    case JOIN:
+		pc = s->x;
+		continue;
+	    case PROD:
+		o = str_append(&scratch, o, s->val);
+		pc = s->x;
+		continue;
+	    case CONS:	// found CONS state marked with 'c'
+		if (c == s->val)
+		    slist_append(sl, pc, o);
+		break;
+	    case CONS_CLASS:
+		if (c != STEP_FINAL && BIT_TEST(prog->sets + 32 * s->y, c))
+		    slist_append(sl, pc, s->val ? str_append(&scratch, o, c) : o);
+		break;
+	    case MAP:
+		if (c != STEP_FINAL && BIT_TEST(prog->maps + MAP_SIZE * s->y, c))
+		    slist_append(sl, pc, str_append(&scratch, o, prog->maps[MAP_SIZE * s->y + 32 + c]));
+		break;
+	    case FINAL:
+		if (c == STEP_FINAL)
+		    slist_append(sl, pc, o);
+		break;
+	}
+	return;
+    }
+}
+
+void twalk_push(uint32_t *sp, uint32_t pc, struct str o, uint32_t oh, int leave) {
+    twalk[*sp].pc = pc;
+    twalk[*sp].o = o;
+    twalk[*sp].oh = oh;
+    twalk[*sp].leave = leave;
+    (*sp)++;
+}
+
+/* nft_step_ with -a; the consuming and final states are left to it.
+ * The walk has its own stack: a rules file chains every rule off one
+ * state, and the path marks keep the calls from being tail calls. */
+void nft_step_all_(struct prog *prog, uint32_t pc, struct str o, uint32_t oh, int c, struct slist *sl) {
+    struct twalk *w;
+    struct inst *s;
+    uint32_t sp = 0;
+
+    twalk_push(&sp, pc, o, oh, 0);
+    while (sp) {
+	w = &twalk[--sp];
+	pc = w->pc;
+	o = w->o;
+	oh = w->oh;
+	if (w->leave) {
+	    visited[pc] = 0;	/* off the path */
+	    continue;
+	}
+	if (pc == NIL || visited[pc] == visit_gen || !tset_add(pc, o, oh))
+	    continue;
+	visited[pc] = visit_gen;
+	twalk_push(&sp, pc, o, oh, 1);
+
+	s = &prog->inst[pc];
+	switch(s->op) {
+	    case SPLIT:
+		twalk_push(&sp, s->x, o, oh, 0);
+		twalk_push(&sp, s->y, o, oh, 0);
+		break;
+	    case SPLITNG:
+		twalk_push(&sp, s->y, o, oh, 0);
+		twalk_push(&sp, s->x, o, oh, 0);
+		break;
+	    case JOIN:
+		twalk_push(&sp, s->x, o, oh, 0);
+		break;
+	    case PROD:
+		twalk_push(&sp, s->x, str_append(&scratch, o, s->val), FNV(oh, s->val), 0);
+		break;
+	    default:		/* consumes or is final, nft_step_ sets the mark */
+		visited[pc] = 0;
+		nft_step_(prog, pc, o, c, sl);
+		break;
+	}
+    }
+}
+
+/* not inlined, the loop of nft_step stays as tight as without -a */
+__attribute__((noinline))
+void nft_step_all(struct prog *prog, struct slist *states, int c, struct slist *sl) {
+    /* a state on the path holds its leave entry and one pending branch */
+    if (twalk_capacity < 2 * prog->n + 2) {
+	free(twalk);
+	twalk_capacity = 2 * prog->n + 2;
+	twalk = malloc(twalk_capacity * sizeof(struct twalk));
+	if (twalk == NULL) {
+	    fprintf(stderr, "error: thread walk allocation failed\n");
+	    exit(EXIT_FAILURE);
+	}
+    }
+    tset_clear();
+    for(uint32_t k = 0; k < states->n; k++)
+	nft_step_all_(prog, prog->inst[states->items[k].pc].x, states->items[k].suffix,
+		      str_hash(states->items[k].suffix), c, sl);
+}
+
+
+/* step all the states on c; the result lives in the scratch arena
+ * until the next call */
+void nft_step(struct prog *prog, struct slist *states, int c, struct slist *sl) {
+    arena_reset(&scratch);
+    sl->n = 0;
+    stats.nft_steps++;
+
+    if (++visit_gen == 0) {		/* wrapped around, clear the marks */
+	memset(visited, 0, prog->n * sizeof(unsigned));
+	visit_gen = 1;
+    }
+    if (all) {
+	nft_step_all(prog, states, c, sl);
+	return;
+    }
+
+    for(uint32_t k = 0; k < states->n; k++)
+	nft_step_(prog, prog->inst[states->items[k].pc].x, states->items[k].suffix, c, sl);
+}
+
+
+struct dstate {
+    struct slist states;
+    struct str final_out;
+    struct str *finals;		/* -a: every final output, final_out first */
+    uint32_t n_finals;
+    int8_t final;
+    uint32_t hash;		/* slist_hash of states */
+};
+
+/* Lazily built DFT. Bytes that no NFT state tells apart share an
+ * equivalence class, so a state has one transition per class instead
+ * of 256. Transitions live in one flat table indexed by
+ * state * n_cls + class; outputs are referenced by index. */
+
+#define DS_UNKNOWN	UINT32_MAX		/* not explored yet */
+#define DS_DEAD		(UINT32_MAX - 1)	/* explored, nothing matches */
+
+/* A DFT shared by the -j workers is read without locks. The explorer
+ * holds dft->lock and publishes a transition only once its target
+ * state, the output and the grown tables are in place; a reader that
+ * finds no transition explores it under the lock. */
+#define LOAD(v)		__atomic_load_n(&(v), __ATOMIC_ACQUIRE)
+#define PUBLISH(v, x)	__atomic_store_n(&(v), (x), __ATOMIC_RELEASE)
+
+struct dft {
+    uint8_t cls[256];		/* byte -> equivalence class */
+    uint32_t n_cls;
+    struct dstate *ds;
+    uint32_t n, capacity;
+    uint32_t *next;		/* target states, n x n_cls */
+    uint32_t *out;		/* output indices, n x n_cls */
+    struct str *outs;		/* transition outputs; 0 is the empty one */
+    uint32_t n_outs, outs_capacity;
+    uint32_t *table;		/* state cache, see dcache_lookup */
+    uint32_t table_capacity;
+    struct arena pool;		/* state lists, suffixes and outputs */
+    struct slist step;		/* scratch list for nft_step */
+    struct slist saved;		/* the current state across a flush */
+    struct arena keep;		/* suffixes of the saved and simulated lists */
+    size_t budget;		/* cache memory limit in bytes, 0 if none */
+    size_t flushes;		/* times the cache was dropped */
+    size_t created;		/* states added, over the flushes */
+    size_t peak;		/* the most memory held before a flush */
+    size_t nbytes;		/* input bytes consumed */
+    int fallback;		/* 1 once switched to the nft simulation */
+    int mapped;			/* next and out point into a compiled file */
+    uint32_t *recs;		/* unanchored DFT: group records, see udft_explore */
+    size_t n_recs, recs_capacity;
+    int shared;			/* explored by several threads */
+    int flush_pending;		/* over the budget, flushed once they stop */
+    pthread_mutex_t lock;
+    void **retired;		/* grown out tables still read by others */
+    size_t n_retired, retired_capacity;
+};
+
+/* switch to the nft simulation once the cache is flushed more often
+ * than this per megabyte of input */
+#define DFT_FLUSHES_PER_MB	8
+
+/* cache budget when the twins test is undecided and -M is not given */
+#define DFT_DEFAULT_BUDGET	(64 << 20)
+
+/* split the classes by membership in the set; with split_all every
+ * member byte gets a class of its own */
+void classes_refine(uint8_t *cls, uint8_t *set, int split_all) {
+    int in[256], out[256], n = 0;
+
+    memset(in, -1, sizeof in);
+    memset(out, -1, sizeof out);
+    for (int c = 0; c < 256; c++) {
+	if (BIT_TEST(set, c)) {
+	    if (split_all)
+		cls[c] = n++;
+	    else {
+		if (in[cls[c]] < 0)
+		    in[cls[c]] = n++;
+		cls[c] = in[cls[c]];
+	    }
+	} else {
+	    if (out[cls[c]] < 0)
+		out[cls[c]] = n++;
+	    cls[c] = out[cls[c]];
+	}
+    }
+}
+
+/* two bytes are equivalent if every consuming state accepts both or
+ * none of them and produces the same output for them */
+uint32_t dft_classes(struct prog *prog, uint8_t *cls) {
+    uint8_t one[32];
+    uint32_t n = 0;
+    struct inst *s;
+
+    memset(cls, 0, 256);
+    for (uint32_t pc = 0; pc < prog->n; pc++) {
+	s = &prog->inst[pc];
+	switch (s->op) {
+	    case CONS:
+		memset(one, 0, sizeof one);
+		BIT_SET(one, s->val);
+		classes_refine(cls, one, 0);
+		break;
+	    case CONS_CLASS:
+		classes_refine(cls, prog->sets + 32 * s->y, s->val);
+		break;
+	    case MAP:
+		classes_refine(cls, prog->maps + MAP_SIZE * s->y, 1);
+		break;
+	}
+    }
+    for (int c = 0; c < 256; c++)
+	if (cls[c] >= n)
+	    n = cls[c] + 1;
+    return n;
+}
+
+/* Twins property test (Allauzen, Mohri). The DFT is finite iff the
+ * suffixes kept in its state lists stay bounded. Two list items p, q
+ * reached on the same input have a delay: their pending outputs with
+ * the common prefix removed. The test walks the graph of such pairs,
+ * where an edge on a byte class appends the outputs of the epsilon
+ * paths taken by both items. Pairs of one item are merged by nft_step,
+ * so they start over with no delay. The delays stay bounded iff every
+ * pair on a cycle has a single delay, whatever path reaches it.
+ * Graphs that outgrow the limits below are left undecided. The pairs
+ * do not see items claimed by a third one, so the test may fail for a
+ * finite DFT; dft_build settles the small ones. */
+
+enum twins { TWINS_UNKNOWN, TWINS_YES, TWINS_NO };
+
+#define TWINS_MAX_ITEMS		1024		/* list items, the pair table is squared */
+#define TWINS_MAX_PATHS		4096		/* epsilon paths per item and class */
+#define TWINS_MAX_PAIRS		(1 << 16)
+#define TWINS_MAX_EDGES		(1 << 20)
+#define TWINS_MAX_DELAYS	64		/* delays per acyclic pair */
+#define TWINS_MAX_INSERTS	(1 << 22)	/* twins_add_edge calls, paths x paths */
+#define TWINS_MAX_BUILD		1024		/* dft states built to settle a failed test */
+
+struct delay {
+    struct str a, b;
+};
+
+struct tsucc {			/* an epsilon path to the item 'to' */
+    uint32_t to;
+    struct str w;
+};
+
+struct tedge {
+    uint32_t to;
+    struct str a, b;
+};
+
+struct tpair {
+    uint32_t i, j;
+    uint32_t edges, n_edges;	/* outgoing edges in twins.edges */
+    uint32_t index, low, scc;	/* tarjan */
+    struct delay *d;		/* delays reaching the pair */
+    uint32_t nd, dcap;
+};
+
+struct tgraph {
+    struct prog *prog;
+    uint32_t *item;		/* pc -> item, NIL if the pc is never in a list */
+    uint32_t *pcs, n_items;
+    uint8_t *onpath;
+    struct tsucc *succ;		/* epsilon paths, grouped by item and class */
+    uint32_t *soff;		/* n_items * n_cls + 1 offsets into succ */
+    uint32_t n_succ, succ_capacity, n_paths;
+    uint32_t *pid;		/* n_items x n_items -> pair, NIL if none */
+    struct tpair *pairs;
+    uint32_t n_pairs, pairs_capacity;
+    struct tedge *edges;
+    uint32_t n_edges, edges_capacity;
+    struct arena pool;		/* outputs and delays */
+    uint32_t n_inserts;
+    int overflow;
+};
+
+void * twins_grow(void *p, uint32_t *capacity, size_t size) {
+    *capacity = *capacity ? *capacity * 2 : 64;
+    p = realloc(p, *capacity * size);
+    if (p == NULL) {
+	fprintf(stderr, "error: twins memory allocation failed\n");
+	exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+struct str str_cat(struct arena *a, struct str s, struct str t) {
+    struct str r;
+
+    r.len = s.len + t.len;
+    r.p = r.len ? arena_bytes(a, r.len) : NULL;
+    if (s.len)
+	memcpy(r.p, s.p, s.len);
+    if (t.len)
+	memcpy(r.p + s.len, t.p, t.len);
+    return r;
+}
+
+/* append the outputs to both sides and drop their common prefix */
+struct delay delay_step(struct arena *a, struct delay d, struct str x, struct str y) {
+    uint32_t n = 0;
+
+    d.a = str_cat(a, d.a, x);
+    d.b = str_cat(a, d.b, y);
+    while (n < d.a.len && n < d.b.len && d.a.p[n] == d.b.p[n])
+	n++;
+    d.a.p += n; d.a.len -= n;
+    d.b.p += n; d.b.len -= n;
+    return d;
+}
+
+int delay_eq(struct delay x, struct delay y) {
+    return str_cmp(x.a, y.a) == 0 && str_cmp(x.b, y.b) == 0;
+}
+
+/* all the simple epsilon paths from pc to the items consuming c;
+ * unlike nft_step_, a state may be entered again from another path */
+void twins_paths(struct tgraph *tw, uint32_t pc, struct str o, unsigned char c) {
+    struct prog *prog = tw->prog;
+    struct inst *s;
+    struct str w = o;
+    int consumed = 0;
+
+    if (pc == NIL || tw->onpath[pc] || tw->overflow)
+	return;
+    if (++tw->n_paths > TWINS_MAX_PATHS) {
+	tw->overflow = 1;
+	return;
+    }
+
+    s = &prog->inst[pc];
+    tw->onpath[pc] = 1;
+    switch(s->op) {
+	case SPLIT:
+	case SPLITNG:
+	    twins_paths(tw, s->x, o, c);
+	    twins_paths(tw, s->y, o, c);
+	    break;
+	case JOIN:
+	    twins_paths(tw, s->x, o, c);
+	    break;
+	case PROD:
+	    twins_paths(tw, s->x, str_append(&tw->pool, o, s->val), c);
+	    break;
+	case CONS:
+	    if ((consumed = c == s->val))
+		w = o;
+	    break;
+	case CONS_CLASS:
+	    if ((consumed = BIT_TEST(prog->sets + 32 * s->y, c)))
+		w = s->val ? str_append(&tw->pool, o, c) : o;
+	    break;
+	case MAP:
+	    if ((consumed = BIT_TEST(prog->maps + MAP_SIZE * s->y, c)))
+		w = str_append(&tw->pool, o, prog->maps[MAP_SIZE * s->y + 32 + c]);
+	    break;
+    }
+    tw->onpath[pc] = 0;
+
+    if (consumed) {
+	if (tw->n_succ == tw->succ_capacity)
+	    tw->succ = twins_grow(tw->succ, &tw->succ_capacity, sizeof(struct tsucc));
+	tw->succ[tw->n_succ].to = tw->item[pc];
+	tw->succ[tw->n_succ].w = str_dup(&tw->pool, w);
+	tw->n_succ++;
+    }
+}
+
+/* the pair (i, j) with the delay reached over the edge from pair
+ * 'from', NIL for a pair of one item */
+/* add a delay reaching pair v from another component */
+int twins_reach(struct tgraph *tw, uint32_t v, struct delay d) {
+    struct tpair *p = &tw->pairs[v];
+
+    for (uint32_t k = 0; k < p->nd; k++)
+	if (delay_eq(p->d[k], d))
+	    return 1;
+    if (p->nd == TWINS_MAX_DELAYS)
+	return 0;
+    if (p->nd == p->dcap)
+	p->d = twins_grow(p->d, &p->dcap, sizeof(struct delay));
+    p->d[p->nd++] = d;
+    return 1;
+}
+
+void twins_add_edge(struct tgraph *tw, uint32_t from, uint32_t i, uint32_t j, struct str a, struct str b) {
+    uint32_t *id = &tw->pid[i * tw->n_items + j];
+    struct tpair *p;
+    struct delay none = { { NULL, 0 }, { NULL, 0 } };
+
+    if (tw->overflow)
+	return;
+    if (++tw->n_inserts > TWINS_MAX_INSERTS) {
+	tw->overflow = 1;
+	return;
+    }
+    if (*id == NIL) {
+	if (tw->n_pairs == TWINS_MAX_PAIRS) {
+	    tw->overflow = 1;
+	    return;
+	}
+	if (tw->n_pairs == tw->pairs_capacity)
+	    tw->pairs = twins_grow(tw->pairs, &tw->pairs_capacity, sizeof(struct tpair));
+	p = &tw->pairs[tw->n_pairs];
+	memset(p, 0, sizeof *p);
+	p->i = i;
+	p->j = j;
+	p->index = NIL;
+	*id = tw->n_pairs++;
+    }
+
+    if (from == NIL) {			/* a source, no delay yet */
+	if (!twins_reach(tw, *id, delay_step(&tw->pool, none, a, b)))
+	    tw->overflow = 1;
+	return;
+    }
+
+    if (tw->n_edges == TWINS_MAX_EDGES) {
+	tw->overflow = 1;
+	return;
+    }
+    if (tw->n_edges == tw->edges_capacity)
+	tw->edges = twins_grow(tw->edges, &tw->edges_capacity, sizeof(struct tedge));
+    tw->edges[tw->n_edges].to = *id;
+    tw->edges[tw->n_edges].a = a;
+    tw->edges[tw->n_edges].b = b;
+    tw->n_edges++;
+}
+
+/* strongly connected components of the pair graph, iterative tarjan;
+ * components are numbered in reverse topological order */
+uint32_t twins_scc(struct tgraph *tw) {
+    uint32_t *stack, *calls, *cpos, sp = 0, cp = 0, index = 0, n_scc = 0, v, w;
+    struct tpair *p;
+
+    stack = malloc(tw->n_pairs * sizeof(uint32_t));
+    calls = malloc(tw->n_pairs * sizeof(uint32_t));
+    cpos = malloc(tw->n_pairs * sizeof(uint32_t));
+    if (!stack || !calls || !cpos) {
+	fprintf(stderr, "error: twins memory allocation failed\n");
+	exit(EXIT_FAILURE);
+    }
+
+    for (uint32_t root = 0; root < tw->n_pairs; root++) {
+	if (tw->pairs[root].index != NIL)
+	    continue;
+	calls[cp] = root; cpos[cp++] = 0;
+	tw->pairs[root].index = tw->pairs[root].low = index++;
+	tw->pairs[root].scc = NIL;
+	stack[sp++] = root;
+
+	while (cp) {
+	    v = calls[cp-1];
+	    p = &tw->pairs[v];
+	    if (cpos[cp-1] < p->n_edges) {
+		w = tw->edges[p->edges + cpos[cp-1]++].to;
+		if (tw->pairs[w].index == NIL) {
+		    tw->pairs[w].index = tw->pairs[w].low = index++;
+		    tw->pairs[w].scc = NIL;
+		    stack[sp++] = w;
+		    calls[cp] = w; cpos[cp++] = 0;
+		} else if (tw->pairs[w].scc == NIL && tw->pairs[w].index < p->low)
+		    p->low = tw->pairs[w].index;	/* w is on the stack */
+		continue;
+	    }
+	    if (p->low == p->index) {
+		do {
+		    w = stack[--sp];
+		    tw->pairs[w].scc = n_scc;
+		} while (w != v);
+		n_scc++;
+	    }
+	    if (--cp && p->low < tw->pairs[calls[cp-1]].low)
+		tw->pairs[calls[cp-1]].low = p->low;
+	}
+    }
+    free(stack);
+    free(calls);
+    free(cpos);
+    return n_scc;
+}
+
+/* propagate the delays in topological order of the components */
+enum twins twins_delays(struct tgraph *tw, uint32_t n_scc) {
+    uint32_t *order, *start, *queue, head, tail, v;
+    struct tpair *p, *q;
+    struct tedge *e;
+    struct delay d;
+    enum twins res = TWINS_YES;
+    int cyclic;
+
+    /* members of each component, bucketed by the component number */
+    order = malloc(tw->n_pairs * sizeof(uint32_t));
+    queue = malloc(tw->n_pairs * sizeof(uint32_t));
+    start = calloc(n_scc + 1, sizeof(uint32_t));
+    if (!order || !queue || !start) {
+	fprintf(stderr, "error: twins memory allocation failed\n");
+	exit(EXIT_FAILURE);
+    }
+    for (v = 0; v < tw->n_pairs; v++)
+	start[tw->pairs[v].scc + 1]++;
+    for (uint32_t s = 0; s < n_scc; s++)
+	start[s + 1] += start[s];
+    for (v = 0; v < tw->n_pairs; v++)
+	order[start[tw->pairs[v].scc]++] = v;
+    for (uint32_t s = n_scc; s > 0; s--)
+	start[s] = start[s - 1];
+    start[0] = 0;
+
+    for (uint32_t s = n_scc; s-- > 0 && res == TWINS_YES; ) {
+	cyclic = start[s + 1] - start[s] > 1;
+	p = &tw->pairs[order[start[s]]];
+	for (uint32_t k = 0; !cyclic && k < p->n_edges; k++)
+	    cyclic = tw->edges[p->edges + k].to == order[start[s]];
+
+	if (cyclic) {
+	    /* a single delay per pair, consistent along every edge */
+	    head = tail = 0;
+	    for (uint32_t m = start[s]; m < start[s + 1]; m++) {
+		p = &tw->pairs[order[m]];
+		if (p->nd > 1)
+		    res = TWINS_NO;
+		else if (p->nd == 1)
+		    queue[tail++] = order[m];
+	    }
+	    while (head < tail && res == TWINS_YES) {
+		p = &tw->pairs[queue[head++]];
+		for (uint32_t k = 0; k < p->n_edges; k++) {
+		    e = &tw->edges[p->edges + k];
+		    q = &tw->pairs[e->to];
+		    if (q->scc != (uint32_t)s)
+			continue;
+		    d = delay_step(&tw->pool, p->d[0], e->a, e->b);
+		    if (q->nd == 0) {
+			twins_reach(tw, e->to, d);
+			queue[tail++] = e->to;
+		    } else if (!delay_eq(q->d[0], d)) {
+			res = TWINS_NO;
+			break;
+		    }
+		}
+	    }
+	}
+
+	/* pass the delays on to the next components */
+	for (uint32_t m = start[s]; m < start[s + 1] && res == TWINS_YES; m++) {
+	    p = &tw->pairs[order[m]];
+	    for (uint32_t k = 0; k < p->n_edges && res == TWINS_YES; k++) {
+		e = &tw->edges[p->edges + k];
+		if (tw->pairs[e->to].scc == (uint32_t)s)
+		    continue;
+		for (uint32_t l = 0; l < p->nd; l++)
+		    if (!twins_reach(tw, e->to, delay_step(&tw->pool, p->d[l], e->a, e->b))) {
+			res = TWINS_UNKNOWN;
+			break;
+		    }
+	    }
+	}
+    }
+
+    free(order);
+    free(queue);
+    free(start);
+    return res;
+}
+
+enum twins twins_test(struct prog *prog) {
+    struct tgraph tw;
+    struct str empty = { NULL, 0 };
+    struct tsucc *x, *y;
+    uint8_t cls[256];
+    unsigned char rep[256];
+    uint32_t n_cls, *reach, n_reach, i, j;
+    uint8_t *claimed;
+    enum twins res = TWINS_UNKNOWN;
+
+    memset(&tw, 0, sizeof tw);
+    tw.prog = prog;
+
+    /* the items: the start and the consuming states */
+    tw.item = malloc(prog->n * sizeof(uint32_t));
+    tw.pcs = malloc(prog->n * sizeof(uint32_t));
+    tw.onpath = calloc(prog->n, sizeof(uint8_t));
+    if (!tw.item || !tw.pcs || !tw.onpath) {
+	fprintf(stderr, "error: twins memory allocation failed\n");
+	exit(EXIT_FAILURE);
+    }
+    for (uint32_t pc = 0; pc < prog->n; pc++) {
+	tw.item[pc] = NIL;
+	switch (prog->inst[pc].op) {
+	    case CONS: case CONS_CLASS: case MAP:
+		break;
+	    default:
+		if (pc != 0)
+		    continue;
+	}
+	tw.item[pc] = tw.n_items;
+	tw.pcs[tw.n_items++] = pc;
+    }
+    if (tw.n_items > TWINS_MAX_ITEMS)
+	goto done;
+
+    /* one byte per class */
+    n_cls = dft_classes(prog, cls);
+    for (int c = 255; c >= 0; c--)
+	rep[cls[c]] = c;
+
+    tw.soff = malloc((tw.n_items * n_cls + 1) * sizeof(uint32_t));
+    if (tw.soff == NULL) {
+	fprintf(stderr, "error: twins memory allocation failed\n");
+	exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < tw.n_items; i++)
+	for (uint32_t k = 0; k < n_cls; k++) {
+	    tw.soff[i * n_cls + k] = tw.n_succ;
+	    tw.n_paths = 0;
+	    twins_paths(&tw, prog->inst[tw.pcs[i]].x, empty, rep[k]);
+	}
+    tw.soff[tw.n_items * n_cls] = tw.n_succ;
+    if (tw.overflow)
+	goto done;
+
+    /* items reachable from the start are the sources of the pair graph */
+    reach = calloc(tw.n_items, sizeof(uint32_t));
+    tw.pid = malloc((size_t)tw.n_items * tw.n_items * sizeof(uint32_t));
+    if (!reach || !tw.pid) {
+	fprintf(stderr, "error: twins memory allocation failed\n");
+	exit(EXIT_FAILURE);
+    }
+    memset(tw.pid, 0xff, (size_t)tw.n_items * tw.n_items * sizeof(uint32_t));
+    memset(tw.onpath, 0, prog->n);
+    tw.onpath[0] = 1;
+    n_reach = 1;
+    for (uint32_t r = 0; r < n_reach; r++)
+	for (x = tw.succ + tw.soff[reach[r] * n_cls]; x < tw.succ + tw.soff[(reach[r] + 1) * n_cls]; x++)
+	    if (!tw.onpath[tw.pcs[x->to]]) {
+		tw.onpath[tw.pcs[x->to]] = 1;
+		reach[n_reach++] = x->to;
+	    }
+
+    for (uint32_t r = 0; r < n_reach && !tw.overflow; r++) {
+	i = reach[r];
+	for (uint32_t k = 0; k < n_cls && !tw.overflow; k++)
+	    for (x = tw.succ + tw.soff[i * n_cls + k]; x < tw.succ + tw.soff[i * n_cls + k + 1] && !tw.overflow; x++)
+		for (y = tw.succ + tw.soff[i * n_cls + k]; y < tw.succ + tw.soff[i * n_cls + k + 1]; y++)
+		    if (x->to != y->to)
+			twins_add_edge(&tw, NIL, x->to, y->to, x->w, y->w);
+    }
+    free(reach);
+    if (tw.overflow)
+	goto done;
+
+    /* Pairs are explored in order, so their edges are contiguous. The
+     * pair (i, j) has i before j in the state list; nft_step gives
+     * every item reachable from i to i, never to j. */
+    claimed = calloc(tw.n_items, sizeof(uint8_t));
+    if (claimed == NULL) {
+	fprintf(stderr, "error: twins memory allocation failed\n");
+	exit(EXIT_FAILURE);
+    }
+    for (uint32_t v = 0; v < tw.n_pairs && !tw.overflow; v++) {
+	i = tw.pairs[v].i;
+	j = tw.pairs[v].j;
+	tw.pairs[v].edges = tw.n_edges;
+	for (uint32_t k = 0; k < n_cls && !tw.overflow; k++) {
+	    for (x = tw.succ + tw.soff[i * n_cls + k]; x < tw.succ + tw.soff[i * n_cls + k + 1]; x++)
+		claimed[x->to] = 1;
+	    for (x = tw.succ + tw.soff[i * n_cls + k]; x < tw.succ + tw.soff[i * n_cls + k + 1] && !tw.overflow; x++)
+		for (y = tw.succ + tw.soff[j * n_cls + k]; y < tw.succ + tw.soff[j * n_cls + k + 1]; y++)
+		    if (!claimed[y->to])
+			twins_add_edge(&tw, v, x->to, y->to, x->w, y->w);
+	    for (x = tw.succ + tw.soff[i * n_cls + k]; x < tw.succ + tw.soff[i * n_cls + k + 1]; x++)
+		claimed[x->to] = 0;
+	}
+	tw.pairs[v].n_edges = tw.n_edges - tw.pairs[v].edges;
+    }
+    free(claimed);
+    if (tw.overflow)
+	goto done;
+
+    res = twins_delays(&tw, twins_scc(&tw));
+
+done:
+    for (uint32_t v = 0; v < tw.n_pairs; v++)
+	free(tw.pairs[v].d);
+    free(tw.pairs);
+    free(tw.edges);
+    free(tw.pid);
+    free(tw.succ);
+    free(tw.soff);
+    free(tw.item);
+    free(tw.pcs);
+    free(tw.onpath);
+    arena_free(&tw.pool);
+    return res;
+}
+
+/* Grow a table to size bytes, used bytes of it are kept. The old
+ * table of a shared DFT may still be read, it is freed at the next
+ * flush. NULL if out of memory. */
+void * dft_grow(struct dft *dft, void *p, size_t used, size_t size) {
+    void *q;
+
+    if (!dft->shared)
+	return realloc(p, size);
+    if ((q = malloc(size)) == NULL)
+	return NULL;
+    if (used)			/* p is NULL before the first state */
+	memcpy(q, p, used);
+    if (dft->n_retired == dft->retired_capacity) {
+	dft->retired_capacity = dft->retired_capacity ? 2 * dft->retired_capacity : 16;
+	dft->retired = realloc(dft->retired, dft->retired_capacity * sizeof(void*));
+	if (dft->retired == NULL) {
+	    fprintf(stderr, "error: dft memory allocation failed\n");
+	    exit(EXIT_FAILURE);
+	}
+    }
+    dft->retired[dft->n_retired++] = p;
+    return q;
+}
+
+uint32_t dft_add_output(struct dft *dft, struct str o) {
+    struct str *outs = dft->outs;
+
+    if (dft->n_outs == dft->outs_capacity) {
+	dft->outs_capacity *= 2;
+	outs = dft_grow(dft, outs, dft->n_outs * sizeof(struct str), dft->outs_capacity * sizeof(struct str));
+	if (outs == NULL) {
+	    fprintf(stderr, "error: dft output re-allocation failed\n");
+	    exit(EXIT_FAILURE);
+	}
+    }
+    outs[dft->n_outs] = str_dup(&dft->pool, o);
+    PUBLISH(dft->outs, outs);
+    return dft->n_outs++;
+}
+
+/* add a state for the list; the list is copied to the pool */
+uint32_t dft_add_state(struct dft *dft, struct slist *sl, uint32_t hash) {
+    struct dstate *ds;
+    uint32_t d = dft->n, *next = dft->next, *out = dft->out;
+    size_t row = dft->n_cls * sizeof(uint32_t);
+
+    if (dft->n == dft->capacity) {
+	dft->capacity *= 2;
+	ds = dft_grow(dft, dft->ds, dft->n * sizeof(struct dstate), dft->capacity * sizeof(struct dstate));
+	if (dft->mapped) {		/* copy the tables out of the file */
+	    next = malloc(dft->capacity * row);
+	    out = malloc(dft->capacity * row);
+	    if (next && out) {
+		memcpy(next, dft->next, dft->n * row);
+		memcpy(out, dft->out, dft->n * row);
+	    }
+	    dft->mapped = 0;
+	} else {
+	    next = dft_grow(dft, next, dft->n * row, dft->capacity * row);
+	    out = dft_grow(dft, out, dft->n * row, dft->capacity * row);
+	}
+	if (!ds || !next || !out) {
+	    fprintf(stderr, "error: dft state re-allocation failed\n");
+	    exit(EXIT_FAILURE);
+	}
+	PUBLISH(dft->ds, ds);
+	PUBLISH(dft->out, out);
+	PUBLISH(dft->next, next);
+    }
+    ds = &dft->ds[d];
+    ds->states.n = sl->n;
+    ds->states.capacity = 0;
+    ds->states.items = arena_alloc(&dft->pool, sl->n * sizeof(struct slitem));
+    for (uint32_t k = 0; k < sl->n; k++) {
+	ds->states.items[k].pc = sl->items[k].pc;
+	ds->states.items[k].suffix = str_dup(&dft->pool, sl->items[k].suffix);
+    }
+    ds->final_out.p = NULL;
+    ds->final_out.len = 0;
+    ds->finals = NULL;
+    ds->n_finals = 0;
+    ds->final = -1;
+    ds->hash = hash;
+    memset(dft->next + d * dft->n_cls, 0xff, dft->n_cls * sizeof(uint32_t));
+    memset(dft->out + d * dft->n_cls, 0, dft->n_cls * sizeof(uint32_t));
+    dft->n++;
+    dft->created++;
+    return d;
+}
+
+int list_cmp(struct slist *a, struct slist *b) {
+    struct slitem *ai, *bi;
+    int sign;
+
+    if(a->n < b->n)
+    	return -1;
+    if(a->n > b->n)
+    	return 1;
+
+    for(uint32_t k = 0; k < a->n; k++) {
+	ai = &a->items[k];
+	bi = &b->items[k];
+	if(ai->pc < bi->pc)
+	    return -1;
+	else if(ai->pc > bi->pc)
+	    return 1;
+	else {
+	    sign = str_cmp(ai->suffix, bi->suffix);
+	    if (sign != 0)
+		return sign;
+	}
+    }
+
+    return 0;
+}
+
+/* FNV-1a over the canonical (state, suffix) list */
+uint32_t slist_hash(struct slist *sl) {
+    uint32_t h = 2166136261u;
+
+    for (uint32_t k = 0; k < sl->n; k++) {
+	h = (h ^ sl->items[k].pc) * 16777619u;
+	h = (h ^ sl->items[k].suffix.len) * 16777619u;
+	for (uint32_t i = 0; i < sl->items[k].suffix.len; i++)
+	    h = (h ^ sl->items[k].suffix.p[i]) * 16777619u;
+    }
+    return h;
+}
+
+/* The state cache is an open addressing hash table of state indices
+ * with linear probing; the table is kept at most half full. */
+
+uint32_t dcache_lookup(struct dft *dft, struct slist *sl, uint32_t h) {
+    uint32_t mask = dft->table_capacity - 1, d;
+
+    for (uint32_t i = h & mask; (d = dft->table[i]) != DS_UNKNOWN; i = (i + 1) & mask)
+	if (dft->ds[d].hash == h && list_cmp(sl, &dft->ds[d].states) == 0)
+	    return d;
+    return DS_UNKNOWN;
+}
+
+void dcache_insert(struct dft *dft, uint32_t d) {
+    uint32_t mask = dft->table_capacity - 1, i;
+
+    if (2 * (dft->n + 1) > dft->table_capacity) {	/* grow and rehash */
+	free(dft->table);
+	dft->table_capacity *= 2;
+	dft->table = malloc(dft->table_capacity * sizeof(uint32_t));
+	if (dft->table == NULL) {
+	    fprintf(stderr, "error: dft cache re-allocation failed\n");
+	    exit(EXIT_FAILURE);
+	}
+	memset(dft->table, 0xff, dft->table_capacity * sizeof(uint32_t));
+	for (uint32_t k = 0; k < dft->n; k++)
+	    if (k != d)
+		dcache_insert(dft, k);
+	mask = dft->table_capacity - 1;
+    }
+
+    for (i = dft->ds[d].hash & mask; dft->table[i] != DS_UNKNOWN; i = (i + 1) & mask)
+	;
+    dft->table[i] = d;
+}
+
+struct dft * dft_create(struct prog *prog) {
+    struct dft *dft;
+    struct str empty = { NULL, 0 };
+
+    dft = calloc(1, sizeof(struct dft));
+    if (dft == NULL) {
+	fprintf(stderr, "error: dft memory allocation failed\n");
+	exit(EXIT_FAILURE);
+    }
+    dft->n_cls = dft_classes(prog, dft->cls);
+    dft->n = 0;
+    dft->capacity = 64;
+    dft->ds = malloc(dft->capacity * sizeof(struct dstate));
+    dft->next = malloc(dft->capacity * dft->n_cls * sizeof(uint32_t));
+    dft->out = malloc(dft->capacity * dft->n_cls * sizeof(uint32_t));
+    dft->n_outs = 0;
+    dft->outs_capacity = 64;
+    dft->outs = malloc(dft->outs_capacity * sizeof(struct str));
+    dft->table_capacity = 128;
+    dft->table = malloc(dft->table_capacity * sizeof(uint32_t));
+    pthread_mutex_init(&dft->lock, NULL);
+    if (!dft->ds || !dft->next || !dft->out || !dft->outs || !dft->table) {
+	fprintf(stderr, "error: dft memory allocation failed\n");
+	exit(EXIT_FAILURE);
+    }
+
+    dft_add_output(dft, empty);			/* the empty output */
+    memset(dft->table, 0xff, dft->table_capacity * sizeof(uint32_t));
+
+    slist_append(&dft->step, 0, empty);
+    dft_add_state(dft, &dft->step, slist_hash(&dft->step));	/* the start state is 0 */
+    dcache_insert(dft, 0);
+    return dft;
+}
+
+
+/* memory held by the cached states; the arrays grow by doubling,
+ * so the allocated size stays within twice of it */
+size_t dft_mem(struct dft *dft) {
+    return dft->n * (sizeof(struct dstate) + 2 * dft->n_cls * sizeof(uint32_t) + 2 * sizeof(uint32_t))
+	 + dft->n_outs * sizeof(struct str) + dft->pool.used + dft->n_recs * sizeof(uint32_t);
+}
+
+/* Drop all the cached states but the start state and the current
+ * state d, RE2 style; returns the new index of d. */
+uint32_t dft_flush(struct dft *dft, uint32_t d) {
+    struct str empty = { NULL, 0 }, final_out, *finals;
+    struct dstate *ds = &dft->ds[d];
+    int8_t final = ds->final;
+    uint32_t hash = ds->hash, n_finals = ds->n_finals;
+
+    arena_reset(&dft->keep);
+    dft->saved.n = 0;
+    for (uint32_t k = 0; k < ds->states.n; k++)
+	slist_append(&dft->saved, ds->states.items[k].pc, str_dup(&dft->keep, ds->states.items[k].suffix));
+    final_out = str_dup(&dft->keep, ds->final_out);
+    finals = strs_dup(&dft->keep, ds->finals, n_finals);
+    if (dft_mem(dft) > dft->peak)
+	dft->peak = dft_mem(dft);
+
+    dft->n = 0;
+    dft->n_outs = 0;
+    dft->n_recs = 0;
+    while (dft->n_retired)		/* no thread reads them at a flush */
+	free(dft->retired[--dft->n_retired]);
+    arena_reset(&dft->pool);
+    memset(dft->table, 0xff, dft->table_capacity * sizeof(uint32_t));
+    dft->flushes++;
+    if (dft->flushes > DFT_FLUSHES_PER_MB * (1 + (dft->nbytes >> 20)))
+	dft->fallback = 1;
+
+    dft_add_output(dft, empty);
+    dft->step.n = 0;
+    slist_append(&dft->step, 0, empty);
+    dft_add_state(dft, &dft->step, slist_hash(&dft->step));
+    dcache_insert(dft, 0);
+    if (d == 0)
+	return 0;
+
+    d = dft_add_state(dft, &dft->saved, hash);
+    dcache_insert(dft, d);
+    dft->ds[d].final = final;
+    dft->ds[d].final_out = str_dup(&dft->pool, final_out);
+    dft->ds[d].finals = strs_dup(&dft->pool, finals, n_finals);
+    dft->ds[d].n_finals = n_finals;
+    return d;
+}
+
+void plot_dft(struct dft *dft) {
+    struct dstate *s;
+    struct str o;
+    uint32_t t, first[256];
+
+    /* label a class transition with its first byte */
+    for (int c = 255; c >= 0; c--)
+	first[dft->cls[c]] = c;
+
+    printf("digraph G {\n\tsplines=true; rankdir=LR;\n");
+
+    for (uint32_t d = 0; d < dft->n; d++) {
+        s = &dft->ds[d];
+
+        if (s->final == 1)
+	    printf("\t\"%u\" [peripheries=2, label=\"%.*s\"];\n", d,
+		   (int)s->final_out.len, s->final_out.len ? (char*)s->final_out.p : "");
+        else
+            printf("\t\"%u\" [label=\"\"];\n", d);
+
+	for (uint32_t k = 0; k < dft->n_cls; k++) {
+	    t = d * dft->n_cls + k;
+	    if (dft->next[t] < DS_DEAD) {
+		o = dft->outs[dft->out[t]];
+		printf("\t\"%u\" -> \"%u\" [label=\"%c:%.*s\"];\n", d, dft->next[t], first[k],
+		       (int)o.len, o.len ? (char*)o.p : "");
+	    }
+        }
+    }
+    printf("}\n");
+}
+
+
+
+/* move the longest common prefix of the suffixes out of the list */
+struct str truncate_lcp(struct slist *sl) {
+    struct str prefix = sl->items[0].suffix, *s;
+    uint32_t n, i;
+
+    for (uint32_t k = 1; k < sl->n && prefix.len; k++) {
+	s = &sl->items[k].suffix;
+	n = s->len < prefix.len ? s->len : prefix.len;
+	if (n && memcmp(prefix.p, s->p, n) != 0) {
+	    for (i = 0; prefix.p[i] == s->p[i]; i++)
+		;
+	    n = i;
+	}
+	prefix.len = n;
+    }
+
+    for (uint32_t k = 0; k < sl->n; k++) {
+	sl->items[k].suffix.p += prefix.len;
+	sl->items[k].suffix.len -= prefix.len;
+    }
+    return prefix;
+}
+
+/* final closure of a new state; the first final thread wins, with -a
+ * the outputs of all of them are kept */
+void dft_final(struct prog *prog, struct dft *dft, uint32_t d) {
+    struct dstate *ds = &dft->ds[d];
+
+    nft_step(prog, &ds->states, STEP_FINAL, &dft->step);
+
+    if (dft->step.n) {
+	ds->final = 1;
+	ds->final_out = str_dup(&dft->pool, dft->step.items[0].suffix);
+	if (all) {
+	    ds->finals = arena_alloc(&dft->pool, dft->step.n * sizeof(struct str));
+	    for (uint32_t k = 0; k < dft->step.n; k++)
+		ds->finals[k] = k ? str_dup(&dft->pool, dft->step.items[k].suffix) : ds->final_out;
+	    ds->n_finals = dft->step.n;
+	}
+    } else {
+	ds->final = 0;
+    }
+}
+
+/* explore the transition of state d on byte c (and its whole class) */
+void dft_explore(struct prog *prog, struct dft *dft, uint32_t d, unsigned char c) {
+    uint32_t t = d * dft->n_cls + dft->cls[c], d_next, h;
+    struct str prefix;
+
+    nft_step(prog, &dft->ds[d].states, c, &dft->step);
+    if (dft->step.n == 0) {			/* nothing consumes c */
+	PUBLISH(dft->next[t], DS_DEAD);
+	return;
+    }
+
+    prefix = truncate_lcp(&dft->step);
+    dft->out[t] = prefix.len ? dft_add_output(dft, prefix) : 0;
+
+    h = slist_hash(&dft->step);
+    if ((d_next = dcache_lookup(dft, &dft->step, h)) == DS_UNKNOWN) {
+	d_next = dft_add_state(dft, &dft->step, h);
+	dcache_insert(dft, d_next);
+	dft_final(prog, dft, d_next);
+    }
+    PUBLISH(dft->next[t], d_next);
+}
+
+
+/* explore every transition; 0 if the DFT grows beyond max states or
+ * its cache budget */
+int dft_build(struct prog *prog, struct dft *dft, uint32_t max) {
+    int rep[256];
+
+    for (int c = 255; c >= 0; c--)
+	rep[dft->cls[c]] = c;
+
+    for (uint32_t d = 0; d < dft->n; d++) {
+	for (uint32_t k = 0; k < dft->n_cls; k++)
+	    if (dft->next[d * dft->n_cls + k] == DS_UNKNOWN)
+		dft_explore(prog, dft, d, rep[k]);
+	if (dft->n > max || (dft->budget && dft_mem(dft) > dft->budget))
+	    return 0;
+    }
+    return 1;
+}
+
+/* Unanchored DFT for the scan mode. Instead of restarting the DFT at
+ * every byte that does not begin a match, one pass carries a group of
+ * threads for every position a match may still start at. A state is
+ * the list of the groups, earliest start first, separated by
+ * GROUP_SEP items; a new group with the start item is appended after
+ * every byte. The groups share the generation marks, so a thread
+ * reaching an instruction an earlier group holds is dropped: the
+ * earlier start has the same future and wins. The start positions and
+ * the outputs of the groups are kept by scan_dft. */
+
+#define GROUP_SEP	NIL
+
+/* step the groups in order; from[g] is the old index of new group g,
+ * returns the number of new groups */
+uint32_t groups_step(struct prog *prog, struct slist *states, int c, struct slist *sl, uint32_t *from) {
+    struct str empty = { NULL, 0 };
+    uint32_t g = 0, n = 0, k = 0, sep, start;
+
+    arena_reset(&scratch);
+    sl->n = 0;
+    stats.nft_steps++;
+    if (++visit_gen == 0) {
+	memset(visited, 0, prog->n * sizeof(unsigned));
+	visit_gen = 1;
+    }
+
+    while (k < states->n) {
+	sep = sl->n;
+	if (n)
+	    slist_append(sl, GROUP_SEP, empty);
+	start = sl->n;
+	for (; k < states->n && states->items[k].pc != GROUP_SEP; k++)
+	    nft_step_(prog, prog->inst[states->items[k].pc].x, states->items[k].suffix, c, sl);
+	if (sl->n == start)		/* the group died */
+	    sl->n = sep;
+	else
+	    from[n++] = g;
+	k++;				/* skip the separator */
+	g++;
+    }
+    return n;
+}
+
+/* Explore the transition of unanchored state d on byte c. The record
+ * at u->out[t] is: the old index of the group that turns final (NIL if
+ * none) and its output; the number of live groups and, for each, its
+ * old index and output. Groups after the final one are dropped. */
+void udft_explore(struct prog *prog, struct dft *u, uint32_t d, unsigned char c) {
+    static __thread struct slist cur;
+    static __thread struct arena keep;
+    static __thread uint32_t *from, *gfrom, from_capacity;
+    struct str empty = { NULL, 0 }, prefix;
+    struct slist *st = &u->ds[d].states, view;
+    uint32_t t = d * u->n_cls + u->cls[c], n, f = NIL, final_out = 0, g, k, d_next, h;
+
+    if (st->n + 1 > from_capacity) {
+	from_capacity = 2 * (st->n + 1);
+	from = realloc(from, from_capacity * sizeof(uint32_t));
+	gfrom = realloc(gfrom, from_capacity * sizeof(uint32_t));
+	if (!from || !gfrom) {
+	    fprintf(stderr, "error: dft memory allocation failed\n");
+	    exit(EXIT_FAILURE);
+	}
+    }
+
+    n = groups_step(prog, st, c, &u->step, from);
+    arena_reset(&keep);
+    cur.n = 0;
+    for (k = 0; k < u->step.n; k++)
+	slist_append(&cur, u->step.items[k].pc, str_dup(&keep, u->step.items[k].suffix));
+
+    /* the first group with a final thread; its first final thread wins */
+    if (groups_step(prog, &cur, STEP_FINAL, &u->step, gfrom)) {
+	f = gfrom[0];
+	final_out = dft_add_output(u, u->step.items[0].suffix);
+	n = f;
+    }
+
+    if (u->n_recs + 3 + 2 * n > u->recs_capacity) {
+	uint32_t *recs;
+
+	u->recs_capacity = 2 * (u->n_recs + 3 + 2 * n);
+	recs = dft_grow(u, u->recs, u->n_recs * sizeof(uint32_t), u->recs_capacity * sizeof(uint32_t));
+	if (recs == NULL) {
+	    fprintf(stderr, "error: dft record re-allocation failed\n");
+	    exit(EXIT_FAILURE);
+	}
+	PUBLISH(u->recs, recs);
+    }
+    u->out[t] = u->n_recs;
+    u->recs[u->n_recs++] = f == NIL ? NIL : from[f];
+    u->recs[u->n_recs++] = final_out;
+    u->recs[u->n_recs++] = n;
+
+    /* the live groups give their common prefixes away */
+    u->step.n = 0;
+    for (g = 0, k = 0; g < n; g++) {
+	view.items = cur.items + k;
+	for (view.n = 0; k < cur.n && cur.items[k].pc != GROUP_SEP; k++)
+	    view.n++;
+	k++;
+	prefix = truncate_lcp(&view);
+	u->recs[u->n_recs++] = from[g];
+	u->recs[u->n_recs++] = prefix.len ? dft_add_output(u, prefix) : 0;
+	if (g)
+	    slist_append(&u->step, GROUP_SEP, empty);
+	for (uint32_t i = 0; i < view.n; i++)
+	    slist_append(&u->step, view.items[i].pc, view.items[i].suffix);
+    }
+    if (n)
+	slist_append(&u->step, GROUP_SEP, empty);
+    slist_append(&u->step, 0, empty);		/* a match may start at the next byte */
+
+    h = slist_hash(&u->step);
+    if ((d_next = dcache_lookup(u, &u->step, h)) == DS_UNKNOWN) {
+	d_next = dft_add_state(u, &u->step, h);
+	dcache_insert(u, d_next);
+	u->ds[d_next].final = 0;
+    }
+    PUBLISH(u->next[t], d_next);
+}
+
+/* The DFT section of a compiled file. Strings are spans of one byte
+ * section; the transition tables are used in place. */
+
+#define DFT_SAVE_MAX	(1 << 16)	/* states explored by -c */
+
+struct trreb_dft {
+    uint8_t cls[256];
+    uint32_t n_cls, n, n_outs, n_items;
+    uint64_t next_off, out_off, outs_off, states_off, items_off, bytes_off;
+    uint64_t n_bytes;
+};
+
+struct trreb_str {
+    uint32_t off, len;
 };
 
-struct str {
-    struct str_item *head;
-    struct str_item *tail;
+struct trreb_state {
+    uint32_t items, n_items;
+    uint32_t hash;
+    int32_t final;
+    struct trreb_str final_out;
+};
+
+struct trreb_item {
+    uint32_t pc;
+    struct trreb_str suffix;
 };
 
-struct str * str_create() {
-    struct str *st;
-    st = malloc(sizeof(struct str));
-    st->head = st->tail = NULL;
-    return st;
+/* the offsets and counts of a compiled DFT are 32 bits */
+void trreb_check_size(uint64_t n) {
+    if (n > UINT32_MAX) {
+	fprintf(stderr, "error: the DFT is too large for a compiled file, see -M\n");
+	exit(EXIT_FAILURE);
+    }
 }
 
-struct str * str_append(struct str *s, unsigned char c) {
-    struct str_item *si;
-    si = malloc(sizeof(struct str_item));
-    si->c = c;
-    si->next = NULL;
+struct trreb_str trreb_str(struct arena *bytes, struct str s) {
+    struct trreb_str r;
 
-    if (s->tail) {
-    	s->tail->next = si;
-    	s->tail = si;
-    } else {
-    	s->tail = s->head = si;
-    }
-    return s;
+    trreb_check_size((uint64_t)arena_used(bytes) + s.len);
+    r.off = arena_used(bytes);
+    r.len = s.len;
+    if (s.len)
+	memcpy(arena_bytes(bytes, s.len), s.p, s.len);
+    return r;
 }
 
-char str_popleft(struct str *s) {
-    unsigned char c;
-    struct str_item *tmp;
+uint64_t trreb_save_dft(FILE *fp, struct dft *dft) {
+    struct trreb_dft t;
+    struct trreb_state *states;
+    struct trreb_item *items;
+    struct trreb_str *outs;
+    struct arena bytes = { NULL, 0, 0 };
+    struct achunk *ch, *chunks = NULL;
+    uint64_t off;
+    size_t hdr = ALIGN_UP(sizeof(struct achunk), ARENA_ALIGN);
+
+    memset(&t, 0, sizeof t);
+    memcpy(t.cls, dft->cls, 256);
+    t.n_cls = dft->n_cls;
+    t.n = dft->n;
+    t.n_outs = dft->n_outs;
+    for (uint32_t d = 0; d < dft->n; d++) {
+	trreb_check_size((uint64_t)t.n_items + dft->ds[d].states.n);
+	t.n_items += dft->ds[d].states.n;
+    }
 
-    if (s->head == NULL) {
-	fprintf(stderr, "error: string underflow\n");
-    	exit(EXIT_FAILURE);
+    states = calloc(t.n, sizeof(struct trreb_state));
+    items = calloc(t.n_items ? t.n_items : 1, sizeof(struct trreb_item));
+    outs = calloc(t.n_outs, sizeof(struct trreb_str));
+    if (!states || !items || !outs) {
+	fprintf(stderr, "error: dft memory allocation failed\n");
+	exit(EXIT_FAILURE);
     }
 
-    // question: what if s->head == s->tail ??
-    c = s->head->c;
+    /* the strings go to one contiguous byte section; the arena
+     * chunks are big enough for any of them */
+    for (uint32_t k = 0; k < dft->n_outs; k++)
+	outs[k] = trreb_str(&bytes, dft->outs[k]);
+    for (uint32_t d = 0, k = 0; d < dft->n; d++) {
+	states[d].items = k;
+	states[d].n_items = dft->ds[d].states.n;
+	states[d].hash = dft->ds[d].hash;
+	states[d].final = dft->ds[d].final;
+	states[d].final_out = trreb_str(&bytes, dft->ds[d].final_out);
+	for (uint32_t j = 0; j < dft->ds[d].states.n; j++, k++) {
+	    items[k].pc = dft->ds[d].states.items[j].pc;
+	    items[k].suffix = trreb_str(&bytes, dft->ds[d].states.items[j].suffix);
+	}
+    }
 
-    if (s->head == s->tail) {
-    	free(s->head);
-    	s->head = s->tail = NULL;
-    } else {
-	tmp = s->head;
-	s->head = s->head->next;
-	free(tmp);
+    off = trreb_write(fp, &t, sizeof t);
+    t.next_off = trreb_write(fp, dft->next, (size_t)t.n * t.n_cls * sizeof(uint32_t));
+    t.out_off = trreb_write(fp, dft->out, (size_t)t.n * t.n_cls * sizeof(uint32_t));
+    t.outs_off = trreb_write(fp, outs, t.n_outs * sizeof(struct trreb_str));
+    t.states_off = trreb_write(fp, states, t.n * sizeof(struct trreb_state));
+    t.items_off = trreb_write(fp, items, t.n_items * sizeof(struct trreb_item));
+
+    /* chunks are linked newest first */
+    for (ch = bytes.head; ch != NULL; ch = bytes.head) {
+	bytes.head = ch->next;
+	ch->next = chunks;
+	chunks = ch;
     }
+    t.bytes_off = ftell(fp);
+    t.n_bytes = arena_used(&bytes);
+    for (ch = chunks; ch != NULL; ch = ch->next)
+	if (ch->used && fwrite((char*)ch + hdr, 1, ch->used, fp) != ch->used) {
+	    fprintf(stderr, "error: can not write the compiled file\n");
+	    exit(EXIT_FAILURE);
+	}
+    trreb_pad(fp);
+    bytes.head = chunks;
+    arena_free(&bytes);
 
-    return c;
+    if (fseek(fp, off, SEEK_SET) != 0 || fwrite(&t, sizeof t, 1, fp) != 1 || fseek(fp, 0, SEEK_END) != 0) {
+	fprintf(stderr, "error: can not write the compiled file\n");
+	exit(EXIT_FAILURE);
+    }
+    free(states);
+    free(items);
+    free(outs);
+    return off;
 }
 
-struct str * str_append_str(struct str *dst, struct str *src) {
-    for(struct str_item *si = src->head; si != NULL; si = si->next) {
-    	str_append(dst, si->c);
+struct str trreb_span(struct trreb_str s, unsigned char *bytes, uint64_t n_bytes, char *fn) {
+    struct str r = { NULL, 0 };
+
+    if ((uint64_t)s.off + s.len > n_bytes) {
+	fprintf(stderr, "error: %s is corrupted\n", fn);
+	exit(EXIT_FAILURE);
     }
-    return dst;
+    if (s.len) {
+	r.p = bytes + s.off;
+	r.len = s.len;
+    }
+    return r;
 }
 
-struct str * str_copy(struct str* src) {
-    struct str *dst = str_create();
-    assert(src);
+/* one allocation per table, the states and strings point into the file */
+struct dft * trreb_load_dft(struct prog *prog, struct trreb_header *h, size_t len, char *fn) {
+    char *base = (char*)h;
+    struct trreb_dft *t;
+    struct trreb_state *states;
+    struct trreb_item *items;
+    struct trreb_str *outs;
+    struct slitem *list;
+    unsigned char *bytes;
+    struct dft *dft;
+    uint64_t cells;
+
+    t = trreb_at(base, len, h->ext_off, sizeof *t, fn);
+    cells = (uint64_t)t->n * t->n_cls;
+    if (t->n == 0 || t->n_outs == 0 || t->n_cls == 0 || t->n_cls > 256) {
+	fprintf(stderr, "error: %s is corrupted\n", fn);
+	exit(EXIT_FAILURE);
+    }
 
-    for(struct str_item *si = src->head; si != NULL; si = si->next) {
-    	str_append(dst, si->c);
+    dft = calloc(1, sizeof(struct dft));
+    if (dft == NULL) {
+	fprintf(stderr, "error: dft memory allocation failed\n");
+	exit(EXIT_FAILURE);
     }
-    return dst;
-}
+    memcpy(dft->cls, t->cls, 256);
+    dft->n_cls = t->n_cls;
+    dft->next = trreb_at(base, len, t->next_off, cells * sizeof(uint32_t), fn);
+    dft->out = trreb_at(base, len, t->out_off, cells * sizeof(uint32_t), fn);
+    dft->mapped = 1;
+    outs = trreb_at(base, len, t->outs_off, (uint64_t)t->n_outs * sizeof(struct trreb_str), fn);
+    states = trreb_at(base, len, t->states_off, (uint64_t)t->n * sizeof(struct trreb_state), fn);
+    items = trreb_at(base, len, t->items_off, (uint64_t)t->n_items * sizeof(struct trreb_item), fn);
+    bytes = trreb_at(base, len, t->bytes_off, t->n_bytes, fn);
+
+    for (uint64_t k = 0; k < cells; k++)
+	if ((dft->next[k] < DS_DEAD && dft->next[k] >= t->n) || dft->out[k] >= t->n_outs) {
+	    fprintf(stderr, "error: %s is corrupted\n", fn);
+	    exit(EXIT_FAILURE);
+	}
 
-void str_free(struct str* s) {
-    struct str_item *si, *next;
-    if (!s) return;
+    dft->n_outs = dft->outs_capacity = t->n_outs;
+    dft->outs = malloc(t->n_outs * sizeof(struct str));
+    dft->n = dft->capacity = t->n;
+    dft->ds = malloc(t->n * sizeof(struct dstate));
+    list = malloc((t->n_items ? t->n_items : 1) * sizeof(struct slitem));
+    for (dft->table_capacity = 128; dft->table_capacity < 2 * (t->n + 1); dft->table_capacity *= 2)
+	;
+    dft->table = malloc(dft->table_capacity * sizeof(uint32_t));
+    if (!dft->outs || !dft->ds || !list || !dft->table) {
+	fprintf(stderr, "error: dft memory allocation failed\n");
+	exit(EXIT_FAILURE);
+    }
+    memset(dft->table, 0xff, dft->table_capacity * sizeof(uint32_t));
 
-    for(si = s->head; si != NULL;) {
-    	next = si->next;
-    	free(si);
-    	si = next;
+    for (uint32_t k = 0; k < t->n_outs; k++)
+	dft->outs[k] = trreb_span(outs[k], bytes, t->n_bytes, fn);
+    for (uint32_t k = 0; k < t->n_items; k++) {
+	if (items[k].pc >= prog->n) {
+	    fprintf(stderr, "error: %s is corrupted\n", fn);
+	    exit(EXIT_FAILURE);
+	}
+	list[k].pc = items[k].pc;
+	list[k].suffix = trreb_span(items[k].suffix, bytes, t->n_bytes, fn);
+    }
+    for (uint32_t d = 0; d < t->n; d++) {
+	if ((uint64_t)states[d].items + states[d].n_items > t->n_items) {
+	    fprintf(stderr, "error: %s is corrupted\n", fn);
+	    exit(EXIT_FAILURE);
+	}
+	dft->ds[d].states.items = list + states[d].items;
+	dft->ds[d].states.n = states[d].n_items;
+	dft->ds[d].states.capacity = 0;
+	dft->ds[d].hash = states[d].hash;
+	dft->ds[d].final = states[d].final;
+	dft->ds[d].final_out = trreb_span(states[d].final_out, bytes, t->n_bytes, fn);
+	dft->ds[d].finals = NULL;
+	dft->ds[d].n_finals = 0;
+	dcache_insert(dft, d);
     }
-    free(s);
+    return dft;
 }
 
-void str_print(struct str *s) {
-    assert(s);
-    for(struct str_item *si=s->head; si != NULL; si=si->next)
-    	fputc(si->c, stdout);
+/* append a string to the output buffer */
+void output_append(size_t *o, struct str s) {
+    while (*o + s.len >= output_capacity)
+	output = resize_output(output, &output_capacity);
+    if (s.len)
+	memcpy(output + *o, s.p, s.len);
+    *o += s.len;
 }
 
-void str_to_char(struct str *s, unsigned char *ch) {
-    assert(s);
-    int i = 0;
-    for(struct str_item *si=s->head; si != NULL; si=si->next)
-    	ch[i++] = si->c;
-    ch[i] = '\0';
+/* input bytes for the fallback heuristic; the -j pool counts them for
+ * a shared DFT */
+void dft_count(struct dft *dft, size_t n) {
+    if (!dft->shared)
+	dft->nbytes += n;
 }
 
+/* Explore a transition of a shared DFT unless another thread has done
+ * it meanwhile. Over the budget the flush is left to the -j pool, it
+ * waits for the threads to stop between their batches. */
+void dft_explore_shared(struct prog *prog, struct dft *dft, uint32_t d, unsigned char c,
+			void (*explore)(struct prog *, struct dft *, uint32_t, unsigned char)) {
+    pthread_mutex_lock(&dft->lock);
+    if (dft->next[d * dft->n_cls + dft->cls[c]] == DS_UNKNOWN) {
+	if (dft->budget && dft_mem(dft) > dft->budget)
+	    PUBLISH(dft->flush_pending, 1);
+	explore(prog, dft, d, c);
+    }
+    pthread_mutex_unlock(&dft->lock);
+}
 
+/* Simulate the nft directly, one state list per input byte. It has
+ * the semantics of infer_dft but caches nothing. */
+ssize_t infer_nft(struct prog *prog, struct dft *dft, unsigned char *inp, size_t len, enum infer_mode mode) {
+    static __thread struct slist lists[2], step;
+    static __thread struct arena keeps[2];
+    struct slist *cur = &lists[0];
+    struct str empty = { NULL, 0 }, prefix;
+    size_t o = 0, i;
+    int b = 0;
+
+    cur->n = 0;
+    slist_append(cur, 0, empty);
+
+    for (i = 0; i < len; i++) {
+
+	if (mode == SCAN && i > 0) {
+	    nft_step(prog, cur, STEP_FINAL, &step);
+	    if (step.n) {
+		out_write(output, o);
+		str_print(step.items[0].suffix);
+		dft_count(dft, i);
+		return i;
+	    }
+	}
 
-struct slist {
-    struct slitem *head;
-    struct slitem *tail;
-    size_t n;
-};
-
-struct slitem {
-    struct nstate *state;
-    struct str *suffix;
-    struct slitem *next;
-};
-
-struct slist * slist_create() {
-    struct slist *sl;
-    sl = malloc(sizeof(struct slist));
-    sl->head = sl->tail = NULL;
-    sl->n = 0;
-
-    return sl;
-}
+	nft_step(prog, cur, inp[i], &step);
+	if (step.n == 0)
+	    break;
 
-struct slist * slist_append(struct slist *sl, struct nstate *state, struct str *suffix) {
-    struct slitem *li;
-    li = malloc(sizeof(struct slitem));
-    li->state = state;
-    li->suffix = suffix;
-    li->next = NULL;
+	prefix = truncate_lcp(&step);
+	output_append(&o, prefix);
 
-    if (sl->tail) {
-    	sl->tail->next = li;
-    	sl->tail = li;
-    } else {
-    	sl->tail = sl->head = li;
+	/* the lists alternate between two arenas */
+	b ^= 1;
+	cur = &lists[b];
+	cur->n = 0;
+	arena_reset(&keeps[b]);
+	for (uint32_t k = 0; k < step.n; k++)
+	    slist_append(cur, step.items[k].pc, str_dup(&keeps[b], step.items[k].suffix));
     }
-    sl->n += 1;
-    return sl;
-}
+    dft_count(dft, i);
 
+    if (mode == SCAN && i > 0) {
+	nft_step(prog, cur, STEP_FINAL, &step);
+	if (step.n) {
+	    out_write(output, o);
+	    str_print(step.items[0].suffix);
+	    return i;
+	}
+    }
 
-void slist_free(struct slist* sl) {
-    struct slitem *li, *next;
-    if (!sl) return;
-
-    for(li = sl->head; li != NULL;) {
-    	next = li->next;
-    	str_free(li->suffix);
-    	free(li);
-    	li = next;
+    if (mode == MATCH && i == len) {
+	nft_step(prog, cur, STEP_FINAL, &step);
+	for (uint32_t k = 0; k < step.n && (all || k == 0); k++) {
+	    out_write(output, o);
+	    str_print(step.items[k].suffix);
+	    out_newline();
+	}
+	return step.n ? (ssize_t)i : -1;
     }
-    free(sl);
+
+    return -1;
 }
 
+ssize_t infer_dft(struct prog *prog, struct dft *dft, unsigned char *inp, size_t len, enum infer_mode mode) {
+    uint32_t d = 0, t, next;
+    struct dstate *ds;
+    size_t o = 0, i;
 
-void nft_step_(struct nstate *s, struct str *o, unsigned char c, struct slist *sl) {
-    if (!s) return;
+    /* the start state is left before its final test in the scan
+     * mode, so it has none: the empty line is matched on the nft */
+    if (dft->fallback || (mode == MATCH && len == 0))
+	return infer_nft(prog, dft, inp, len, mode);
 
+    for (i = 0; i < len; i++) {
 
-    switch(s->type) {
-	case SPLIT:
-	    nft_step_(s->nextb, o, c, sl);
-	    nft_step_(s->nexta, str_copy(o), c, sl);
-	    break;
-	case SPLITNG:
-	    nft_step_(s->nexta, o, c, sl);
-	    nft_step_(s->nextb, str_copy(o), c, sl);
-	    break;
-	case JOIN:
-	    nft_step_(s->nexta, o, c, sl);
-	    break;
-	case PROD:
-	    nft_step_(s->nexta, str_append(o, s->val), c, sl);
-	    break;
-	case CONS:	// found CONS state marked with 'c'
-	    if (c == s->val && s->visited == 0) {
-	    	s->visited = 1;
-		slist_append(sl, s, o);
+	ds = LOAD(dft->ds);
+	if (mode == SCAN && ds[d].final == 1) {
+	    out_write(output, o);
+	    str_print(ds[d].final_out);
+	    dft_count(dft, i);
+	    stats.lookups += i;
+	    return i;
+	}
+
+	t = d * dft->n_cls + dft->cls[inp[i]];
+	if ((next = LOAD(LOAD(dft->next)[t])) == DS_UNKNOWN) {	/* not explored, explore */
+	    stats.misses++;
+	    if (dft->shared)
+		dft_explore_shared(prog, dft, d, inp[i], dft_explore);
+	    else {
+		if (dft->budget && dft_mem(dft) > dft->budget) {
+		    d = dft_flush(dft, d);
+		    t = d * dft->n_cls + dft->cls[inp[i]];
+		}
+		dft_explore(prog, dft, d, inp[i]);
 	    }
+	    next = LOAD(LOAD(dft->next)[t]);
+	}
+	if (next == DS_DEAD)				/* explored but found nothing */
 	    break;
-	case FINAL:
-	    if(c == '\0' && s->visited == 0) {	/* final states closure */
-		slist_append(sl, s, o);
-	    	s->visited = 1;
-	    }
-	    return;
+
+	output_append(&o, LOAD(dft->outs)[LOAD(dft->out)[t]]);
+	d = next;
     }
-    return;
-}
+    dft_count(dft, i);
+    stats.lookups += i + (i < len);	/* and the dead one */
 
+    ds = LOAD(dft->ds);
+    if (mode == SCAN && ds[d].final == 1) {
+	out_write(output, o);
+	str_print(ds[d].final_out);
+	return i;
+    }
 
-struct slist * nft_step(struct slist *states, unsigned char c) {
-    struct slist *sl = slist_create();
-    struct slitem *li;
+    /* a line per output */
+    if (mode == MATCH && i == len && ds[d].final == 1) {
+	for (uint32_t k = 0; k < (all ? ds[d].n_finals : 1); k++) {
+	    out_write(output, o);
+	    str_print(all ? ds[d].finals[k] : ds[d].final_out);
+	    out_newline();
+	}
+	return i;
+    }
 
-    for(li=states->head; li; li=li->next)
-	nft_step_(li->state->nexta, str_copy(li->suffix), c, sl);
+    return -1;
+}
 
-    /* reset the visited flag; yes it is linear
-     * but the list have to be short */
-    for(li=sl->head; li; li=li->next)
-    	li->state->visited = 0;
+/* Pending matches of the unanchored scan. A live group maps to a
+ * group of the current state; a frozen group has turned final while
+ * an earlier group was still alive and waits for it to fail. */
 
-    return sl;
-}
+struct ubuf {
+    unsigned char *p;
+    size_t len, capacity;
+};
 
+struct ugroup {
+    size_t start, end;		/* offsets in the line; end once frozen */
+    struct ubuf out;		/* output since the start */
+};
 
-struct dstate {
-    struct slist *states;
-    struct str *final_out;
-    int8_t final;
-    struct str *out[256];
-    struct dstate *next[256];
+struct ugroups {
+    struct ugroup *g;
+    uint32_t n, head, capacity;
 };
 
-struct dstate * dstate_create(struct slist *states) {
-    struct dstate *ds;
-    ds = malloc(sizeof(struct dstate));
-    ds->states = states;
-    ds->final = -1;
-    memset(ds->next, 0, sizeof ds->next);
-    memset(ds->out, 0, sizeof ds->out);
-    return ds;
+static __thread struct ugroups live, frozen;
+static __thread struct ubuf *spare;	/* buffers of the dropped groups */
+static __thread uint32_t n_spare, spare_capacity;
+
+void ubuf_append(struct ubuf *b, struct str s) {
+    if (b->capacity == 0 && n_spare)	/* buffers are taken on the first output */
+	*b = spare[--n_spare];
+    if (b->len + s.len > b->capacity) {
+	b->capacity = 2 * (b->len + s.len);
+	b->p = realloc(b->p, b->capacity);
+	if (b->p == NULL) {
+	    fprintf(stderr, "error: output re-allocation failed\n");
+	    exit(EXIT_FAILURE);
+	}
+    }
+    if (s.len)
+	memcpy(b->p + b->len, s.p, s.len);
+    b->len += s.len;
 }
 
-int dstack_lookup(struct dstate **b, struct dstate **e, struct dstate *v) {
-    while(b != e)
-	if (v == *(--e)) return 1;
-    return 0;
+void ubuf_drop(struct ubuf b) {
+    if (b.capacity == 0)
+	return;
+    b.len = 0;
+    if (n_spare == spare_capacity) {
+	spare_capacity = spare_capacity ? 2 * spare_capacity : 16;
+	spare = realloc(spare, spare_capacity * sizeof(struct ubuf));
+	if (spare == NULL) {
+	    fprintf(stderr, "error: output re-allocation failed\n");
+	    exit(EXIT_FAILURE);
+	}
+    }
+    spare[n_spare++] = b;
 }
 
+struct ugroup * ugroups_push(struct ugroups *gs, size_t start) {
+    struct ugroup *g;
 
-void plot_dft(struct dstate *dstart) {
-    struct dstate *stack[1024];
-    struct dstate *visited[1024];
-
-    struct dstate **sp = stack;
-    struct dstate **vp = visited;
-    struct dstate *s = dstart, *s_next = NULL;
-    unsigned char out[32], label[32];
-
-    printf("digraph G {\n\tsplines=true; rankdir=LR;\n");
-
-    push(sp, s);
-    while (sp != stack) {
-        s = pop(sp);
-        push(vp, s);
-
-        if (s->final == 1) {
-            str_to_char(s->final_out, out);
-	    printf("\t\"%p\" [peripheries=2, label=\"%s\"];\n", (void*)s, out);
+    if (gs->n == gs->capacity) {
+	gs->capacity = gs->capacity ? 2 * gs->capacity : 16;
+	gs->g = realloc(gs->g, gs->capacity * sizeof(struct ugroup));
+	if (gs->g == NULL) {
+	    fprintf(stderr, "error: scan re-allocation failed\n");
+	    exit(EXIT_FAILURE);
 	}
-        else
-            printf("\t\"%p\" [label=\"\"];\n", (void*)s);
-
-	for(int c=0; c < 256; c++) {
-	    if ((s_next = s->next[c]) != NULL) {
-	    	str_to_char(s->out[c], label);
-		printf("\t\"%p\" -> \"%p\" [label=\"%c:%s\"];\n", (void*)s, (void*)s_next, c, label);
-		if (!dstack_lookup(visited, vp, s_next))
-		    push(sp, s_next);
-	    }
-        }
     }
-    printf("}\n");
+    g = &gs->g[gs->n++];
+    g->start = start;
+    g->end = 0;
+    memset(&g->out, 0, sizeof g->out);
+    return g;
 }
 
+/* write the frozen matches that no live group precedes */
+void ugroups_commit(unsigned char *line, size_t *done, int all) {
+    struct ugroup *g;
 
+    while (frozen.head < frozen.n) {
+	g = &frozen.g[frozen.head];
+	if (!all && live.n && live.g[0].start < g->start)
+	    break;
+	out_write(line + *done, g->start - *done);
+	out_write(g->out.p, g->out.len);
+	*done = g->end;
+	ubuf_drop(g->out);
+	frozen.head++;
+    }
+    if (frozen.head == frozen.n)
+	frozen.head = frozen.n = 0;
+}
 
-struct str * truncate_lcp(struct slist *sl, struct str *prefix) {
-    struct slitem *li;
-    unsigned char ch;
-
-    for(;;) {
-    	if(!sl->head->suffix->head) 			/* end of lcp */
-    	    return prefix;
-
-    	ch = sl->head->suffix->head->c;			/* omg */
-	for(li=sl->head; li; li=li->next) {
-	    if (!li->suffix || !li->suffix->head || li->suffix->head->c != ch)
-		return prefix;
+/* Rewrite a line in one left-to-right pass over the unanchored DFT.
+ * The result is the one of restarting infer_dft at every byte: the
+ * leftmost match wins, the shortest of it, and the scan goes on after
+ * its end. Bytes before the earliest pending match are written as
+ * spans as soon as no match can cover them. */
+void scan_dft(struct prog *prog, struct dft *u, struct skip *sk, unsigned char *line, size_t len) {
+    uint32_t d = 0, d_next, t, *rec, f, n, k, r;
+    struct str *outs;
+    size_t i, done = 0, lookups = 0;
+    struct ugroup *g;
+
+    live.n = 0;
+    frozen.n = frozen.head = 0;
+    ugroups_push(&live, 0);
+
+    for (i = 0; i < len; i++) {
+	if (d == 0 && sk->enabled) {	/* nothing pending, skip ahead */
+	    size_t next = (unsigned char*)skip_next(sk, (char*)line + i, (char*)line + len) - line;
+	    if (next == len)
+		break;
+	    i = next;
+	    live.g[0].start = i;
 	}
 
-	/* we found the common char,
-	 * - add the char to the prefix,
-	 * - truncate the suffixes */
-	str_append(prefix, ch);
-	for(li=sl->head; li; li=li->next)
-	    str_popleft(li->suffix);
+	t = d * u->n_cls + u->cls[line[i]];
+	lookups++;
+	if ((d_next = LOAD(LOAD(u->next)[t])) == DS_UNKNOWN) {
+	    stats.misses++;
+	    if (u->shared)
+		dft_explore_shared(prog, u, d, line[i], udft_explore);
+	    else {
+		if (u->budget && dft_mem(u) > u->budget) {
+		    d = dft_flush(u, d);
+		    t = d * u->n_cls + u->cls[line[i]];
+		}
+		udft_explore(prog, u, d, line[i]);
+	    }
+	    d_next = LOAD(LOAD(u->next)[t]);
+	}
+	rec = LOAD(u->recs) + LOAD(u->out)[t];
+	outs = LOAD(u->outs);
+	f = rec[0];
+	n = rec[2];
+
+	/* carry the live groups over in place; the others are dropped */
+	for (k = 0, r = 0; k < live.n; k++) {
+	    g = &live.g[k];
+	    if (r < n && rec[3 + 2 * r] == k) {
+		if (rec[4 + 2 * r])
+		    ubuf_append(&g->out, outs[rec[4 + 2 * r]]);
+		if (r != k)
+		    live.g[r] = *g;
+		r++;
+	    } else if (k == f) {
+		if (k == 0 && frozen.head == frozen.n) {	/* the leftmost match */
+		    out_write(line + done, g->start - done);
+		    out_write(g->out.p, g->out.len);
+		    str_print(outs[rec[1]]);
+		    done = i + 1;
+		    ubuf_drop(g->out);
+		} else {
+		    /* frozen: the later pending matches can not win any more */
+		    while (frozen.n > frozen.head && frozen.g[frozen.n - 1].start > g->start)
+			ubuf_drop(frozen.g[--frozen.n].out);
+		    ubuf_append(&g->out, outs[rec[1]]);
+		    g->end = i + 1;
+		    *ugroups_push(&frozen, 0) = *g;
+		}
+		for (k++; k < live.n; k++)
+		    ubuf_drop(live.g[k].out);
+		break;
+	    } else
+		ubuf_drop(g->out);
+	}
+	live.n = r;
+	ugroups_push(&live, i + 1);
+	d = d_next;
+
+	if (frozen.head < frozen.n)
+	    ugroups_commit(line, &done, 0);
+	if (live.g[0].start > done) {
+	    out_write(line + done, live.g[0].start - done);
+	    done = live.g[0].start;
+	}
     }
-    return prefix;
+    dft_count(u, len);
+    stats.lookups += lookups;
+
+    /* the live groups can not match any more */
+    for (k = 0; k < live.n; k++)
+	ubuf_drop(live.g[k].out);
+    live.n = 0;
+    ugroups_commit(line, &done, 1);
+    out_write(line + done, len - done);
 }
 
-/* lexicographic comparison */
-int str_cmp(struct str *a, struct str *b) {
-    struct str_item *ai, *bi;
-    for(ai=a->head, bi=b->head; ai && bi; ai=ai->next, bi=bi->next)
-    	if (ai->c < bi->c)
-    	    return -1;
-	else if (ai->c > bi->c)
-    	    return 1;
-    if (ai)
-	return 1;
-    if (bi)
-	return -1;
+/* a byte count with an optional k, m or g suffix */
+size_t parse_size(char *arg) {
+    char *end;
+    size_t n = strtoul(arg, &end, 10);
 
-    return 0;
+    switch (*end) {
+	case 'k': case 'K':	n <<= 10; end++; break;
+	case 'm': case 'M':	n <<= 20; end++; break;
+	case 'g': case 'G':	n <<= 30; end++; break;
+    }
+    if (end == arg || *end != '\0') {
+	fprintf(stderr, "error: invalid size %s\n", arg);
+	exit(EXIT_FAILURE);
+    }
+    return n;
 }
 
-int list_cmp(struct slist *a, struct slist *b) {
-    struct slitem *ai, *bi;
-    int sign;
+/* Line input. A regular file is mapped whole and its lines are used
+ * in place; a pipe is read in large blocks and only the line that
+ * straddles two blocks is moved. The lines are spans, so a last line
+ * without the newline and the NUL bytes in a line are kept. */
 
-    if(a->n < b->n)
-    	return -1;
-    if(a->n > b->n)
-    	return 1;
+#define INPUT_BLOCK	(1 << 20)
 
-    for(ai=a->head, bi=b->head; ai && bi; ai=ai->next, bi=bi->next)
-	if(ai->state < bi->state)
-	    return -1;
-	else if(ai->state > bi->state)
-	    return 1;
-	else {
-	    sign = str_cmp(ai->suffix, bi->suffix);
-	    if (sign != 0)
-		return sign;
-	}
+struct input {
+    int fd;
+    char *map;			/* the mapped file, or NULL */
+    char *buf;			/* the block buffer otherwise */
+    size_t size;		/* bytes mapped or buffered */
+    size_t capacity;
+    size_t pos;			/* start of the next line */
+    size_t scanned;		/* no newline in [pos, scanned) */
+    int eof;
+    size_t total, lines;	/* bytes and lines handed out */
+};
 
-    return 0;
-}
+struct input * input_open(char *fn) {
+    struct input *in = calloc(1, sizeof(struct input));
+    struct stat st;
+    off_t off;
 
+    if (in == NULL) {
+	fprintf(stderr, "error: memory allocation failed\n");
+	exit(EXIT_FAILURE);
+    }
+    in->fd = fn ? open(fn, O_RDONLY) : STDIN_FILENO;
+    if (in->fd < 0 || fstat(in->fd, &st) != 0) {
+	fprintf(stderr, "error: can not open file %s\n", fn ? fn : "stdin");
+	exit(EXIT_FAILURE);
+    }
 
-// Define the structure for the tree node
-struct btnode {
-    struct dstate *ds;
-    struct btnode *l;
-    struct btnode *r;
-};
+    /* the files of /proc and alike report no size, they are read */
+    if (S_ISREG(st.st_mode) && st.st_size > 0 && (off = lseek(in->fd, 0, SEEK_CUR)) >= 0) {
+	in->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, in->fd, 0);
+	if (in->map != MAP_FAILED) {
+	    madvise(in->map, st.st_size, MADV_SEQUENTIAL);
+	    in->size = st.st_size;
+	    in->pos = in->scanned = (size_t)off < in->size ? (size_t)off : in->size;
+	    in->eof = 1;
+	    return in;
+	}
+	in->map = NULL;
+    }
 
-// Function to create a new node with given data
-struct btnode* bt_create(struct dstate *ds) {
-    struct btnode* node;
-    node = malloc(sizeof(struct btnode));
-    if (node == NULL) {
-        printf("error: binary tree node allocation failed.\n");
+    in->capacity = INPUT_BLOCK;
+    in->buf = malloc(in->capacity);
+    if (in->buf == NULL) {
+	fprintf(stderr, "error: memory allocation failed\n");
 	exit(EXIT_FAILURE);
     }
-    node->ds = ds;
-    node->l = NULL;
-    node->r = NULL;
-    return node;
+    return in;
 }
 
-// Lookup function to search for a value in the binary tree
-struct dstate* bt_lookup(struct btnode *n, struct slist *sl) {
-    int sign = 0;
+/* the next line without its newline; 0 at the end of the input */
+int input_line(struct input *in, char **line, size_t *len) {
+    char *base = in->map ? in->map : in->buf, *q;
+    ssize_t n;
+
+    for (;;) {
+	q = memchr(base + in->scanned, '\n', in->size - in->scanned);
+	if (q != NULL) {
+	    *line = base + in->pos;
+	    *len = q - *line;
+	    in->total += *len + 1;
+	    in->lines++;
+	    in->pos = in->scanned = q - base + 1;
+	    return 1;
+	}
+	in->scanned = in->size;
+	if (in->eof) {
+	    if (in->pos == in->size)
+		return 0;
+	    *line = base + in->pos;	/* no newline at the end */
+	    *len = in->size - in->pos;
+	    in->total += *len;
+	    in->lines++;
+	    in->pos = in->size;
+	    return 1;
+	}
 
-    while (n != NULL) {
-    	sign = list_cmp(sl, n->ds->states);
-        if (sign < 0)		/* less */
-            n = n->l;
-        else if (sign > 0)	/* more */
-            n = n->r;
-        else
-            return n->ds; 	/* found */
+	/* keep the partial line and read the next block after it */
+	if (in->pos > 0) {
+	    memmove(in->buf, in->buf + in->pos, in->size - in->pos);
+	    in->size -= in->pos;
+	    in->scanned -= in->pos;
+	    in->pos = 0;
+	}
+	if (in->size == in->capacity) {
+	    in->capacity *= 2;
+	    in->buf = realloc(in->buf, in->capacity);
+	    if (in->buf == NULL) {
+		fprintf(stderr, "error: input re-allocation failed\n");
+		exit(EXIT_FAILURE);
+	    }
+	}
+	base = in->buf;
+	n = read(in->fd, in->buf + in->size, in->capacity - in->size);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n < 0) {
+	    fprintf(stderr, "error: can not read the input\n");
+	    exit(EXIT_FAILURE);
+	}
+	if (n == 0)
+	    in->eof = 1;
+	in->size += n;
     }
-    return NULL;
 }
 
-// Function to insert nodes to form a binary search tree
-struct btnode* bt_insert(struct btnode* n, struct dstate *ds) {
-    int sign;
-    if (n == NULL)
-        return bt_create(ds);
-    sign = list_cmp(ds->states, n->ds->states);
-    if (sign < 0)
-        n->l = bt_insert(n->l, ds);
-    else if (sign > 0)
-	n->r = bt_insert(n->r, ds);
-    return n;
+void input_close(struct input *in) {
+    if (in->map)
+	munmap(in->map, in->size);
+    free(in->buf);
+    if (in->fd != STDIN_FILENO)
+	close(in->fd);
+    free(in);
 }
 
-void bt_free(struct btnode* root) {
-    if (root == NULL) return;
-    bt_free(root->l);
-    bt_free(root->r);
-    free(root);
-}
 
+/* what the line loop needs; a -j worker has its own DFT caches */
+struct engine {
+    struct prog *prog;
+    struct dft *dft, *udft;
+    struct skip *sk;
+    struct filter *flt;
+    enum infer_mode mode;
+};
 
-int infer_dft(struct dstate *dstart, unsigned char *inp, struct btnode *dcache, enum infer_mode mode) {
-    struct dstate *ds_next, *ds=dstart;
-    struct str *prefix, *out = str_create();
-    struct slist *sl;
+void process_line(struct engine *e, char *line, size_t n) {
+    char *ch = line, *end = line + n, *next;
+    ssize_t ioffset;
 
-    unsigned char *c;
-    int i = 0;
+    if (e->mode != SCAN) {	/* MATCH mode and generator, nothing if no match */
+	if (filter_pass(e->flt, line, n, 1))
+	    infer_dft(e->prog, e->dft, (unsigned char*)line, n, e->mode);
+	return;
+    }
 
-    for(c=inp; *c != '\0'; c++, i++) {
+    if (!filter_pass(e->flt, line, n, 0)) {
+	out_write(line, n);
+	out_newline();
+	return;
+    }
+    if (e->udft && !e->udft->fallback) {
+	scan_dft(e->prog, e->udft, e->sk, (unsigned char*)line, n);
+	out_newline();
+	return;
+    }
 
-	if (mode == SCAN && ds->final == 1) {
-	    str_print(out);
-	    str_print(ds->final_out);
-	    str_free(out);
-	    return i;
+    while (ch < end) {
+	if (e->sk->enabled) {	/* copy what no match can start at */
+	    next = skip_next(e->sk, ch, end);
+	    out_write(ch, next - ch);
+	    if ((ch = next) == end)
+		break;
 	}
+	ioffset = infer_dft(e->prog, e->dft, (unsigned char*)ch, end - ch, e->mode);
+	if (ioffset > 0)
+	    ch += ioffset;
+	else
+	    out_byte(*ch++);
+    }
+    infer_dft(e->prog, e->dft, (unsigned char*)ch, 0, e->mode);
+    out_newline();
+}
 
-	// todo: double check this logic
-	if (ds->next[*c] != NULL) {
-	    str_append_str(out, ds->out[*c]);
-	    ds = ds->next[*c];
-	}
-	else if (ds->out[*c] != NULL) {				/* already explored but found nothing */
-	    break;
-	}
-	else {							/* not explored, explore */
-	    sl = nft_step(ds->states, *c);
+/* Parallel lines, -j N. The main thread cuts the input into batches
+ * of whole lines, hands them to N workers through a ring and writes
+ * the outputs back in the input order, so the ring slot to refill is
+ * always the one to write next. Lines of a mapped file are used in
+ * place; the lines of a pipe are copied, as its buffer moves. The
+ * workers share the lazy DFT: a state found by one is there for all.
+ * A shared DFT over its budget is flushed between the batches, once
+ * no worker is inside one. */
+
+#define BATCH_BYTES	(1 << 18)
+#define BATCH_RING	4		/* batches per worker */
+
+enum batch_state { BATCH_FREE, BATCH_READY, BATCH_DONE };
+
+struct batch {
+    char *p;			/* the lines, separated by newlines */
+    size_t len, n_lines;
+    char *copy;			/* owned lines of a pipe */
+    size_t copy_capacity;
+    char *out;			/* the output of the lines */
+    size_t out_len, out_capacity;
+    enum batch_state state;
+};
 
-	    /* expand each state and accumulate CONS states labeled with c */
-	    if (!sl->head) {					/* got empty list; mark as explored and exit */
-	    	ds->out[*c] = (struct str*)1;			/* fixme: can we create a better indicator? */
-	    	slist_free(sl);
-	    	break;
-	    }
+struct pool {
+    struct engine *e;		/* shared by the workers */
+    struct batch *b;
+    size_t n_b;
+    size_t filled, taken;	/* batches handed out and picked up */
+    int eof;
+    int active;			/* workers inside a batch */
+    struct stats stats;		/* of the workers that are done */
+    pthread_mutex_t lock;
+    pthread_cond_t ready, done, idle;
+};
 
-	    prefix = str_create();
-	    truncate_lcp(sl, prefix);
+/* the next batch of lines; 0 at the end of the input */
+int batch_fill(struct batch *b, struct input *in, size_t max) {
+    char *line, *first = NULL;
+    size_t n;
 
-	    if ((ds_next = bt_lookup(dcache, sl)) != NULL) {
-	    	ds->next[*c] = ds_next;
-	    	ds->out[*c] = prefix;
-	    	slist_free(sl);					/* no need for the list */
-	    } else {
-	    	ds_next = dstate_create(sl);
-	    	ds->next[*c] = ds_next;
-	    	ds->out[*c] = prefix;
-	    	bt_insert(dcache, ds_next);
+    b->len = b->n_lines = 0;
+    while (b->len < max && input_line(in, &line, &n)) {
+	if (in->map) {		/* the lines lie in the map in a row */
+	    if (first == NULL)
+		first = line;
+	    b->p = first;
+	    b->len = line + n - first;
+	} else {
+	    if (b->len + n + 1 > b->copy_capacity) {
+		b->copy_capacity = 2 * (b->len + n + 1);
+		b->copy = realloc(b->copy, b->copy_capacity);
+		if (b->copy == NULL) {
+		    fprintf(stderr, "error: batch re-allocation failed\n");
+		    exit(EXIT_FAILURE);
+		}
 	    }
+	    if (b->n_lines)
+		b->copy[b->len++] = '\n';
+	    memcpy(b->copy + b->len, line, n);
+	    b->len += n;
+	    b->p = b->copy;
+	}
+	b->n_lines++;
+    }
+    return b->n_lines > 0;
+}
 
-	    str_append_str(out, ds->out[*c]);
-	    ds = ds_next;
-	    //str_free(prefix);
+/* flush the DFTs over their budget once the other workers are out
+ * of their batches; called with the pool locked */
+void pool_quiesce(struct pool *pl) {
+    struct engine *e = pl->e;
+
+    while (LOAD(e->dft->flush_pending) || (e->udft && LOAD(e->udft->flush_pending))) {
+	if (pl->active) {
+	    pthread_cond_wait(&pl->idle, &pl->lock);
+	    continue;
+	}
+	if (e->dft->flush_pending) {
+	    dft_flush(e->dft, 0);
+	    e->dft->flush_pending = 0;
+	}
+	if (e->udft && e->udft->flush_pending) {
+	    dft_flush(e->udft, 0);
+	    e->udft->flush_pending = 0;
+	}
+    }
+}
 
-	    // refactor this: do not make closure several times
-	    if (ds->final < 0) {					/* unexplored */
-		sl = nft_step(ds->states, '\0');
+void * pool_worker(void *arg) {
+    struct pool *pl = arg;
+    struct engine *e = pl->e;
+    struct batch *b;
+    char *line, *end, *q;
 
-		if (sl->head) {						/* got final states; take the first one */
-		    ds->final = 1;
-		    ds->final_out = str_copy(sl->head->suffix);
-		    // we do not need the 'sl' list anymore
-		} else {
-		    ds->final = 0;
-		}
-	    }
+    output = malloc(output_capacity * sizeof(char));
+    visited = calloc(e->prog->n, sizeof(unsigned));
+    if (output == NULL || visited == NULL) {
+	fprintf(stderr, "error: memory allocation failed\n");
+	exit(EXIT_FAILURE);
+    }
+    out.mem = 1;
+
+    for (;;) {
+	pthread_mutex_lock(&pl->lock);
+	pool_quiesce(pl);	/* it waits unlocked, so before the batch is picked */
+	while (pl->taken == pl->filled && !pl->eof)
+	    pthread_cond_wait(&pl->ready, &pl->lock);
+	if (pl->taken == pl->filled) {
+	    stats_add(&pl->stats, &stats);
+	    pthread_mutex_unlock(&pl->lock);
+	    return NULL;
+	}
+	b = &pl->b[pl->taken++ % pl->n_b];
+	pl->active++;
+	pthread_mutex_unlock(&pl->lock);
+
+	out.p = b->out;
+	out.capacity = b->out_capacity;
+	out.n = 0;
+	line = b->p;
+	end = b->p + b->len;
+	for (size_t k = 0; k < b->n_lines; k++) {
+	    q = memchr(line, '\n', end - line);
+	    q = q ? q : end;
+	    process_line(e, line, q - line);
+	    line = q + 1;
 	}
+	b->out = out.p;
+	b->out_capacity = out.capacity;
+	b->out_len = out.n;
+
+	pthread_mutex_lock(&pl->lock);
+	e->dft->nbytes += b->len;	/* for the fallback heuristic */
+	if (e->udft)
+	    e->udft->nbytes += b->len;
+	if (--pl->active == 0)
+	    pthread_cond_broadcast(&pl->idle);
+	b->state = BATCH_DONE;
+	pthread_cond_broadcast(&pl->done);
+	pthread_mutex_unlock(&pl->lock);
     }
+}
 
-    if (mode == SCAN && ds->final == 1) {
-	str_print(out);
-	str_print(ds->final_out);
-	return i;
+/* write batch b once its worker is done */
+void pool_write(struct pool *pl, struct batch *b) {
+    struct iovec v;
+
+    pthread_mutex_lock(&pl->lock);
+    while (b->state != BATCH_DONE)
+	pthread_cond_wait(&pl->done, &pl->lock);
+    pthread_mutex_unlock(&pl->lock);
+
+    v.iov_base = b->out;
+    v.iov_len = b->out_len;
+    if (v.iov_len)
+	out_writev(&v, 1);
+    b->state = BATCH_FREE;
+}
+
+void run_pool(struct engine *e, struct input *in, int jobs, int line_buf) {
+    struct pool pl;
+    pthread_t *th;
+    struct batch *b;
+    size_t seq;
+
+    memset(&pl, 0, sizeof pl);
+    pl.e = e;
+    pl.n_b = (size_t)jobs * BATCH_RING;
+    pl.b = calloc(pl.n_b, sizeof(struct batch));
+    th = malloc(jobs * sizeof(pthread_t));
+    if (!pl.b || !th) {
+	fprintf(stderr, "error: memory allocation failed\n");
+	exit(EXIT_FAILURE);
     }
+    pthread_mutex_init(&pl.lock, NULL);
+    pthread_cond_init(&pl.ready, NULL);
+    pthread_cond_init(&pl.done, NULL);
+    pthread_cond_init(&pl.idle, NULL);
+    e->dft->shared = 1;
+    if (e->udft)
+	e->udft->shared = 1;
+    for (int k = 0; k < jobs; k++)
+	if (pthread_create(&th[k], NULL, pool_worker, &pl) != 0) {
+	    fprintf(stderr, "error: can not start a thread\n");
+	    exit(EXIT_FAILURE);
+	}
 
+    out_flush();
+    for (seq = 0; ; seq++) {
+	b = &pl.b[seq % pl.n_b];
+	if (seq >= pl.n_b)
+	    pool_write(&pl, b);
+	/* one line per batch when every line is awaited */
+	if (!batch_fill(b, in, line_buf ? 1 : BATCH_BYTES))
+	    break;
+	pthread_mutex_lock(&pl.lock);
+	b->state = BATCH_READY;
+	pl.filled++;
+	pthread_cond_signal(&pl.ready);
+	pthread_mutex_unlock(&pl.lock);
+    }
 
-    /*
-    //if (mode == MATCH && ds->final == 1 && *c == '\0') {
-    if (ds->final == 1 && *c == '\0') {
-	str_print(out);
-	str_print(ds->final_out);
+    pthread_mutex_lock(&pl.lock);
+    pl.eof = 1;
+    pthread_cond_broadcast(&pl.ready);
+    pthread_mutex_unlock(&pl.lock);
+    for (size_t k = seq >= pl.n_b ? seq - pl.n_b + 1 : 0; k < seq; k++)
+	pool_write(&pl, &pl.b[k % pl.n_b]);
+    for (int k = 0; k < jobs; k++)
+	pthread_join(th[k], NULL);
+    stats_add(&stats, &pl.stats);
+
+    for (size_t k = 0; k < pl.n_b; k++) {
+	free(pl.b[k].copy);
+	free(pl.b[k].out);
     }
-    */
+    free(pl.b);
+    free(th);
+}
 
-    str_free(out);
 
-    return -1;
+/* -s, a line per dft */
+void stats_dft(char *name, struct dft *dft) {
+    size_t mem = dft_mem(dft);
+
+    fprintf(stderr, "%s: %zu states created, %u cached, %zu flushes, %zu bytes, peak %zu%s\n",
+	    name, dft->created, dft->n, dft->flushes, mem, mem > dft->peak ? mem : dft->peak,
+	    dft->fallback ? ", fell back to the nft" : "");
 }
 
+/* -s: t holds the start and the ends of the parse, the nft, the
+ * analyses and the run; with -f the rules are parsed with the nft */
+void stats_print(struct engine *e, struct input *in, double *t) {
+    double run = t[4] - t[3];
+
+    fprintf(stderr, "parse: %.3f ms\n", 1e3 * (t[1] - t[0]));
+    fprintf(stderr, "nft: %.3f ms, %u states, %zu bytes\n", 1e3 * (t[2] - t[1]),
+	    e->prog->n, arena_used(&arena));
+    fprintf(stderr, "analyze: %.3f ms\n", 1e3 * (t[3] - t[2]));
+    fprintf(stderr, "run: %.3f ms\n", 1e3 * run);
+    stats_dft("dft", e->dft);
+    if (e->udft)
+	stats_dft("udft", e->udft);
+    fprintf(stderr, "nft_step: %zu calls\n", stats.nft_steps);
+    fprintf(stderr, "cache: %zu lookups, %zu misses, %.2f%% hits\n", stats.lookups, stats.misses,
+	    stats.lookups ? 100.0 * (stats.lookups - stats.misses) / stats.lookups : 0);
+    fprintf(stderr, "in: %zu bytes, %zu lines, %.2f MB/s, %.0f lines/s\n", in->total, in->lines,
+	    run > 0 ? in->total / run / (1 << 20) : 0, run > 0 ? in->lines / run : 0);
+    fprintf(stderr, "out: %zu bytes\n", out.written);
+}
 
 int main(int argc, char **argv)
 {
     FILE *fp;
     char *expr;
-    ssize_t read, ioffset;
-    size_t input_len;
-    //unsigned char *line = NULL, *input_fn, *ch;
-    char *line = NULL, *input_fn, *ch;
+    size_t n;
+    char *line;
+    struct input *in;
+    struct engine e;
+    struct skip sk;
+    struct filter flt;
     struct node *root;
-    struct nstate *start;
+    struct prog *prog;
     //struct sstack *stack = screate(32);
-    struct dstate *dstart;
-    struct btnode *dcache;
+    struct dft *dft, *udft = NULL;
     enum infer_mode mode = SCAN;
 
 
-    int opt, debug=0;
+    int opt, debug=0, test=0, line_buf=0, jobs=1, stat=0;
+    double t[5];
+    size_t budget = 0;
+    enum twins twins;
+    char *twins_str[] = { "unknown", "determinizable", "not determinizable" };
+    char *save_fn = NULL, *load_fn = NULL, *rules_fn = NULL;
+    struct trreb_header *h = NULL, hdr;
+    size_t len;
 
-    while ((opt = getopt(argc, argv, "dma")) != -1) {
+    while ((opt = getopt(argc, argv, "dmatlsj:M:c:C:f:")) != -1) {
 	switch (opt) {
 	    case 'd':
 		debug = 1;
 		break;
+	    case 'M':
+		budget = parse_size(optarg);
+		break;
+	    case 't':
+		test = 1;
+		break;
+	    case 'c':
+		save_fn = optarg;
+		break;
+	    case 'C':
+		load_fn = optarg;
+		break;
+	    case 'f':
+		rules_fn = optarg;
+		break;
 	    case 'm':
 		mode = MATCH;
 		break;
+	    case 'l':
+		line_buf = 1;
+		break;
+	    case 's':
+		stat = 1;
+		break;
+	    case 'j':
+		if ((jobs = atoi(optarg)) < 1) {
+		    fprintf(stderr, "error: bad number of jobs %s\n", optarg);
+		    exit(EXIT_FAILURE);
+		}
+		break;
 	    case 'a':
-		fprintf(stderr, "Not supported yet\n");
-		exit(EXIT_FAILURE);
+		all = 1;
+		break;
 	    default: /* '?' */
-		fprintf(stderr, "Usage: %s [-dma] expr [file]\n",
-		       argv[0]);
+		fprintf(stderr, "Usage: %s [-dmatls] [-j n] [-M bytes] [-c file] expr [file]\n"
+				"       %s [-dmatls] [-j n] [-M bytes] [-c file] -f rules [file]\n"
+				"       %s [-dmatls] [-j n] [-M bytes] -C file [file]\n",
+		       argv[0], argv[0], argv[0]);
 		exit(EXIT_FAILURE);
 	}
     }
 
-    if (optind >= argc) {
-       fprintf(stderr, "error: missing trre expression\n");
-       exit(EXIT_FAILURE);
+    if (all && mode != MATCH) {
+	fprintf(stderr, "error: -a works in the match mode -m only\n");
+	exit(EXIT_FAILURE);
     }
+    if (test || save_fn)	/* the compiled file holds the first match DFT */
+	all = 0;
+
+    t[0] = t[1] = now();
+    if (load_fn) {			/* precompiled by -c */
+	h = trreb_map(load_fn, TRREB_DFT, &len);
+	prog = trreb_load_prog(h, len, load_fn);
+    } else if (rules_fn) {		/* one expression per line */
+	prog = compile(create_nft_rules(rules_fn, debug));
+    } else {
+	if (optind >= argc) {
+	   fprintf(stderr, "error: missing trre expression\n");
+	   exit(EXIT_FAILURE);
+	}
+	expr = argv[optind++];
+	root = parse(expr);
+	t[1] = now();
 
-    expr = argv[optind];
-    root = parse(expr);
-
-    start = create_nft(root);
+	prog = compile(create_nft(root));
+    }
+    t[2] = now();
+    visited = calloc(prog->n, sizeof(unsigned));
 
     if (debug) {
 	//plot_ast(root);
-	plot_nft(start);
+	plot_nft(prog);
+	fflush(stdout);		/* before the writer takes over */
+	fprintf(stderr, "arena: %zu bytes\n", arena_used(&arena));
     }
 
     //printf("%c\n", start->type);
 
     // todo: can we do better?
     output = malloc(output_capacity*sizeof(char));
+    out_init(line_buf || isatty(STDOUT_FILENO));
+
+    /* run the transducers that can not be determinized on the nft; the
+     * twins test is about the first match, with -a the states of the
+     * outputs pending are cached within the budget */
+    if (all) {
+	twins = TWINS_UNKNOWN;
+	dft = dft_create(prog);
+    } else if (h) {
+	twins = h->flags;
+	dft = h->ext_off ? trreb_load_dft(prog, h, len, load_fn) : dft_create(prog);
+    } else {
+	dft = dft_create(prog);
+	twins = twins_test(prog);
+	if (twins != TWINS_YES && dft_build(prog, dft, TWINS_MAX_BUILD))
+	    twins = TWINS_YES;
+    }
+    if (test) {
+	printf("%s\n", twins_str[twins]);
+	return 0;
+    }
 
-    struct slist *sl_init = slist_create();
-    slist_append(sl_init, start, str_create());
+    if (save_fn) {			/* with as much of the DFT as allowed */
+	fp = trreb_create(save_fn);
+	trreb_save_prog(fp, prog, &hdr, TRREB_DFT);
+	hdr.flags = twins;
+	if (twins != TWINS_NO) {
+	    dft->budget = budget ? budget : DFT_DEFAULT_BUDGET;
+	    if (dft_build(prog, dft, DFT_SAVE_MAX))
+		hdr.flags = TWINS_YES;
+	    hdr.ext_off = trreb_save_dft(fp, dft);
+	}
+	trreb_finish(fp, &hdr, save_fn);
+	arena_free(&arena);
+	return 0;
+    }
 
-    dstart = dstate_create(sl_init);
-    dcache = bt_create(dstart);
+    if (twins == TWINS_UNKNOWN && budget == 0)
+	budget = DFT_DEFAULT_BUDGET;
 
-    if (optind == argc - 2) {		// filename provided
-	input_fn = argv[optind + 1];
+    dft->budget = budget;
+    dft->fallback = twins == TWINS_NO;
 
-	fp = fopen(input_fn, "r");
-	if (fp == NULL) {
-	    fprintf(stderr, "error: can not open file %s\n", input_fn);
-	    exit(EXIT_FAILURE);
-	}
-    } else
-    	fp = stdin;
+    skip_analyze(prog, &sk);
+    filter_analyze(prog, &flt);
+    if (debug)
+	filter_print(&flt);
 
-    if (mode == SCAN) {
-	while ((read = getline(&line, &input_len, fp)) != -1) {
-	    line[read-1] = '\0';
-	    ch = line;
+    in = input_open(optind < argc ? argv[optind] : NULL);
 
-	    while (*ch != '\0') {
-		ioffset = infer_dft(dstart, (unsigned char*)ch, dcache, mode);
-		if (ioffset > 0)
-		    ch += ioffset;
-		else
-		    fputc(*ch++, stdout);
-	    }
-	    infer_dft(dstart, (unsigned char*)ch, dcache, mode);
-	    fputc('\n', stdout);
-	}
-    } else {	/* MATCH mode and generator */
-	while ((read = getline(&line, &input_len, fp)) != -1) {
-	    line[read-1] = '\0';
-	    ioffset = infer_dft(dstart, (unsigned char*)line, dcache, mode);
-	    fputc('\n', stdout);
-	}
+    /* one pass per line unless the transducer runs on the nft */
+    if (mode == SCAN && !dft->fallback) {
+	udft = dft_create(prog);
+	udft->budget = budget;
     }
+
+    e.prog = prog;
+    e.dft = dft;
+    e.udft = udft;
+    e.sk = &sk;
+    e.flt = &flt;
+    e.mode = mode;
+    t[3] = now();
+    if (jobs > 1)
+	run_pool(&e, in, jobs, line_buf);
+    else
+	while (input_line(in, &line, &n))
+	    process_line(&e, line, n);
+    out_flush();
+    t[4] = now();
+    if (stat)
+	stats_print(&e, in, t);
     if (debug) {
-    	plot_dft(dstart);
+	if (!dft->fallback)
+	    plot_dft(dft);
+	fprintf(stderr, "dft: %u states, %zu bytes, %zu flushes, %zu input bytes%s\n",
+		dft->n, dft_mem(dft), dft->flushes, dft->nbytes,
+		dft->fallback ? ", fell back to the nft" : "");
+	fprintf(stderr, "twins: %s\n", twins_str[twins]);
     }
 
-    fclose(fp);
-    if (line)
-        free(line);
+    input_close(in);
+    arena_free(&arena);
     return 0;
 }
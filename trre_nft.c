@@ -5,7 +5,36 @@
 #include <assert.h>
 #include <stdint.h>
 #include <unistd.h>
-
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdarg.h>
+
+#include "trre.h"
+
+/* Errors. The tool prints them and exits; within a library call they
+ * unwind to its entry point, which returns the code instead. */
+static __thread jmp_buf *bail_jmp;
+static __thread int bail_code;
+
+__attribute__((noreturn))
+void bail(int code, const char *fmt, ...) {
+    va_list ap;
+
+    if (bail_jmp) {
+	bail_code = code;
+	longjmp(*bail_jmp, 1);
+    }
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    exit(EXIT_FAILURE);
+}
 
 /* precendence table */
 int prec(char c) {
@@ -35,22 +64,256 @@ struct node {
 #define STACK_INIT_CAPACITY	32
 #define STACK_MAX_CAPACITY	100000
 
-static unsigned char operators[1024];
-static struct node *operands[1024];
+#define PARSE_STACK_INIT	1024
 
-static unsigned char *opr = operators;
-static struct node **opd = operands;
+/* parser stacks, grown with the nesting of the expression */
+static __thread unsigned char *operators;
+static __thread struct node **operands;
+static __thread size_t operators_cap, operands_cap;
 
-static char* output;
-static size_t output_capacity=32;
+static __thread unsigned char *opr;
+static __thread struct node **opd;
 
+void opr_push(unsigned char op) {
+    size_t n = opr - operators;
 
-struct node * create_node(char type, struct node *l, struct node *r) {
-    struct node *node = malloc(sizeof(struct node));
-    if (!node) {
-	fprintf(stderr, "error: node memory allocation failed\n");
+    if (n == operators_cap) {
+	operators_cap = operators_cap ? 2 * operators_cap : PARSE_STACK_INIT;
+	operators = realloc(operators, operators_cap);
+	if (operators == NULL)
+	    bail(TRRE_ENOMEM, "error: parser memory allocation failed\n");
+	opr = operators + n;
+    }
+    *opr++ = op;
+}
+
+void opd_push(struct node *node) {
+    size_t n = opd - operands;
+
+    if (n == operands_cap) {
+	operands_cap = operands_cap ? 2 * operands_cap : PARSE_STACK_INIT;
+	operands = realloc(operands, operands_cap * sizeof(struct node*));
+	if (operands == NULL)
+	    bail(TRRE_ENOMEM, "error: parser memory allocation failed\n");
+	opd = operands + n;
+    }
+    *opd++ = node;
+}
+
+/* release the stacks of the thread after a library call */
+void parse_free(void) {
+    free(operators);
+    free(operands);
+    operators = opr = NULL;
+    operands = opd = NULL;
+    operators_cap = operands_cap = 0;
+}
+
+/* the runtime state is per thread for the -j workers */
+static __thread char* output;
+static __thread size_t output_capacity=32;
+
+
+/* Counters of -s. They are per thread and bumped without atomics,
+ * the engines keep theirs in locals and add them once per call; a -j
+ * worker adds its counters to the pool when it is done. */
+struct stats {
+    size_t steps;		/* backtracking or Pike VM thread steps */
+    size_t stack_max;		/* backtracking stack high-water mark */
+    size_t bs_lines;		/* lines run with the bit-state */
+};
+
+static __thread struct stats stats;
+
+void stats_add(struct stats *to, struct stats *from) {
+    to->steps += from->steps;
+    to->bs_lines += from->bs_lines;
+    if (from->stack_max > to->stack_max)
+	to->stack_max = from->stack_max;
+}
+
+/* monotonic time in seconds */
+double now(void) {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+
+/* Buffered writer for stdout. Spans of the input and the outputs are
+ * copied into one block that goes out with write() when full; a span
+ * longer than the block is written along with it by one writev(). In
+ * the line buffered mode the block goes out at every end of line.
+ * What is buffered is also written on exit, errors included. A -j
+ * worker has a writer of its own that grows in memory instead, and a
+ * library call one that hands the blocks to its callback. */
+
+#define OUT_BLOCK	(1 << 16)
+
+struct writer {
+    char *p;
+    size_t n, capacity;
+    int line;			/* flush at every end of line */
+    int mem;			/* grow, never write */
+    trre_write_fn fn;		/* write to a callback, not stdout */
+    void *arg;
+    size_t written;		/* bytes written to stdout */
+};
+
+static __thread struct writer out;
+
+void out_writev(struct iovec *iov, int cnt) {
+    ssize_t n;
+
+    if (out.fn) {
+	for (; cnt; iov++, cnt--)
+	    out.fn(out.arg, iov->iov_base, iov->iov_len);
+	return;
+    }
+    while (cnt) {
+	n = writev(STDOUT_FILENO, iov, cnt);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n < 0) {			/* may run at exit, so no exit() */
+	    fprintf(stderr, "error: can not write the output\n");
+	    _exit(EXIT_FAILURE);
+	}
+	out.written += n;
+	for (; cnt && (size_t)n >= iov->iov_len; iov++, cnt--)
+	    n -= iov->iov_len;
+	if (cnt) {			/* partial write */
+	    iov->iov_base = (char*)iov->iov_base + n;
+	    iov->iov_len -= n;
+	}
+    }
+}
+
+void out_flush(void) {
+    struct iovec v = { out.p, out.n };
+
+    if (out.mem)
+	return;
+    out.n = 0;
+    if (v.iov_len)
+	out_writev(&v, 1);
+}
+
+void out_init(int line) {
+    out.capacity = OUT_BLOCK;
+    out.p = malloc(out.capacity);
+    if (out.p == NULL) {
+	fprintf(stderr, "error: memory allocation failed\n");
 	exit(EXIT_FAILURE);
     }
+    out.line = line;
+    atexit(out_flush);
+}
+
+void out_grow(size_t n) {
+    out.capacity = out.capacity ? out.capacity : OUT_BLOCK;
+    while (out.capacity < n)
+	out.capacity *= 2;
+    out.p = realloc(out.p, out.capacity);
+    if (out.p == NULL)
+	bail(TRRE_ENOMEM, "error: output re-allocation failed\n");
+}
+
+void out_write(const void *p, size_t n) {
+    if (n == 0)
+	return;
+    if (out.n + n > out.capacity) {
+	if (out.mem)
+	    out_grow(out.n + n);
+	else if (n >= out.capacity) {
+	    struct iovec v[2] = { { out.p, out.n }, { (void*)p, n } };
+	    out.n = 0;
+	    out_writev(v, 2);
+	    return;
+	} else
+	    out_flush();
+    }
+    memcpy(out.p + out.n, p, n);
+    out.n += n;
+}
+
+void out_byte(char c) {
+    if (out.n == out.capacity && out.mem)
+	out_grow(out.n + 1);
+    else if (out.n == out.capacity)
+	out_flush();
+    out.p[out.n++] = c;
+}
+
+/* the end of an output line */
+void out_newline(void) {
+    out_byte('\n');
+    if (out.line)
+	out_flush();
+}
+
+
+/* bump allocator; owns the AST and the NFT of one compiled expression */
+
+#define ARENA_CHUNK_SIZE	(64*1024)
+#define ARENA_ALIGN		16
+#define ALIGN_UP(n, a)		(((n) + (a) - 1) & ~((size_t)(a) - 1))
+
+struct achunk {
+    struct achunk *next;
+    size_t size;
+    size_t used;
+};
+
+struct arena {
+    struct achunk *head;
+    size_t used;		/* bytes handed out */
+    size_t allocated;		/* bytes requested from malloc */
+};
+
+static __thread struct arena arena;
+
+void * arena_alloc(struct arena *a, size_t size) {
+    struct achunk *ch = a->head;
+    size_t hdr = ALIGN_UP(sizeof(struct achunk), ARENA_ALIGN);
+    void *p;
+
+    size = ALIGN_UP(size, ARENA_ALIGN);
+    if (ch == NULL || ch->used + size > ch->size) {
+	size_t csize = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+	ch = malloc(hdr + csize);
+	if (ch == NULL)
+	    bail(TRRE_ENOMEM, "error: arena memory allocation failed\n");
+	ch->next = a->head;
+	ch->size = csize;
+	ch->used = 0;
+	a->head = ch;
+	a->allocated += hdr + csize;
+    }
+    p = (char*)ch + hdr + ch->used;
+    ch->used += size;
+    a->used += size;
+    return p;
+}
+
+void arena_free(struct arena *a) {
+    struct achunk *ch, *next;
+
+    for (ch = a->head; ch != NULL; ch = next) {
+	next = ch->next;
+	free(ch);
+    }
+    a->head = NULL;
+    a->used = a->allocated = 0;
+}
+
+size_t arena_used(struct arena *a) {
+    return a->used;
+}
+
+
+struct node * create_node(char type, struct node *l, struct node *r) {
+    struct node *node = arena_alloc(&arena, sizeof(struct node));
     node->type = type;
     node->val = 0;
     node->l = l;
@@ -78,14 +341,15 @@ void reduce_postfix(char op, int ng) {
 
     switch(op) {
 	case '*': case '+': case '?':
+	    if (opd == operands)
+		bail(TRRE_ESYNTAX, "error: missing operand\n");
 	    l = pop(opd);
 	    r = create_node(op, l, NULL);
 	    r->val = ng;
-	    push(opd, r);
+	    opd_push(r);
 	    break;
 	default:
-	    fprintf(stderr, "error: unexpected postfix operator\n");
-	    exit(EXIT_FAILURE);
+	    bail(TRRE_ESYNTAX, "error: unexpected postfix operator\n");
     }
 }
 
@@ -97,13 +361,14 @@ void reduce() {
     op = pop(opr);
     switch(op) {
 	case '|': case '.': case ':': case '-':
+	    if (opd - operands < 2)
+		bail(TRRE_ESYNTAX, "error: missing operand\n");
 	    r = pop(opd);
 	    l = pop(opd);
-	    push(opd, create_node(op, l, r));
+	    opd_push(create_node(op, l, r));
 	    break;
 	case '(':
-	    fprintf(stderr, "error: unmached parenthesis\n");
-	    exit(EXIT_FAILURE);
+	    bail(TRRE_ESYNTAX, "error: unmached parenthesis\n");
     }
 }
 
@@ -111,7 +376,7 @@ void reduce() {
 void reduce_op(char op) {
     while(opr != operators && prec(top(opr)) >= prec(op))
         reduce();
-    push(opr, op);
+    opr_push(op);
 }
 
 char* parse_curly_brackets(char *expr) {
@@ -134,25 +399,20 @@ char* parse_curly_brackets(char *expr) {
 	    }
             if (state == 0)
             	lv = count;
-	    else if (state > 1) {
-		fprintf(stderr, "error: more then one comma in curly brackets\n");
-		exit(EXIT_FAILURE);
-	    }
+	    else if (state > 1)
+		bail(TRRE_ESYNTAX, "error: more then one comma in curly brackets\n");
 
 	    r = create_nodev(lv, count);
 	    l = create_node('I', pop(opd), r);
 	    l->val = ng;
-	    push(opd, l);
+	    opd_push(l);
 
             return expr;
-        } else {
-	    fprintf(stderr, "error: unexpected symbol in curly brackets: %c\n", c);
-	    exit(EXIT_FAILURE);
-        }
+        } else
+	    bail(TRRE_ESYNTAX, "error: unexpected symbol in curly brackets: %c\n", c);
         expr++;
     }
-    fprintf(stderr, "error: unmached curly brackets");
-    exit(EXIT_FAILURE);
+    bail(TRRE_ESYNTAX, "error: unmached curly brackets");
 }
 
 char* parse_square_brackets(char *expr) {
@@ -163,10 +423,9 @@ char* parse_square_brackets(char *expr) {
         if (state == 0) {              			   // expect operand
             switch(c) {
 		case ':': case '-': case '[': case ']':
-		    fprintf(stderr, "error: unexpected symbol in square brackets: %c", c);
-		    exit(EXIT_FAILURE);
+		    bail(TRRE_ESYNTAX, "error: unexpected symbol in square brackets: %c", c);
 		default:
-		    push(opd, create_nodev('c', c));       // push operand
+		    opd_push(create_nodev('c', c));       // push operand
 		    state = 1;
 	    }
 	} else {                       		   	   // expect operator
@@ -188,8 +447,7 @@ char* parse_square_brackets(char *expr) {
 	}
         expr++;
     }
-    fprintf(stderr, "error: unmached square brackets");
-    exit(EXIT_FAILURE);
+    bail(TRRE_ESYNTAX, "error: unmached square brackets");
 }
 
 
@@ -197,44 +455,45 @@ struct node * parse(char *expr) {
     unsigned char c;
     int state = 0;
 
+    opr = operators;		/* left over by a failed parse */
+    opd = operands;
+
     while ((c = *expr) != '\0') {
         if (state == 0) {                     	// expect operand
             switch(c) {
 		case '(':
-		    push(opr, c);
+		    opr_push(c);
 		    break;
 		case '[':
-		    push(opr, c);
+		    opr_push(c);
 		    expr = parse_square_brackets(expr+1);
 		    state = 1;
 		    break;
 		case '\\':
-		    push(opd, create_nodev('c', *++expr));
+		    opd_push(create_nodev('c', *++expr));
 		    state = 1;
 		    break;
 		case '.':
-		    //push(opd, create_nodev('a', 0));
-		    push(opd, create_node('-',
+		    //opd_push(create_nodev('a', 0));
+		    opd_push(create_node('-',
 		    		create_nodev('c', 0),
 		    		create_nodev('c', 255)));
 		    state = 1;
 		    break;
 		case ':':					// epsilon as an implicit left operand
-		    push(opd, create_nodev('e', c));
+		    opd_push(create_nodev('e', c));
 		    state = 1;
 		    continue;					// stay in the same position in expr
 		case '|': case '*': case '+': case '?':
 		case ')': case '{': case '}':
 		    if (opr != operators && top(opr) == ':') { 	// epsilon as an implicit right operand
-			push(opd, create_nodev('e', c));
+			opd_push(create_nodev('e', c));
 			state = 1;
 			continue;				// stay in the same position in expr
-		    } else {
-			fprintf(stderr, "error: unexpected symbol %c\n", c);
-			exit(EXIT_FAILURE);
-		    }
+		    } else
+			bail(TRRE_ESYNTAX, "error: unexpected symbol %c\n", c);
 		default:
-		    push(opd, create_nodev('c', c));
+		    opd_push(create_nodev('c', c));
 		    state = 1;
             }
 	} else {               					// expect postfix or binary operator
@@ -252,10 +511,10 @@ struct node * parse(char *expr) {
                 state = 0;
                 break;
             case ':':
+		reduce_op(c);
                 if (*(expr+1) == '\0') {		// implicit epsilon as a right operand
-                    push(opd, create_nodev('e', c));
+                    opd_push(create_nodev('e', c));
                 }
-		reduce_op(c);
 		state = 0;
 		break;
             case '{':
@@ -264,10 +523,8 @@ struct node * parse(char *expr) {
             case ')':
                 while (opr != operators && top(opr) != '(')
                     reduce();
-                if (opr == operators || top(opr) != '(') {
-		    fprintf(stderr, "error: unmached parenthesis");
-		    exit(EXIT_FAILURE);
-		}
+                if (opr == operators || top(opr) != '(')
+		    bail(TRRE_ESYNTAX, "error: unmached parenthesis");
                 --opr;                       	// remove ( from the stack
                 break;
             default:                            // implicit cat
@@ -282,7 +539,8 @@ struct node * parse(char *expr) {
     while (opr != operators) {
         reduce();
     }
-    assert (operands != opd);
+    if (opd == operands)
+	bail(TRRE_ESYNTAX, "error: missing operand\n");
 
     return pop(opd);
 }
@@ -326,9 +584,15 @@ enum nstate_type {
     SPLIT,
     SPLITNG,
     JOIN,
-    FINAL
+    FINAL,
+    CONS_CLASS,
+    MAP
 };
 
+#define BIT_SET(set, c)		((set)[(unsigned char)(c) >> 3] |= 1 << ((unsigned char)(c) & 7))
+#define BIT_TEST(set, c)	((set)[(unsigned char)(c) >> 3] & (1 << ((unsigned char)(c) & 7)))
+
+
 
 // nft state
 struct nstate {
@@ -337,22 +601,25 @@ struct nstate {
     char mode;
     struct nstate *nexta;
     struct nstate *nextb;
+    uint8_t *set;		/* CONS_CLASS, MAP: 256-bit byte set */
+    uint8_t *map;		/* MAP: output byte for each input byte */
+    size_t id;			/* dense index, used by the Pike VM */
 };
 
+static __thread size_t n_states = 0;
+
 
 struct nstate* create_nstate(enum nstate_type type, struct nstate *nexta, struct nstate *nextb) {
     struct nstate *state;
 
-    state = malloc(sizeof(struct nstate));
-    if (state == NULL) {
-        fprintf(stderr, "error: nft state memory allocation failed\n");
-        exit(EXIT_FAILURE);
-    }
-
+    state = arena_alloc(&arena, sizeof(struct nstate));
     state->type = type;
     state->nexta = nexta;
     state->nextb = nextb;
+    state->set = NULL;
+    state->map = NULL;
     state->val = 0;
+    state->id = n_states++;
     return state;
 }
 
@@ -372,6 +639,117 @@ struct nchunk chunk(struct nstate *head, struct nstate *tail) {
 }
 
 
+/* collect the bytes of a single-byte expression: a char, a range or
+ * an alternation of those; return 0 if the node is anything else or
+ * if a byte is covered twice, so that -a still lists every path */
+int node_class(struct node *n, uint8_t *set) {
+    switch (n->type) {
+	case 'c':
+	    if (BIT_TEST(set, n->val))
+		return 0;
+	    BIT_SET(set, n->val);
+	    return 1;
+	case '-':
+	    if (n->l->type != 'c' || n->r->type != 'c')
+		return 0;
+	    for (int c = n->l->val; c <= n->r->val; c++) {
+		if (BIT_TEST(set, c))
+		    return 0;
+		BIT_SET(set, c);
+	    }
+	    return 1;
+	case '|':
+	    return node_class(n->l, set) && node_class(n->r, set);
+    }
+    return 0;
+}
+
+/* single state for a byte set; in mode 0 the byte is copied to the output */
+struct nchunk nft_class(uint8_t *set, char mode) {
+    struct nstate *state = create_nstate(CONS_CLASS, NULL, NULL);
+    state->set = arena_alloc(&arena, 32);
+    memcpy(state->set, set, 32);
+    state->val = (mode == 0);
+    return chunk(state, state);
+}
+
+
+/* collect a byte-to-byte transduction: pairs like a:x, ranges of pairs
+ * like a:A-z:Z, plain bytes (copied as is) and alternations of those;
+ * return 0 if the node is anything else or if a byte is covered twice */
+int node_map(struct node *n, uint8_t *set, uint8_t *map) {
+    int lo, hi, out;
+
+    switch (n->type) {
+	case 'c':
+	    lo = hi = out = n->val;
+	    break;
+	case ':':
+	    if (n->l->type != 'c' || n->r->type != 'c')
+		return 0;
+	    lo = hi = n->l->val;
+	    out = n->r->val;
+	    break;
+	case '-':
+	    if (n->l->type == 'c' && n->r->type == 'c') {
+		lo = out = n->l->val;
+		hi = n->r->val;
+	    } else if (n->l->type == ':' && n->r->type == ':'
+		    && n->l->l->type == 'c' && n->l->r->type == 'c'
+		    && n->r->l->type == 'c') {
+		lo = n->l->l->val;
+		out = n->l->r->val;
+		hi = n->r->l->val;
+	    } else
+		return 0;
+	    break;
+	case '|':
+	    return node_map(n->l, set, map) && node_map(n->r, set, map);
+	default:
+	    return 0;
+    }
+
+    for (int c = lo; c <= hi; c++, out++) {
+	if (BIT_TEST(set, c))
+	    return 0;
+	BIT_SET(set, c);
+	map[c] = out;
+    }
+    return 1;
+}
+
+/* single state for a byte-to-byte transduction */
+struct nchunk nft_map(uint8_t *set, uint8_t *map) {
+    struct nstate *state = create_nstate(MAP, NULL, NULL);
+    state->set = arena_alloc(&arena, 32);
+    state->map = arena_alloc(&arena, 256);
+    memcpy(state->set, set, 32);
+    memcpy(state->map, map, 256);
+    return chunk(state, state);
+}
+
+
+/* scratch for nft_bytes(); kept out of the frame of the recursive nft()
+ * so that long expressions do not run out of stack */
+static __thread uint8_t bytes_set[32], bytes_map[256];
+
+/* build a single byte set or byte map state for n if it has that shape */
+int nft_bytes(struct node *n, char mode, struct nchunk *c) {
+    /* byte sets are consumed by one state, they can not be generated */
+    memset(bytes_set, 0, sizeof bytes_set);
+    if (mode != 2 && node_class(n, bytes_set)) {
+	*c = nft_class(bytes_set, mode);
+	return 1;
+    }
+    memset(bytes_set, 0, sizeof bytes_set);
+    if (mode == 0 && node_map(n, bytes_set, bytes_map)) {
+	*c = nft_map(bytes_set, bytes_map);
+	return 1;
+    }
+    return 0;
+}
+
+
 struct nchunk nft(struct node *n, char mode) {
     struct nstate *split, *psplit, *join;
     struct nstate *cstate, *pstate, *state, *head, *tail, *final;
@@ -382,6 +760,9 @@ struct nchunk nft(struct node *n, char mode) {
     if (n == NULL)
     	return chunk(NULL, NULL);
 
+    if ((n->type == '|' || n->type == '-') && nft_bytes(n, mode, &l))
+	return l;
+
     switch(n->type) {
 	case '.':
 	    l = nft(n->l, mode);
@@ -452,8 +833,7 @@ struct nchunk nft(struct node *n, char mode) {
 		return chunk(psplit, join);
 	    }
 	    else {
-		fprintf(stderr, "error: unexpected range syntax\n");
-		exit(EXIT_FAILURE);
+		bail(TRRE_ESYNTAX, "error: unexpected range syntax\n");
 	    }
 	case 'I':
 	    lb = n->r->type;		/* placeholder for the left range */
@@ -510,222 +890,2434 @@ struct nstate* create_nft(struct node *root) {
     return ch.head;
 }
 
-struct sitem {
-    struct nstate *s;
-    size_t i;
-    size_t o;
+/* Rules file: one expression per line, empty lines and lines starting
+ * with '#' are skipped. The rules are joined as alternatives in file
+ * order, so an earlier rule wins over a later one, and the input is
+ * scanned once for all of them. */
+struct nstate* create_nft_rules(char *fn, int debug) {
+    struct nstate *final = create_nstate(FINAL, NULL, NULL);
+    struct nstate *join = create_nstate(JOIN, final, NULL);
+    struct nstate **heads = NULL, *head;
+    size_t n = 0, cap = 0, lineno = 0, len = 0, states;
+    struct timespec t0, t1;
+    struct nchunk ch;
+    char *line = NULL;
+    ssize_t read;
+    FILE *fp;
+
+    fp = fopen(fn, "r");
+    if (fp == NULL) {
+	fprintf(stderr, "error: can not open file %s\n", fn);
+	exit(EXIT_FAILURE);
+    }
+    while ((read = getline(&line, &len, fp)) != -1) {
+	lineno++;
+	if (read > 0 && line[read-1] == '\n')
+	    line[--read] = '\0';
+	if (read == 0 || line[0] == '#')
+	    continue;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	states = n_states;
+	ch = nft(parse(line), 0);
+	ch.tail->nexta = join;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	if (debug)
+	    fprintf(stderr, "rule %zu (line %zu): %zu states, %.3f ms\n", n + 1, lineno,
+		    n_states - states, (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+
+	if (n == cap) {
+	    cap = cap ? 2 * cap : 64;
+	    heads = realloc(heads, cap * sizeof(struct nstate*));
+	    if (heads == NULL) {
+		fprintf(stderr, "error: memory allocation failed\n");
+		exit(EXIT_FAILURE);
+	    }
+	}
+	heads[n++] = ch.head;
+    }
+    fclose(fp);
+    free(line);
+    if (n == 0) {
+	fprintf(stderr, "error: no rules in %s\n", fn);
+	exit(EXIT_FAILURE);
+    }
+
+    /* the first rule is the first alternative of every split */
+    head = heads[n - 1];
+    for (size_t i = n - 1; i > 0; i--)
+	head = create_nstate(SPLITNG, heads[i - 1], head);
+    free(heads);
+    return head;
+}
+
+/* Compiled NFT: the state graph flattened into a contiguous array of
+ * instructions. Transitions are 32-bit indices, states are stored in
+ * depth-first order following nexta first, so most of the time the
+ * next instruction is the adjacent one. The program holds no pointers
+ * and can be copied or written to a file as is. */
+
+#define NIL	UINT32_MAX	/* no transition */
+
+struct inst {
+    uint8_t op;			/* enum nstate_type */
+    uint8_t val;
+    uint32_t x;			/* nexta */
+    uint32_t y;			/* nextb */
 };
 
-struct sstack {
-    struct sitem *items;
-    size_t n_items;
-    size_t capacity;
+struct prog {
+    struct inst *inst;
+    uint32_t n;			/* the start instruction is 0 */
+    uint8_t *sets;		/* CONS_CLASS byte sets, 32 bytes each */
+    uint32_t n_sets;
+    uint8_t *maps;		/* MAP byte sets followed by output tables */
+    uint32_t n_maps;
 };
 
-struct sstack * screate(size_t capacity) {
-    struct sstack *stack;
+#define MAP_SIZE	(32 + 256)
 
-    stack = (struct sstack*)malloc(sizeof(struct sstack));
-    stack->items = malloc(capacity * sizeof(struct sitem));
-    if (stack == NULL || stack->items == NULL) {
-	fprintf(stderr, "error: stack memory allocation failed\n");
+/* the scratch of compile; a bail leaves it to compile_free */
+static __thread uint32_t *compile_map;
+static __thread struct nstate **compile_order, **compile_stack;
+
+void compile_free(void) {
+    free(compile_map);
+    free(compile_order);
+    free(compile_stack);
+    compile_map = NULL;
+    compile_order = compile_stack = NULL;
+}
+
+struct prog * compile(struct nstate *start) {
+    struct prog *prog = arena_alloc(&arena, sizeof(struct prog));
+    struct nstate **order, **stack, **sp, *s;
+    uint32_t *map;
+
+    map = compile_map = malloc(n_states * sizeof(uint32_t));
+    order = compile_order = malloc(n_states * sizeof(struct nstate*));
+    stack = compile_stack = malloc((2 * n_states + 1) * sizeof(struct nstate*));
+    if (!map || !order || !stack)
+	bail(TRRE_ENOMEM, "error: compile memory allocation failed\n");
+    memset(map, 0xff, n_states * sizeof(uint32_t));
+
+    prog->n = 0;
+    sp = stack;
+    push(sp, start);
+    while (sp != stack) {
+	s = pop(sp);
+	if (map[s->id] != NIL)
+	    continue;
+	map[s->id] = prog->n;
+	order[prog->n++] = s;
+	if (s->nextb)
+	    push(sp, s->nextb);
+	if (s->nexta)
+	    push(sp, s->nexta);
+    }
+
+    prog->inst = arena_alloc(&arena, prog->n * sizeof(struct inst));
+    prog->n_sets = prog->n_maps = 0;
+    for (uint32_t i = 0; i < prog->n; i++)
+	if (order[i]->type == CONS_CLASS)
+	    prog->n_sets++;
+	else if (order[i]->type == MAP)
+	    prog->n_maps++;
+    prog->sets = arena_alloc(&arena, prog->n_sets * 32);
+    prog->maps = arena_alloc(&arena, prog->n_maps * MAP_SIZE);
+
+    prog->n_sets = prog->n_maps = 0;
+    for (uint32_t i = 0; i < prog->n; i++) {
+	s = order[i];
+	prog->inst[i].op = s->type;
+	prog->inst[i].val = s->val;
+	prog->inst[i].x = s->nexta ? map[s->nexta->id] : NIL;
+	prog->inst[i].y = s->nextb ? map[s->nextb->id] : NIL;
+	if (s->type == CONS_CLASS) {		/* y holds the set index */
+	    memcpy(prog->sets + 32 * prog->n_sets, s->set, 32);
+	    prog->inst[i].y = prog->n_sets++;
+	} else if (s->type == MAP) {		/* y holds the map index */
+	    memcpy(prog->maps + MAP_SIZE * prog->n_maps, s->set, 32);
+	    memcpy(prog->maps + MAP_SIZE * prog->n_maps + 32, s->map, 256);
+	    prog->inst[i].y = prog->n_maps++;
+	}
+    }
+
+    compile_free();
+    return prog;
+}
+
+/* Compiled program files. All the sections are addressed by offsets
+ * from the start of the file, so a file is mapped and used in place;
+ * the instruction layout is checked against this build. */
+
+#define TRREB_MAGIC	"TRRB"
+#define TRREB_VERSION	1
+#define TRREB_NFT	1		/* kind: compiled by trre */
+#define TRREB_DFT	2		/* kind: compiled by trre_dft */
+#define TRREB_ALIGN	8
+
+struct trreb_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t kind;
+    uint32_t inst_size;		/* sizeof(struct inst) */
+    uint32_t n_inst, n_sets, n_maps;
+    uint32_t flags;		/* kind specific */
+    uint64_t inst_off, sets_off, maps_off;
+    uint64_t ext_off;		/* kind specific section, 0 if none */
+};
+
+void trreb_pad(FILE *fp) {
+    static const char pad[TRREB_ALIGN];
+    long off = ftell(fp);
+
+    if (off < 0 || (off % TRREB_ALIGN && fwrite(pad, 1, TRREB_ALIGN - off % TRREB_ALIGN, fp) == 0)) {
+	fprintf(stderr, "error: can not write the compiled file\n");
 	exit(EXIT_FAILURE);
     }
-    stack->n_items = 0;
-    stack->capacity = capacity;
-    return stack;
 }
 
-void sresize(struct sstack *stack, size_t new_capacity) {
-    stack->items = realloc(stack->items, new_capacity * sizeof(struct sitem));
-    if (stack->items == NULL) {
-	fprintf(stderr, "error: stack memory re-allocation failed\n");
+/* write a section padded to TRREB_ALIGN; returns its offset */
+uint64_t trreb_write(FILE *fp, const void *p, size_t size) {
+    long off = ftell(fp);
+
+    if (off < 0 || (size && fwrite(p, 1, size, fp) != size)) {
+	fprintf(stderr, "error: can not write the compiled file\n");
 	exit(EXIT_FAILURE);
     }
-    stack->capacity = new_capacity;
+    trreb_pad(fp);
+    return (uint64_t)off;
 }
 
-void spush(struct sstack *stack, struct nstate *s, size_t i, size_t o) {
-    struct sitem *it;
-    if (stack->n_items == stack->capacity) {
-        if (stack->capacity * 2 > STACK_MAX_CAPACITY) {
-	    fprintf(stderr, "error: stack max capacity reached\n");
+/* write the header and the program; the header is rewritten once
+ * the offsets are known */
+void trreb_save_prog(FILE *fp, struct prog *prog, struct trreb_header *h, uint32_t kind) {
+    struct inst t;
+
+    memset(h, 0, sizeof *h);
+    memcpy(h->magic, TRREB_MAGIC, 4);
+    h->version = TRREB_VERSION;
+    h->kind = kind;
+    h->inst_size = sizeof(struct inst);
+    h->n_inst = prog->n;
+    h->n_sets = prog->n_sets;
+    h->n_maps = prog->n_maps;
+    trreb_write(fp, h, sizeof *h);
+
+    h->inst_off = ftell(fp);
+    for (uint32_t i = 0; i < prog->n; i++) {
+	memset(&t, 0, sizeof t);		/* no garbage in the padding */
+	t.op = prog->inst[i].op;
+	t.val = prog->inst[i].val;
+	t.x = prog->inst[i].x;
+	t.y = prog->inst[i].y;
+	if (fwrite(&t, sizeof t, 1, fp) != 1) {
+	    fprintf(stderr, "error: can not write the compiled file\n");
 	    exit(EXIT_FAILURE);
 	}
-	sresize(stack, stack->capacity * 2);
     }
-    it = &stack->items[stack->n_items];
-    it->s = s;
-    it->i = i;
-    it->o = o;
-
-    stack->n_items++;
+    trreb_pad(fp);
+    h->sets_off = trreb_write(fp, prog->sets, prog->n_sets * 32);
+    h->maps_off = trreb_write(fp, prog->maps, prog->n_maps * MAP_SIZE);
 }
 
-size_t spop(struct sstack *stack, struct nstate **s, size_t *i, size_t *o) {
-    struct sitem *it;
-    if (stack->n_items == 0) {
-	fprintf(stderr, "error: stack underflow\n");
-        exit(EXIT_FAILURE);
+void trreb_finish(FILE *fp, struct trreb_header *h, char *fn) {
+    if (fseek(fp, 0, SEEK_SET) != 0 || fwrite(h, sizeof *h, 1, fp) != 1 || fclose(fp) != 0) {
+	fprintf(stderr, "error: can not write %s\n", fn);
+	exit(EXIT_FAILURE);
     }
-    stack->n_items--;
-    it = &stack->items[stack->n_items];
-    *s = it->s;
-    *i = it->i;
-    *o = it->o;
-
-    return stack->n_items;
 }
 
+FILE * trreb_create(char *fn) {
+    FILE *fp = fopen(fn, "wb");
 
-// Function to dynamically resize the output array
-char* resize_output(char *output, size_t *capacity) {
-    *capacity *= 2; // Double the capacity
-    output = realloc(output, *capacity * sizeof(char));
-    if (!output) {
-        fprintf(stderr, "error: memory reallocation failed for output\n");
-        exit(EXIT_FAILURE);
+    if (fp == NULL) {
+	fprintf(stderr, "error: can not open file %s\n", fn);
+	exit(EXIT_FAILURE);
     }
-    return output;
+    return fp;
 }
 
-// Main DFS traversal function
-ssize_t infer_backtrack(struct nstate *start, char *input, struct sstack *stack, enum infer_mode mode, int all) {
-    size_t i = 0, o = 0;
-    struct nstate *s = start;
-    stack->n_items = 0;		/* reset stack; do not shrink */
+/* check that [off, off + size) lies in the file */
+void * trreb_at(char *base, size_t len, uint64_t off, uint64_t size, char *fn) {
+    if (off > len || size > len - off || off % TRREB_ALIGN) {
+	fprintf(stderr, "error: %s is corrupted\n", fn);
+	exit(EXIT_FAILURE);
+    }
+    return base + off;
+}
 
-    while (stack->n_items || s) {
-        if (!s) {
-	    spop(stack, &s, &i, &o);
-            if (!s) {
-                continue;
-            }
-        }
-        // Resize output array if necessary
-        if (o >= output_capacity - 1) {
-            output = resize_output(output, &output_capacity);
-        }
+/* map a compiled file privately, so that the tables stay writable */
+struct trreb_header * trreb_map(char *fn, uint32_t kind, size_t *len) {
+    struct trreb_header *h;
+    struct stat st;
+    void *base;
+    int fd;
 
-        switch (s->type) {
-            case CONS:
-                if (input[i] != '\0' && s->val == input[i]) {
-                    i++;
-                    s = s->nexta;
-                } else {
-                    s = NULL;
-                }
-                break;
-            case PROD:
-                output[o++] = s->val;
-                s = s->nexta;
-                break;
-            case SPLIT:
-                spush(stack, s->nexta, i, o);
-                s = s->nextb;
-                break;
-            case SPLITNG:
-                spush(stack, s->nextb, i, o);
-                s = s->nexta;
-                break;
-            case JOIN:
-                s = s->nexta;
-                break;
-            case FINAL:
-		if (mode == MODE_MATCH) {
-		    if (input[i] == '\0') {
-			output[o] = '\0'; // Null-terminate the output string
-			fputs(output, stdout);
-			fputc('\n', stdout);
-			if (!all)
-			    return i;
-		    }
-		} else {
-		    output[o] = '\0'; // Null-terminate the output string
-		    fputs(output, stdout);
-		    if (!all)
-			return i;
-		}
-		s = NULL;
-                break;
-            default:
-                fprintf(stderr, "error: unknown state type\n");
-                exit(1);
-        }
+    fd = open(fn, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+	fprintf(stderr, "error: can not open file %s\n", fn);
+	exit(EXIT_FAILURE);
     }
-    return -1;
+    if ((size_t)st.st_size < sizeof *h) {
+	fprintf(stderr, "error: %s is not a compiled trre file\n", fn);
+	exit(EXIT_FAILURE);
+    }
+    base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+	fprintf(stderr, "error: can not map file %s\n", fn);
+	exit(EXIT_FAILURE);
+    }
+    h = base;
+    if (memcmp(h->magic, TRREB_MAGIC, 4) != 0) {
+	fprintf(stderr, "error: %s is not a compiled trre file\n", fn);
+	exit(EXIT_FAILURE);
+    }
+    if (h->version != TRREB_VERSION || h->inst_size != sizeof(struct inst)) {
+	fprintf(stderr, "error: %s was compiled by another version\n", fn);
+	exit(EXIT_FAILURE);
+    }
+    if (h->kind != kind) {
+	fprintf(stderr, "error: %s was compiled by %s\n", fn, h->kind == TRREB_DFT ? "trre_dft" : "trre");
+	exit(EXIT_FAILURE);
+    }
+    *len = st.st_size;
+    return h;
 }
 
+/* the program points into the mapping */
+struct prog * trreb_load_prog(struct trreb_header *h, size_t len, char *fn) {
+    struct prog *prog = arena_alloc(&arena, sizeof(struct prog));
+    char *base = (char*)h;
 
-int stack_lookup(struct nstate **b, struct nstate **e, struct nstate *v) {
-    while(b != e)
-	if (v == *(--e)) return 1;
-    return 0;
+    if (h->n_inst == 0) {		/* no start instruction */
+	fprintf(stderr, "error: %s is corrupted\n", fn);
+	exit(EXIT_FAILURE);
+    }
+    prog->n = h->n_inst;
+    prog->n_sets = h->n_sets;
+    prog->n_maps = h->n_maps;
+    prog->inst = trreb_at(base, len, h->inst_off, (uint64_t)h->n_inst * sizeof(struct inst), fn);
+    prog->sets = trreb_at(base, len, h->sets_off, (uint64_t)h->n_sets * 32, fn);
+    prog->maps = trreb_at(base, len, h->maps_off, (uint64_t)h->n_maps * MAP_SIZE, fn);
+
+    for (uint32_t i = 0; i < prog->n; i++) {
+	struct inst *s = &prog->inst[i];
+	if (s->op > MAP || (s->x != NIL && s->x >= prog->n)
+	    || (s->op == CONS_CLASS && s->y >= prog->n_sets)
+	    || (s->op == MAP && s->y >= prog->n_maps)
+	    || (s->op != CONS_CLASS && s->op != MAP && s->y != NIL && s->y >= prog->n)) {
+	    fprintf(stderr, "error: %s is corrupted\n", fn);
+	    exit(EXIT_FAILURE);
+	}
+    }
+    return prog;
 }
 
+/* Scan acceleration. If the expression can not match the empty
+ * string, a match can only start at a byte of its first set and, if
+ * every match starts with the same bytes, at an occurrence of that
+ * literal prefix. The scan loop copies the positions in between in
+ * one write instead of running the engine on each of them. The
+ * analysis runs on the program, so precompiled files get it too. */
+
+#define PREFIX_MAX	64
+
+struct skip {
+    int enabled;		/* 0 if nothing can be skipped */
+    uint8_t first[32];		/* bytes a match can start with */
+    int n_first;
+    unsigned char prefix[PREFIX_MAX];
+    size_t prefix_len;
+};
 
-void plot_nft(struct nstate *start) {
-    struct nstate *stack[1024];
-    struct nstate *visited[1024];
+/* push an unseen instruction on a walk stack */
+void walk_push(uint32_t *stack, uint32_t *sp, uint8_t *seen, uint32_t pc) {
+    if (pc == NIL || seen[pc])
+	return;
+    seen[pc] = 1;
+    stack[(*sp)++] = pc;
+}
 
-    struct nstate **sp = stack;
-    struct nstate **vp = visited;
-    struct nstate *s = start;
-    char l,m;
+/* the consuming instructions reachable from pc by epsilon moves;
+ * returns 1 if a final state is reachable too. The walk has its own
+ * stack of prog->n instructions: a rules file chains every rule off
+ * one instruction. */
+int skip_closure(struct prog *prog, uint32_t pc, uint8_t *seen, uint32_t *list, uint32_t *n, uint32_t *stack) {
+    struct inst *s;
+    uint32_t sp = 0;
+    int final = 0;
+
+    walk_push(stack, &sp, seen, pc);
+
+    while (sp) {
+	pc = stack[--sp];
+	s = &prog->inst[pc];
+	switch (s->op) {
+	    case SPLIT:
+	    case SPLITNG:
+		walk_push(stack, &sp, seen, s->y);
+		walk_push(stack, &sp, seen, s->x);
+		break;
+	    case JOIN:
+	    case PROD:
+		walk_push(stack, &sp, seen, s->x);
+		break;
+	    case CONS:
+	    case CONS_CLASS:
+	    case MAP:
+		list[(*n)++] = pc;
+		break;
+	    default:		/* FINAL */
+		final = 1;
+	}
+    }
+    return final;
+}
+
+/* clear the marks skip_closure() left from pc, so that a walk costs
+ * the instructions it reached and not prog->n */
+void skip_unmark(struct prog *prog, uint32_t pc, uint8_t *seen, uint32_t *stack) {
+    struct inst *s;
+    uint32_t sp = 0;
+
+    if (pc == NIL || !seen[pc])
+	return;
+    seen[pc] = 0;
+    stack[sp++] = pc;
+    while (sp) {
+	s = &prog->inst[stack[--sp]];
+	if (s->op == CONS || s->op == CONS_CLASS || s->op == MAP || s->op == FINAL)
+	    continue;
+	if ((s->op == SPLIT || s->op == SPLITNG) && s->y != NIL && seen[s->y]) {
+	    seen[s->y] = 0;
+	    stack[sp++] = s->y;
+	}
+	if (s->x != NIL && seen[s->x]) {
+	    seen[s->x] = 0;
+	    stack[sp++] = s->x;
+	}
+    }
+}
+
+/* the bytes accepted by a consuming instruction */
+void skip_accept(struct prog *prog, struct inst *s, uint8_t *set) {
+    if (s->op == CONS)
+	BIT_SET(set, s->val);
+    else
+	for (int k = 0; k < 32; k++)
+	    set[k] |= s->op == CONS_CLASS ? prog->sets[32 * s->y + k] : prog->maps[MAP_SIZE * s->y + k];
+}
+
+void skip_analyze(struct prog *prog, struct skip *sk) {
+    uint8_t *seen, set[32];
+    uint32_t *list, *stack, n = 0, m;
+    int final, n_set, b = 0;
+
+    memset(sk, 0, sizeof *sk);
+    seen = calloc(prog->n, sizeof(uint8_t));
+    list = malloc(2 * prog->n * sizeof(uint32_t));
+    stack = malloc(prog->n * sizeof(uint32_t));
+    if (!seen || !list || !stack) {
+	free(seen);
+	free(list);
+	free(stack);
+	bail(TRRE_ENOMEM, "error: memory allocation failed\n");
+    }
+
+    final = skip_closure(prog, 0, seen, list, &n, stack);
+    for (uint32_t k = 0; k < n; k++)
+	skip_accept(prog, &prog->inst[list[k]], sk->first);
+    for (int c = 0; c < 256; c++)
+	sk->n_first += BIT_TEST(sk->first, c) ? 1 : 0;
+    sk->enabled = !final && sk->n_first < 256;
+
+    /* extend the prefix while all the threads consume the same byte */
+    while (sk->enabled && !final && n && sk->prefix_len < PREFIX_MAX) {
+	memset(set, 0, sizeof set);
+	for (uint32_t k = 0; k < n; k++)
+	    skip_accept(prog, &prog->inst[list[k]], set);
+	n_set = 0;
+	for (int c = 0; c < 256; c++)
+	    if (BIT_TEST(set, c)) {
+		n_set++;
+		b = c;
+	    }
+	if (n_set != 1)
+	    break;
+	sk->prefix[sk->prefix_len++] = b;
+
+	memset(seen, 0, prog->n);
+	m = n;
+	n = 0;
+	final = 0;
+	for (uint32_t k = 0; k < m; k++)	/* the list is consumed in place */
+	    final |= skip_closure(prog, prog->inst[list[k]].x, seen, list + m, &n, stack);
+	memmove(list, list + m, n * sizeof(uint32_t));
+    }
+
+    free(seen);
+    free(list);
+    free(stack);
+}
+
+/* the first position at or after p where a match can start */
+char * skip_next(struct skip *sk, char *p, char *end) {
+    char *q;
+
+    if (sk->prefix_len > 1) {
+	q = memmem(p, end - p, sk->prefix, sk->prefix_len);
+	return q ? q : end;
+    }
+    if (sk->prefix_len == 1) {
+	q = memchr(p, sk->prefix[0], end - p);
+	return q ? q : end;
+    }
+    while (p < end && !BIT_TEST(sk->first, *p))
+	p++;
+    return p;
+}
+
+/* Line prefilter. Every match of the expression consumes a literal,
+ * the longest run of single bytes that lies on all the paths to the
+ * final state, and between min_len and max_len bytes. A line without
+ * the literal, or too short, holds no match and is copied as is; in
+ * the match mode a line must also fit max_len. The single bytes on
+ * all the paths are the consuming dominators of the final state. */
+
+#define LITERAL_MAX	64
+#define LEN_INF		SIZE_MAX
+
+struct filter {
+    unsigned char lit[LITERAL_MAX];
+    size_t lit_len;
+    size_t min_len, max_len;
+};
+
+/* the single byte accepted by a consuming instruction, -1 if more */
+int filter_byte(struct prog *prog, struct inst *s) {
+    uint8_t set[32];
+    int n = 0, b = -1;
+
+    memset(set, 0, sizeof set);
+    skip_accept(prog, s, set);
+    for (int c = 0; c < 256; c++)
+	if (BIT_TEST(set, c)) {
+	    n++;
+	    b = c;
+	}
+    return n == 1 ? b : -1;
+}
+
+/* depth-first numbering from the start for the dominators, on the
+ * explicit stack; while an instruction is on it, num holds the
+ * number of its successors entered so far */
+void filter_dfs(struct prog *prog, uint32_t *num, uint32_t *order, uint32_t *n, uint32_t *stack) {
+    uint32_t sp = 0, pc, w;
+    struct inst *s;
+
+    num[0] = 0;
+    stack[sp++] = 0;
+    while (sp) {
+	pc = stack[sp - 1];
+	s = &prog->inst[pc];
+	if (num[pc] < 2) {
+	    w = num[pc]++ ? ((s->op == SPLIT || s->op == SPLITNG) ? s->y : NIL) : s->x;
+	    if (w != NIL && num[w] == NIL) {
+		num[w] = 0;
+		stack[sp++] = w;
+	    }
+	    continue;
+	}
+	sp--;
+	order[*n] = pc;		/* postorder */
+	num[pc] = (*n)++;
+    }
+}
+
+uint32_t filter_intersect(uint32_t *idom, uint32_t *num, uint32_t a, uint32_t b) {
+    while (a != b) {
+	while (num[a] < num[b])
+	    a = idom[a];
+	while (num[b] < num[a])
+	    b = idom[b];
+    }
+    return a;
+}
+
+/* Tarjan over the instructions; each component gets the longest
+ * consumption to the final state, LEN_INF if unbounded, and
+ * LEN_INF - 1 when it can not reach the final state */
+struct fscc {
+    uint32_t *index, *low, *stack, *comp;
+    uint32_t *call;		/* the instructions being visited */
+    uint8_t *edge;		/* successors of each entered so far */
+    size_t *len;
+    uint32_t sp, n_index, n_comp;
+};
+
+/* pop the component of the root v and combine the exits of its members */
+void filter_scc_close(struct prog *prog, struct fscc *g, uint32_t v) {
+    struct inst *s;
+    uint32_t succ[2], w, top = g->sp;
+    size_t len = LEN_INF - 1, l;	/* LEN_INF - 1: can not reach the final */
+    int cyclic, consumes = 0;
+
+    do
+	g->comp[g->stack[--g->sp]] = g->n_comp;
+    while (g->stack[g->sp] != v);
+    cyclic = top - g->sp > 1;
+    for (uint32_t m = g->sp; m < top; m++) {
+	s = &prog->inst[g->stack[m]];
+	if (s->op == CONS || s->op == CONS_CLASS || s->op == MAP)
+	    consumes = 1;
+	if (s->op == FINAL && len == LEN_INF - 1)
+	    len = 0;
+	succ[0] = s->x;
+	succ[1] = (s->op == SPLIT || s->op == SPLITNG) ? s->y : NIL;
+	for (int k = 0; k < 2; k++) {
+	    if ((w = succ[k]) == NIL)
+		continue;
+	    if (g->comp[w] == g->n_comp) {
+		cyclic = 1;
+		continue;
+	    }
+	    l = g->len[g->comp[w]];
+	    if (l == LEN_INF - 1)
+		continue;
+	    if (len == LEN_INF - 1 || l > len)
+		len = l;
+	}
+    }
+    if (len != LEN_INF - 1 && len != LEN_INF && consumes)
+	len = cyclic ? LEN_INF : len + 1;
+    g->len[g->n_comp++] = len;
+}
+
+void filter_scc_enter(struct fscc *g, uint32_t v) {
+    g->index[v] = g->low[v] = g->n_index++;
+    g->stack[g->sp++] = v;
+    g->edge[v] = 0;
+}
+
+/* Tarjan from v with the call stack in g->call */
+void filter_scc(struct prog *prog, struct fscc *g, uint32_t v) {
+    struct inst *s;
+    uint32_t depth = 0, w, u;
+
+    filter_scc_enter(g, v);
+    g->call[depth++] = v;
+    while (depth) {
+	v = g->call[depth - 1];
+	s = &prog->inst[v];
+	if (g->edge[v] < 2) {
+	    w = g->edge[v]++ ? ((s->op == SPLIT || s->op == SPLITNG) ? s->y : NIL) : s->x;
+	    if (w == NIL)
+		continue;
+	    if (g->index[w] == NIL) {
+		filter_scc_enter(g, w);
+		g->call[depth++] = w;
+	    } else if (g->comp[w] == NIL && g->index[w] < g->low[v])
+		g->low[v] = g->index[w];
+	    continue;
+	}
+	depth--;
+	if (depth && g->low[v] < g->low[u = g->call[depth - 1]])
+	    g->low[u] = g->low[v];
+	if (g->low[v] == g->index[v])
+	    filter_scc_close(prog, g, v);
+    }
+}
+
+void filter_analyze(struct prog *prog, struct filter *f) {
+    uint32_t *num, *order, *idom, *dist, *queue, *list, *seen_list, *pred_off, *preds;
+    uint32_t n = 0, final = NIL, head, tail, pc, w, m, cnt;
+    uint8_t *seen, set[32];
+    struct inst *s;
+    struct fscc g;
+    int changed, b, at_final, oom = 0;
+    size_t len;
+
+    memset(f, 0, sizeof *f);
+    f->max_len = LEN_INF;
+
+    num = malloc(prog->n * sizeof(uint32_t));
+    order = malloc(prog->n * sizeof(uint32_t));
+    idom = malloc(prog->n * sizeof(uint32_t));
+    dist = malloc(prog->n * sizeof(uint32_t));
+    queue = malloc(2 * prog->n * sizeof(uint32_t));
+    list = malloc(2 * prog->n * sizeof(uint32_t));
+    seen = calloc(prog->n, sizeof(uint8_t));
+    g.len = malloc(prog->n * sizeof(size_t));
+    if (!num || !order || !idom || !dist || !queue || !list || !seen || !g.len) {
+	oom = 1;
+	goto done;
+    }
+
+    /* min_len: 0-1 breadth-first search, consuming edges cost 1 */
+    for (pc = 0; pc < prog->n; pc++)
+	dist[pc] = NIL;
+    head = tail = prog->n;
+    queue[tail++] = 0;
+    dist[0] = 0;
+    while (head < tail) {
+	pc = queue[head++];
+	s = &prog->inst[pc];
+	if (s->op == FINAL) {
+	    final = pc;
+	    continue;
+	}
+	for (int k = 0; k < 2; k++) {
+	    w = k ? ((s->op == SPLIT || s->op == SPLITNG) ? s->y : NIL) : s->x;
+	    cnt = (s->op == CONS || s->op == CONS_CLASS || s->op == MAP);
+	    if (w == NIL || dist[w] <= dist[pc] + cnt)
+		continue;
+	    dist[w] = dist[pc] + cnt;
+	    if (cnt)
+		queue[tail++] = w;
+	    else
+		queue[--head] = w;
+	}
+    }
+    if (final == NIL)
+	goto done;
+    f->min_len = dist[final];
+
+    /* max_len: the longest path over the components */
+    g.index = num;
+    g.low = idom;
+    g.stack = order;
+    g.comp = dist;
+    g.call = list;
+    g.edge = seen;
+    for (pc = 0; pc < prog->n; pc++)
+	num[pc] = dist[pc] = NIL;
+    g.sp = g.n_index = g.n_comp = 0;
+    filter_scc(prog, &g, 0);
+    len = g.len[dist[0]];
+    f->max_len = len == LEN_INF - 1 ? 0 : len;
+
+    /* predecessors, in place of the dist and queue arrays */
+    pred_off = dist;
+    preds = queue;
+    memset(pred_off, 0, prog->n * sizeof(uint32_t));
+    for (pc = 0; pc < prog->n; pc++) {
+	s = &prog->inst[pc];
+	if (s->x != NIL)
+	    pred_off[s->x]++;
+	if ((s->op == SPLIT || s->op == SPLITNG) && s->y != NIL)
+	    pred_off[s->y]++;
+    }
+    for (pc = 0, cnt = 0; pc < prog->n; pc++) {
+	cnt += pred_off[pc];
+	pred_off[pc] = cnt;		/* the end, moved back below */
+    }
+    for (pc = 0; pc < prog->n; pc++) {
+	s = &prog->inst[pc];
+	if (s->x != NIL)
+	    preds[--pred_off[s->x]] = pc;
+	if ((s->op == SPLIT || s->op == SPLITNG) && s->y != NIL)
+	    preds[--pred_off[s->y]] = pc;
+    }
+
+    /* dominators (Cooper, Harvey, Kennedy) over the postorder */
+    for (pc = 0; pc < prog->n; pc++)
+	num[pc] = idom[pc] = NIL;
+    filter_dfs(prog, num, order, &n, list);
+    idom[0] = 0;
+    do {
+	changed = 0;
+	for (uint32_t i = n; i-- > 0; ) {	/* reverse postorder */
+	    uint32_t v = order[i], d = NIL;
+	    uint32_t end = v + 1 < prog->n ? pred_off[v + 1] : cnt;
+	    if (v == 0)
+		continue;
+	    for (uint32_t k = pred_off[v]; k < end; k++)
+		if (idom[preds[k]] != NIL)
+		    d = d == NIL ? preds[k] : filter_intersect(idom, num, preds[k], d);
+	    if (d != idom[v]) {
+		idom[v] = d;
+		changed = 1;
+	    }
+	}
+    } while (changed);
+
+    /* the dominators of the final state, from the start on */
+    for (pc = idom[final], n = 0; ; pc = idom[pc]) {
+	order[n++] = pc;
+	if (pc == 0)
+	    break;
+    }
+
+    /* extend each single byte dominator into a literal; the closures
+     * walk on the dist array, the predecessors are done with. A
+     * dominator that a literal reached as its only thread is marked in
+     * num: its own literal is a suffix of that one. */
+    memset(seen, 0, prog->n);
+    memset(num, 0, prog->n * sizeof(uint32_t));
+    while (n--) {
+	pc = order[n];
+	s = &prog->inst[pc];
+	if (!num[pc] && (s->op == CONS || s->op == CONS_CLASS || s->op == MAP) && (b = filter_byte(prog, s)) >= 0) {
+	    unsigned char lit[LITERAL_MAX];
+	    size_t lit_len = 0;
+
+	    lit[lit_len++] = b;
+	    list[0] = pc;
+	    m = 1;
+	    seen_list = list + prog->n;
+	    while (lit_len < LITERAL_MAX) {
+		cnt = 0;
+		at_final = 0;
+		for (uint32_t k = 0; k < m; k++)
+		    at_final |= skip_closure(prog, prog->inst[list[k]].x, seen, seen_list, &cnt, dist);
+		for (uint32_t k = 0; k < m; k++)
+		    skip_unmark(prog, prog->inst[list[k]].x, seen, dist);
+		if (at_final || cnt == 0)
+		    break;
+		memset(set, 0, sizeof set);
+		for (uint32_t k = 0; k < cnt; k++)
+		    skip_accept(prog, &prog->inst[seen_list[k]], set);
+		b = -1;
+		for (int c = 0; c < 256; c++)
+		    if (BIT_TEST(set, c))
+			b = b == -1 ? c : -2;
+		if (b < 0)
+		    break;
+		lit[lit_len++] = b;
+		memmove(list, seen_list, cnt * sizeof(uint32_t));
+		m = cnt;
+		if (m == 1)
+		    num[list[0]] = 1;
+	    }
+	    if (lit_len >= f->lit_len) {	/* on a tie, the later one */
+		memcpy(f->lit, lit, lit_len);
+		f->lit_len = lit_len;
+	    }
+	}
+    }
+
+done:
+    free(num);
+    free(order);
+    free(idom);
+    free(dist);
+    free(queue);
+    free(list);
+    free(seen);
+    free(g.len);
+    if (oom)
+	bail(TRRE_ENOMEM, "error: memory allocation failed\n");
+}
+
+/* 0 if the line can hold no match; in the match mode the whole line
+ * has to be one */
+int filter_pass(struct filter *f, char *line, size_t len, int whole) {
+    if (len < f->min_len || (whole && len > f->max_len))
+	return 0;
+    return f->lit_len == 0 || memmem(line, len, f->lit, f->lit_len) != NULL;
+}
+
+void filter_print(struct filter *f) {
+    fprintf(stderr, "filter: literal \"");
+    for (size_t i = 0; i < f->lit_len; i++)
+	fprintf(stderr, f->lit[i] >= 0x20 && f->lit[i] < 0x7f ? "%c" : "\\x%02x", f->lit[i]);
+    fprintf(stderr, "\", length %zu..", f->min_len);
+    if (f->max_len == LEN_INF)
+	fprintf(stderr, "inf\n");
+    else
+	fprintf(stderr, "%zu\n", f->max_len);
+}
+
+/* Dictionaries. An alternation of literal pairs, such as
+ * colour:color|centre:center|..., is run on an Aho-Corasick automaton
+ * instead of trying the alternatives one by one at every position.
+ * The scan keeps the backtracker's answer: the leftmost position
+ * where any key matches and, among the keys matching there, the first
+ * alternative. The entries are read off the program, so precompiled
+ * files get the automaton too. */
+
+#define DICT_MIN	2	/* fewer entries are left to the engines */
+
+struct dentry {
+    uint32_t key, key_len;	/* offsets into the byte buffer */
+    uint32_t out, out_len;
+};
+
+struct dict {
+    struct dentry *e;
+    uint32_t n_e, cap_e;
+    unsigned char *buf;		/* keys and outputs */
+    size_t buf_len, buf_cap;
+
+    uint8_t cls[256];		/* byte classes of the keys, 0 for the rest */
+    uint32_t n_cls;
+    uint32_t *next;		/* goto function completed with the failures */
+    uint32_t *depth;		/* length of the string spelled by a node */
+    uint32_t *entry;		/* first entry ending at a node or NIL */
+    uint32_t *link;		/* nearest proper suffix with an entry or NIL */
+    uint32_t n, cap;
+
+    unsigned char *key, *out;	/* scratch of dict_collect, NULL after it */
+    uint32_t *walk;
+};
+
+/* realloc for the dictionary arrays; on failure the old block stays
+ * in the dictionary for dict_free */
+void * dict_grow(void *p, size_t size) {
+    if ((p = realloc(p, size)) == NULL)
+	bail(TRRE_ENOMEM, "error: memory allocation failed\n");
+    return p;
+}
+
+void dict_bytes(struct dict *d, unsigned char *p, size_t len) {
+    if (d->buf_len + len > d->buf_cap) {
+	d->buf_cap = 2 * (d->buf_len + len);
+	d->buf = dict_grow(d->buf, d->buf_cap);
+    }
+    memcpy(d->buf + d->buf_len, p, len);
+    d->buf_len += len;
+}
+
+void dict_entry(struct dict *d, unsigned char *key, size_t key_len, unsigned char *out, size_t out_len) {
+    struct dentry *e;
+
+    if (d->n_e == d->cap_e) {
+	d->cap_e = d->cap_e ? 2 * d->cap_e : 64;
+	d->e = dict_grow(d->e, d->cap_e * sizeof(struct dentry));
+    }
+    e = &d->e[d->n_e++];
+    e->key = d->buf_len;
+    e->key_len = key_len;
+    dict_bytes(d, key, key_len);
+    e->out = d->buf_len;
+    e->out_len = out_len;
+    dict_bytes(d, out, out_len);
+}
+
+/* the entries of one alternative at pc; 0 if it is not a literal
+ * pair. A lone map or class alternative gives an entry per byte. */
+int dict_pair(struct prog *prog, uint32_t pc, struct dict *d) {
+    unsigned char *key = d->key, *out = d->out;
+    struct inst *s = &prog->inst[pc];
+    size_t key_len = 0, out_len = 0;
+    uint8_t *set, *map;
+    uint32_t steps = 0;
+
+    if (s->op == CONS_CLASS || s->op == MAP) {
+	set = s->op == CONS_CLASS ? prog->sets + 32 * s->y : prog->maps + MAP_SIZE * s->y;
+	map = s->op == MAP ? set + 32 : NULL;
+	for (pc = s->x; pc != NIL && prog->inst[pc].op == JOIN; pc = prog->inst[pc].x)
+	    if (++steps > prog->n)
+		return 0;
+	if (pc == NIL || prog->inst[pc].op != FINAL)
+	    return 0;
+	for (int c = 0; c < 256; c++)
+	    if (BIT_TEST(set, c)) {
+		key[0] = c;
+		out[0] = map ? map[c] : c;
+		dict_entry(d, key, 1, out, (map || s->val) ? 1 : 0);
+	    }
+	return 1;
+    }
+
+    for (; pc != NIL; pc = s->x) {
+	s = &prog->inst[pc];
+	if (++steps > prog->n)		/* a cycle in a corrupted file */
+	    return 0;
+	switch (s->op) {
+	    case CONS:
+		key[key_len++] = s->val;
+		break;
+	    case PROD:
+		out[out_len++] = s->val;
+		break;
+	    case JOIN:
+		break;
+	    case FINAL:
+		if (key_len == 0)	/* the empty match is not a dictionary */
+		    return 0;
+		dict_entry(d, key, key_len, out, out_len);
+		return 1;
+	    default:
+		return 0;
+	}
+    }
+    return 0;
+}
+
+/* collect the alternatives below pc in priority order; 0 if one of
+ * them is not a literal pair. The SPLITNG tree is walked on its own
+ * stack, a rules file makes it as deep as the rules are many. */
+int dict_collect(struct prog *prog, uint32_t pc, struct dict *d) {
+    uint32_t *stack = d->walk, sp = 0, steps = 0;
+    int ok = 1;
+
+    stack[sp++] = pc;
+    while (ok && sp) {
+	pc = stack[--sp];
+	if (pc == NIL || ++steps > 2 * prog->n)	/* the end of a range pair chain, or a cycle */
+	    ok = 0;
+	else if (prog->inst[pc].op == SPLITNG) {
+	    stack[sp++] = prog->inst[pc].y;
+	    stack[sp++] = prog->inst[pc].x;
+	} else
+	    ok = dict_pair(prog, pc, d);
+    }
+    return ok;
+}
+
+uint32_t dict_node(struct dict *d, uint32_t depth) {
+    if (d->n == d->cap) {
+	d->cap = d->cap ? 2 * d->cap : 256;
+	d->next = dict_grow(d->next, (size_t)d->cap * d->n_cls * sizeof(uint32_t));
+	d->depth = dict_grow(d->depth, d->cap * sizeof(uint32_t));
+	d->entry = dict_grow(d->entry, d->cap * sizeof(uint32_t));
+	d->link = dict_grow(d->link, d->cap * sizeof(uint32_t));
+    }
+    memset(d->next + (size_t)d->n * d->n_cls, 0xff, d->n_cls * sizeof(uint32_t));
+    d->depth[d->n] = depth;
+    d->entry[d->n] = NIL;
+    d->link[d->n] = NIL;
+    return d->n++;
+}
+
+void dict_free(struct dict *d) {
+    if (d == NULL)
+	return;
+    free(d->e);
+    free(d->buf);
+    free(d->next);
+    free(d->depth);
+    free(d->entry);
+    free(d->link);
+    free(d->key);
+    free(d->out);
+    free(d->walk);
+    free(d);
+}
+
+/* drop the scratch of dict_collect once the entries are in */
+void dict_collected(struct dict *d) {
+    free(d->key);
+    free(d->out);
+    free(d->walk);
+    d->key = d->out = NULL;
+    d->walk = NULL;
+}
+
+/* the automaton for a program in *dp, NULL if it is not a dictionary.
+ * It is there from the start, so a bail leaves it to the caller to
+ * free along with the rest of a half built expression. */
+void dict_create(struct prog *prog, struct dict **dp) {
+    struct dict *d;
+    uint32_t *queue, *fail, head = 0, tail = 0, s, t, u;
+    uint8_t used[32];
+
+    *dp = NULL;
+    if (prog->inst[0].op != SPLITNG)
+	return;
+    if ((*dp = d = calloc(1, sizeof(struct dict))) == NULL)
+	bail(TRRE_ENOMEM, "error: memory allocation failed\n");
+    d->key = malloc(prog->n);		/* a pair spells fewer bytes than instructions */
+    d->out = malloc(prog->n);
+    d->walk = malloc((2 * prog->n + 2) * sizeof(uint32_t));
+    if (!d->key || !d->out || !d->walk)
+	bail(TRRE_ENOMEM, "error: memory allocation failed\n");
+    if (!dict_collect(prog, 0, d) || d->n_e < DICT_MIN) {
+	dict_free(d);
+	*dp = NULL;
+	return;
+    }
+    dict_collected(d);
+
+    /* a class per byte used in the keys */
+    memset(used, 0, sizeof used);
+    for (uint32_t i = 0; i < d->n_e; i++)
+	for (uint32_t k = 0; k < d->e[i].key_len; k++)
+	    BIT_SET(used, d->buf[d->e[i].key + k]);
+    d->n_cls = 1;
+    for (int c = 0; c < 256; c++)
+	d->cls[c] = BIT_TEST(used, c) ? d->n_cls++ : 0;
+
+    /* the trie; a repeated key keeps its first alternative */
+    dict_node(d, 0);
+    for (uint32_t i = 0; i < d->n_e; i++) {
+	s = 0;
+	for (uint32_t k = 0; k < d->e[i].key_len; k++) {
+	    uint32_t c = d->cls[d->buf[d->e[i].key + k]];
+	    if (d->next[(size_t)s * d->n_cls + c] == NIL) {
+		t = dict_node(d, k + 1);
+		d->next[(size_t)s * d->n_cls + c] = t;
+	    }
+	    s = d->next[(size_t)s * d->n_cls + c];
+	}
+	if (d->entry[s] == NIL)
+	    d->entry[s] = i;
+    }
+
+    /* failures in breadth-first order, folded into the goto function */
+    queue = malloc(d->n * sizeof(uint32_t));
+    fail = malloc(d->n * sizeof(uint32_t));
+    if (!queue || !fail) {
+	free(queue);
+	free(fail);
+	bail(TRRE_ENOMEM, "error: memory allocation failed\n");
+    }
+    fail[0] = 0;
+    for (uint32_t c = 0; c < d->n_cls; c++) {
+	t = d->next[c];
+	if (t == NIL)
+	    d->next[c] = 0;
+	else {
+	    fail[t] = 0;
+	    queue[tail++] = t;
+	}
+    }
+    while (head < tail) {
+	s = queue[head++];
+	u = fail[s];
+	d->link[s] = d->entry[u] != NIL ? u : d->link[u];
+	for (uint32_t c = 0; c < d->n_cls; c++) {
+	    t = d->next[(size_t)s * d->n_cls + c];
+	    if (t == NIL)
+		d->next[(size_t)s * d->n_cls + c] = d->next[(size_t)u * d->n_cls + c];
+	    else {
+		fail[t] = d->next[(size_t)u * d->n_cls + c];
+		queue[tail++] = t;
+	    }
+	}
+    }
+    free(queue);
+    free(fail);
+}
+
+/* rewrite [p, end) to the standard output */
+void dict_scan(struct dict *d, unsigned char *p, unsigned char *end) {
+    unsigned char *q, *start, *best;
+    uint32_t s, t, e, best_e;
+
+    while (p < end) {
+	best = NULL;
+	best_e = NIL;
+	s = 0;
+	for (q = p; q < end; q++) {
+	    s = d->next[(size_t)s * d->n_cls + d->cls[*q]];
+	    for (t = d->entry[s] != NIL ? s : d->link[s]; t != NIL; t = d->link[t]) {
+		start = q + 1 - d->depth[t];
+		e = d->entry[t];
+		if (best == NULL || start < best || (start == best && e < best_e)) {
+		    best = start;
+		    best_e = e;
+		}
+	    }
+	    /* a later match starts after the node's string does */
+	    if (best && q + 1 - d->depth[s] > best)
+		break;
+	}
+	if (best == NULL)
+	    break;
+	out_write(p, best - p);
+	out_write(d->buf + d->e[best_e].out, d->e[best_e].out_len);
+	p = best + d->e[best_e].key_len;
+    }
+    out_write(p, end - p);
+}
+
+
+
+struct sitem {
+    uint32_t pc;
+    size_t i;
+    size_t o;
+};
+
+struct sstack {
+    struct sitem *items;
+    size_t n_items;
+    size_t capacity;
+    size_t high;		/* the most items at once */
+};
+
+struct sstack * screate(size_t capacity) {
+    struct sstack *stack;
+
+    stack = (struct sstack*)malloc(sizeof(struct sstack));
+    stack->items = malloc(capacity * sizeof(struct sitem));
+    if (stack == NULL || stack->items == NULL)
+	bail(TRRE_ENOMEM, "error: stack memory allocation failed\n");
+    stack->n_items = 0;
+    stack->capacity = capacity;
+    stack->high = 0;
+    return stack;
+}
+
+void sfree(struct sstack *stack) {
+    if (stack == NULL)
+	return;
+    free(stack->items);
+    free(stack);
+}
+
+void sresize(struct sstack *stack, size_t new_capacity) {
+    stack->items = realloc(stack->items, new_capacity * sizeof(struct sitem));
+    if (stack->items == NULL)
+	bail(TRRE_ENOMEM, "error: stack memory re-allocation failed\n");
+    stack->capacity = new_capacity;
+}
+
+void spush(struct sstack *stack, uint32_t pc, size_t i, size_t o) {
+    struct sitem *it;
+    if (stack->n_items == stack->capacity) {
+        if (stack->capacity * 2 > STACK_MAX_CAPACITY)
+	    bail(TRRE_ELIMIT, "error: stack max capacity reached\n");
+	sresize(stack, stack->capacity * 2);
+    }
+    it = &stack->items[stack->n_items];
+    it->pc = pc;
+    it->i = i;
+    it->o = o;
+
+    if (++stack->n_items > stack->high)
+	stack->high = stack->n_items;
+}
+
+size_t spop(struct sstack *stack, uint32_t *pc, size_t *i, size_t *o) {
+    struct sitem *it;
+    if (stack->n_items == 0)
+	bail(TRRE_EINVAL, "error: stack underflow\n");
+    stack->n_items--;
+    it = &stack->items[stack->n_items];
+    *pc = it->pc;
+    *i = it->i;
+    *o = it->o;
+
+    return stack->n_items;
+}
+
+
+// Function to dynamically resize the output array
+char* resize_output(char *output, size_t *capacity) {
+    *capacity *= 2; // Double the capacity
+    output = realloc(output, *capacity * sizeof(char));
+    if (!output)
+	bail(TRRE_ENOMEM, "error: memory reallocation failed for output\n");
+    return output;
+}
+
+/* Bit-state backtracking, as RE2's BitState. Whether a thread at an
+ * instruction and an input offset reaches FINAL does not depend on the
+ * output it carries, so once an attempt that fails has visited the
+ * pair, no later visit can succeed and it is cut. That bounds a line
+ * to states x (len + 1) steps instead of exponentially many. The marks
+ * of a line live in a bitmap, offset-major; they are kept over the
+ * failed attempts of a scan, while the rows an attempt that matched
+ * has touched are cleared. It is used for the lines whose bitmap fits
+ * the budget and never with -a, which wants every path. */
+
+#define BITSTATE_BUDGET	(32 << 10)	/* bytes, 256k marks as in RE2 */
+
+struct bitstate {
+    uint64_t *bits;
+    size_t capacity;		/* words */
+    size_t budget;		/* bytes */
+    char *line;			/* offsets are from the line start */
+    size_t hi;			/* rows [0, hi) may hold marks */
+};
+
+struct bitstate * bitstate_create(size_t budget) {
+    struct bitstate *bs = calloc(1, sizeof(struct bitstate));
+
+    if (bs == NULL)
+	bail(TRRE_ENOMEM, "error: bitstate memory allocation failed\n");
+    bs->budget = budget;
+    return bs;
+}
+
+void bitstate_free(struct bitstate *bs) {
+    if (bs == NULL)
+	return;
+    free(bs->bits);
+    free(bs);
+}
+
+/* Without a split every instruction is a fixed distance from the
+ * start of an attempt, so no pair is ever reached twice and the marks
+ * would only cost; 1 if the program has a split. */
+int bitstate_pays(struct prog *prog) {
+    for (uint32_t pc = 0; pc < prog->n; pc++)
+	if (prog->inst[pc].op == SPLIT || prog->inst[pc].op == SPLITNG)
+	    return 1;
+    return 0;
+}
+
+/* clear the marks of the rows [lo, hi); whole words, so a neighbour
+ * row may lose some, which only costs a revisit */
+void bitstate_clear(struct bitstate *bs, uint32_t n, size_t lo, size_t hi) {
+    size_t w = lo * n / 64, end = (hi * n + 63) / 64;
+
+    if (w < end)
+	memset(bs->bits + w, 0, (end - w) * sizeof(uint64_t));
+}
+
+/* start a line of len bytes; 0 if its bitmap is over the budget */
+int bitstate_line(struct bitstate *bs, struct prog *prog, char *line, size_t len) {
+    size_t words;
+
+    if (len >= bs->budget * 8 / prog->n)	/* so the product does not overflow */
+	return 0;
+    words = ((len + 1) * prog->n + 63) / 64;
+    if (words > bs->capacity) {
+	free(bs->bits);
+	if ((bs->bits = calloc(words, sizeof(uint64_t))) == NULL)
+	    bail(TRRE_ENOMEM, "error: bitstate memory allocation failed\n");
+	bs->capacity = words;
+    } else
+	bitstate_clear(bs, prog->n, 0, bs->hi);
+    bs->line = line;
+    bs->hi = 0;
+    return 1;
+}
+
+/* add the counters of an infer_backtrack call */
+void backtrack_count(struct sstack *stack, size_t steps) {
+    stats.steps += steps;
+    if (stack->high > stats.stack_max)
+	stats.stack_max = stack->high;
+}
+
+/* the end of an attempt over the input at off; the marks of a match
+ * are cleared, the ones of a failure kept */
+void bitstate_done(struct bitstate *bs, uint32_t n, size_t off, size_t imax, int matched) {
+    if (matched)
+	bitstate_clear(bs, n, off, off + imax + 1);
+    else if (off + imax + 1 > bs->hi)
+	bs->hi = off + imax + 1;
+}
+
+// Main DFS traversal function; bs, if not NULL, is the bitmap of the
+// line started by bitstate_line that input lies in
+ssize_t infer_backtrack(struct prog *prog, char *input, size_t n, struct sstack *stack, enum infer_mode mode, int all,
+			struct bitstate *bs) {
+    size_t i = 0, o = 0, steps = 0, off = 0, imax = 0, b;
+    uint32_t pc = 0;
+    struct inst *s;
+    stack->n_items = 0;		/* reset stack; do not shrink */
+
+    if (bs)
+	off = input - bs->line;
+    while (stack->n_items || pc != NIL) {
+	steps++;
+        if (pc == NIL) {
+	    spop(stack, &pc, &i, &o);
+            if (pc == NIL) {
+                continue;
+            }
+        }
+	if (bs) {		/* cut a visited pair */
+	    b = (off + i) * prog->n + pc;
+	    if (bs->bits[b / 64] & (uint64_t)1 << b % 64) {
+		pc = NIL;
+		continue;
+	    }
+	    bs->bits[b / 64] |= (uint64_t)1 << b % 64;
+	    if (i > imax)
+		imax = i;
+	}
+        // Resize output array if necessary
+        if (o >= output_capacity - 1) {
+            output = resize_output(output, &output_capacity);
+        }
+
+        s = &prog->inst[pc];
+        switch (s->op) {
+            case CONS:
+                if (i < n && s->val == (unsigned char)input[i]) {
+                    i++;
+                    pc = s->x;
+                } else {
+                    pc = NIL;
+                }
+                break;
+            case CONS_CLASS:
+                if (i < n && BIT_TEST(prog->sets + 32 * s->y, input[i])) {
+                    if (s->val)
+                        output[o++] = input[i];
+                    i++;
+                    pc = s->x;
+                } else {
+                    pc = NIL;
+                }
+                break;
+            case MAP:
+                if (i < n && BIT_TEST(prog->maps + MAP_SIZE * s->y, input[i])) {
+                    output[o++] = prog->maps[MAP_SIZE * s->y + 32 + (unsigned char)input[i]];
+                    i++;
+                    pc = s->x;
+                } else {
+                    pc = NIL;
+                }
+                break;
+            case PROD:
+                output[o++] = s->val;
+                pc = s->x;
+                break;
+            case SPLIT:
+                spush(stack, s->x, i, o);
+                pc = s->y;
+                break;
+            case SPLITNG:
+                spush(stack, s->y, i, o);
+                pc = s->x;
+                break;
+            case JOIN:
+                pc = s->x;
+                break;
+            case FINAL:
+		if (mode == MODE_MATCH) {
+		    if (i == n) {
+			out_write(output, o);
+			if (!all) {
+			    backtrack_count(stack, steps);
+			    if (bs)
+				bitstate_done(bs, prog->n, off, imax, 1);
+			    return i;
+			}
+			out_newline();
+		    }
+		} else {
+		    out_write(output, o);
+		    if (!all) {
+			backtrack_count(stack, steps);
+			if (bs)
+			    bitstate_done(bs, prog->n, off, imax, 1);
+			return i;
+		    }
+		}
+		pc = NIL;
+                break;
+            default:
+                bail(TRRE_EINVAL, "error: unknown state type\n");
+        }
+    }
+    backtrack_count(stack, steps);
+    if (bs)
+	bitstate_done(bs, prog->n, off, imax, 0);
+    return -1;
+}
+
+
+/* Pike VM: breadth-first simulation of the NFT.
+ *
+ * All live threads advance over the input in lockstep, so the running
+ * time is O(states x input). The thread list is kept in priority order
+ * (SPLIT prefers nextb, SPLITNG prefers nexta, as in infer_backtrack);
+ * once a thread reaches FINAL every lower priority thread is cut off,
+ * which gives the same first match as the depth-first search.
+ *
+ * The scan mode searches for the next match in the same pass: a thread
+ * is started at every offset, as the lowest priority one, until a match
+ * is found. Each thread remembers its offset, so the match that starts
+ * first wins and its output is the one of the anchored search there.
+ *
+ * Each thread owns an output tape. Tapes are linked lists of cells in
+ * a per-call pool, so forking a thread shares the common prefix. */
+
+struct tcell {
+    size_t prev;		/* previous cell; 0 is the empty tape */
+    char c;
+};
+
+struct thread {
+    uint32_t pc;
+    size_t tape;
+    size_t start;		/* offset the thread was started at */
+};
+
+struct tlist {
+    struct thread *t;
+    size_t n;
+};
+
+struct pike {
+    struct tlist clist;
+    struct tlist nlist;
+    unsigned *mark;		/* per-instruction generation marks */
+    unsigned gen;
+    size_t n;
+    struct tcell *cells;
+    size_t n_cells;
+    size_t cells_capacity;
+    struct thread *stack;	/* pending epsilon moves of pike_add */
+};
+
+struct pike * pike_create(size_t n) {
+    struct pike *vm;
+
+    vm = malloc(sizeof(struct pike));
+    if (vm == NULL)
+	bail(TRRE_ENOMEM, "error: pike vm memory allocation failed\n");
+    vm->clist.t = malloc(n * sizeof(struct thread));
+    vm->nlist.t = malloc(n * sizeof(struct thread));
+    vm->mark = calloc(n, sizeof(unsigned));
+    vm->stack = malloc((2 * n + 1) * sizeof(struct thread));
+    vm->cells_capacity = STACK_INIT_CAPACITY;
+    vm->cells = malloc(vm->cells_capacity * sizeof(struct tcell));
+    if (!vm->clist.t || !vm->nlist.t || !vm->mark || !vm->stack || !vm->cells)
+	bail(TRRE_ENOMEM, "error: pike vm memory allocation failed\n");
+    vm->gen = 0;
+    vm->n = n;
+    return vm;
+}
+
+void pike_free(struct pike *vm) {
+    if (vm == NULL)
+	return;
+    free(vm->clist.t);
+    free(vm->nlist.t);
+    free(vm->mark);
+    free(vm->stack);
+    free(vm->cells);
+    free(vm);
+}
+
+/* start a new thread list; marks are cleared on generation wrap-around */
+void pike_next_gen(struct pike *vm) {
+    if (++vm->gen == 0) {
+	memset(vm->mark, 0, vm->n * sizeof(unsigned));
+	vm->gen = 1;
+    }
+}
+
+size_t pike_tape_push(struct pike *vm, size_t tape, char c) {
+    if (vm->n_cells == vm->cells_capacity) {
+	vm->cells_capacity *= 2;
+	vm->cells = realloc(vm->cells, vm->cells_capacity * sizeof(struct tcell));
+	if (vm->cells == NULL)
+	    bail(TRRE_ENOMEM, "error: pike vm tape re-allocation failed\n");
+    }
+    vm->cells[vm->n_cells].prev = tape;
+    vm->cells[vm->n_cells].c = c;
+    return vm->n_cells++;
+}
+
+void pike_push(struct pike *vm, size_t *sp, uint32_t pc, size_t tape) {
+    vm->stack[*sp].pc = pc;
+    vm->stack[*sp].tape = tape;
+    (*sp)++;
+}
+
+/* follow epsilon transitions in priority order; a state is marked when it
+ * is popped, so the stack walks the same preorder as a recursive descent */
+void pike_add(struct pike *vm, struct tlist *l, struct prog *prog, uint32_t pc, size_t tape, size_t start) {
+    struct inst *s;
+    size_t sp = 0;
+
+    pike_push(vm, &sp, pc, tape);
+    while (sp > 0) {
+	sp--;
+	pc = vm->stack[sp].pc;
+	tape = vm->stack[sp].tape;
+	if (pc == NIL || vm->mark[pc] == vm->gen)
+	    continue;
+	vm->mark[pc] = vm->gen;
+
+	s = &prog->inst[pc];
+	switch (s->op) {
+	    case JOIN:
+		pike_push(vm, &sp, s->x, tape);
+		break;
+	    case SPLIT:
+		pike_push(vm, &sp, s->x, tape);
+		pike_push(vm, &sp, s->y, tape);
+		break;
+	    case SPLITNG:
+		pike_push(vm, &sp, s->y, tape);
+		pike_push(vm, &sp, s->x, tape);
+		break;
+	    case PROD:
+		pike_push(vm, &sp, s->x, pike_tape_push(vm, tape, s->val));
+		break;
+	    default:		/* consuming states and FINAL wait for the next step */
+		l->t[l->n].pc = pc;
+		l->t[l->n].tape = tape;
+		l->t[l->n].start = start;
+		l->n++;
+	}
+    }
+}
+
+void pike_print(struct pike *vm, size_t tape) {
+    size_t len = 0, n, t;
+
+    for (t = tape; t != 0; t = vm->cells[t].prev)
+	len++;
+    while (len + 1 >= output_capacity)
+	output = resize_output(output, &output_capacity);
+
+    n = len;
+    for (t = tape; t != 0; t = vm->cells[t].prev)
+	output[--len] = vm->cells[t].c;
+    out_write(output, n);
+}
+
+/* the end of the first match and its output tape in *tape; with sk
+ * the match is searched for at every offset and *start is where it
+ * begins, else it has to begin at the start of the input */
+ssize_t pike_run(struct prog *prog, char *input, size_t n, struct pike *vm, enum infer_mode mode,
+		 struct skip *sk, size_t *start, size_t *tape) {
+    struct tlist *cl = &vm->clist, *nl = &vm->nlist, *tmp;
+    struct thread *t;
+    struct inst *s;
+    ssize_t matched = -1;
+    size_t i, k, steps = 0;
+
+    vm->n_cells = 1;		/* cell 0 is the empty tape */
+    cl->n = 0;
+    pike_next_gen(vm);
+    for (i = 0; ; i++) {
+	if (i == 0 || (sk && matched < 0 && i < n)) {
+	    if (sk && cl->n == 0 && sk->enabled) {	/* no thread, skip ahead */
+		i = skip_next(sk, input + i, input + n) - input;
+		if (i == n)
+		    break;
+	    }
+	    pike_add(vm, cl, prog, 0, 0, i);	/* the lowest priority */
+	}
+	if (cl->n == 0)
+	    break;
+	nl->n = 0;
+	pike_next_gen(vm);
+	steps += cl->n;
+
+	for (k = 0; k < cl->n; k++) {
+	    t = &cl->t[k];
+	    s = &prog->inst[t->pc];
+	    if (s->op == FINAL) {
+		if (mode == MODE_MATCH && i < n)
+		    continue;
+		matched = i;
+		*start = t->start;
+		*tape = t->tape;
+		break;			/* cut off lower priority threads */
+	    }
+	    if (i == n)
+		continue;
+	    if (s->op == CONS && s->val == (unsigned char)input[i])
+		pike_add(vm, nl, prog, s->x, t->tape, t->start);
+	    else if (s->op == CONS_CLASS && BIT_TEST(prog->sets + 32 * s->y, input[i]))
+		pike_add(vm, nl, prog, s->x, s->val ? pike_tape_push(vm, t->tape, input[i])
+						    : t->tape, t->start);
+	    else if (s->op == MAP && BIT_TEST(prog->maps + MAP_SIZE * s->y, input[i]))
+		pike_add(vm, nl, prog, s->x, pike_tape_push(vm, t->tape,
+			 prog->maps[MAP_SIZE * s->y + 32 + (unsigned char)input[i]]), t->start);
+	}
+	if (i == n)
+	    break;
+	tmp = cl; cl = nl; nl = tmp;
+    }
+    stats.steps += steps;
+    return matched;
+}
+
+ssize_t infer_pike(struct prog *prog, char *input, size_t n, struct pike *vm, enum infer_mode mode) {
+    size_t start, tape;
+    ssize_t matched;
+
+    matched = pike_run(prog, input, n, vm, mode, NULL, &start, &tape);
+    if (matched >= 0)
+	pike_print(vm, tape);
+    return matched;
+}
+
+
+void plot_nft(struct prog *prog) {
+    struct inst *s;
+    char l,m;
 
     printf("digraph G {\n\tsplines=true; rankdir=LR;\n");
 
-    push(sp, s);
-    while (sp != stack) {
-        s = pop(sp);
-        push(vp, s);
+    for (uint32_t pc = 0; pc < prog->n; pc++) {
+        s = &prog->inst[pc];
 
-        if (s->type == FINAL)
-            printf("\t\"%p\" [peripheries=2, label=\"\"];\n", (void*)s);
+        if (s->op == FINAL)
+            printf("\t\"%u\" [peripheries=2, label=\"\"];\n", pc);
         else {
-            switch(s->type) {
+            switch(s->op) {
 		case PROD: 	l=s->val; m='+'; break;
 		case CONS: 	l=s->val; m='-'; break;
+		case CONS_CLASS: l='C'; m=s->val ? '+' : '-'; break;
+		case MAP:	l='M'; m='+'; break;
 		case SPLITNG: 	l='S'; m='n'; break;
 		case SPLIT: 	l='S'; m=' '; break;
 		case JOIN: 	l='J'; m=' '; break;
 		default:	l=' '; m=' '; break;
 	    }
-            printf("\t\"%p\" [label=\"%c%c\"];\n", (void*)s, l, m);
+            printf("\t\"%u\" [label=\"%c%c\"];\n", pc, l, m);
         }
 
-        if (s->nexta) {
-            printf("\t\"%p\" -> \"%p\";\n", (void*)s, (void*)s->nexta);
-            if (!stack_lookup(visited, vp, s->nexta))
-                push(sp, s->nexta);
-        }
+        if (s->x != NIL)
+            printf("\t\"%u\" -> \"%u\";\n", pc, s->x);
 
-        if (s->nextb) {
-            printf("\t\"%p\" -> \"%p\" [label=\"%c\"];\n", (void*)s, (void*)s->nextb, '*');
-            if (!stack_lookup(visited, vp, s->nextb))
-                push(sp, s->nextb);
-        }
+        if (s->y != NIL && s->op != CONS_CLASS && s->op != MAP)
+            printf("\t\"%u\" -> \"%u\" [label=\"%c\"];\n", pc, s->y, '*');
     }
     printf("}\n");
 }
 
 
+/* Line input. A regular file is mapped whole and its lines are used
+ * in place; a pipe is read in large blocks and only the line that
+ * straddles two blocks is moved. The lines are spans, so a last line
+ * without the newline and the NUL bytes in a line are kept. */
+
+#define INPUT_BLOCK	(1 << 20)
+
+struct input {
+    int fd;
+    char *map;			/* the mapped file, or NULL */
+    char *buf;			/* the block buffer otherwise */
+    size_t size;		/* bytes mapped or buffered */
+    size_t capacity;
+    size_t pos;			/* start of the next line */
+    size_t scanned;		/* no newline in [pos, scanned) */
+    int eof;
+    size_t total, lines;	/* bytes and lines handed out */
+};
+
+struct input * input_open(char *fn) {
+    struct input *in = calloc(1, sizeof(struct input));
+    struct stat st;
+    off_t off;
+
+    if (in == NULL) {
+	fprintf(stderr, "error: memory allocation failed\n");
+	exit(EXIT_FAILURE);
+    }
+    in->fd = fn ? open(fn, O_RDONLY) : STDIN_FILENO;
+    if (in->fd < 0 || fstat(in->fd, &st) != 0) {
+	fprintf(stderr, "error: can not open file %s\n", fn ? fn : "stdin");
+	exit(EXIT_FAILURE);
+    }
+
+    /* the files of /proc and alike report no size, they are read */
+    if (S_ISREG(st.st_mode) && st.st_size > 0 && (off = lseek(in->fd, 0, SEEK_CUR)) >= 0) {
+	in->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, in->fd, 0);
+	if (in->map != MAP_FAILED) {
+	    madvise(in->map, st.st_size, MADV_SEQUENTIAL);
+	    in->size = st.st_size;
+	    in->pos = in->scanned = (size_t)off < in->size ? (size_t)off : in->size;
+	    in->eof = 1;
+	    return in;
+	}
+	in->map = NULL;
+    }
+
+    in->capacity = INPUT_BLOCK;
+    in->buf = malloc(in->capacity);
+    if (in->buf == NULL) {
+	fprintf(stderr, "error: memory allocation failed\n");
+	exit(EXIT_FAILURE);
+    }
+    return in;
+}
+
+/* the next line without its newline; 0 at the end of the input */
+int input_line(struct input *in, char **line, size_t *len) {
+    char *base = in->map ? in->map : in->buf, *q;
+    ssize_t n;
+
+    for (;;) {
+	q = memchr(base + in->scanned, '\n', in->size - in->scanned);
+	if (q != NULL) {
+	    *line = base + in->pos;
+	    *len = q - *line;
+	    in->total += *len + 1;
+	    in->lines++;
+	    in->pos = in->scanned = q - base + 1;
+	    return 1;
+	}
+	in->scanned = in->size;
+	if (in->eof) {
+	    if (in->pos == in->size)
+		return 0;
+	    *line = base + in->pos;	/* no newline at the end */
+	    *len = in->size - in->pos;
+	    in->total += *len;
+	    in->lines++;
+	    in->pos = in->size;
+	    return 1;
+	}
+
+	/* keep the partial line and read the next block after it */
+	if (in->pos > 0) {
+	    memmove(in->buf, in->buf + in->pos, in->size - in->pos);
+	    in->size -= in->pos;
+	    in->scanned -= in->pos;
+	    in->pos = 0;
+	}
+	if (in->size == in->capacity) {
+	    in->capacity *= 2;
+	    in->buf = realloc(in->buf, in->capacity);
+	    if (in->buf == NULL) {
+		fprintf(stderr, "error: input re-allocation failed\n");
+		exit(EXIT_FAILURE);
+	    }
+	}
+	base = in->buf;
+	n = read(in->fd, in->buf + in->size, in->capacity - in->size);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n < 0) {
+	    fprintf(stderr, "error: can not read the input\n");
+	    exit(EXIT_FAILURE);
+	}
+	if (n == 0)
+	    in->eof = 1;
+	in->size += n;
+    }
+}
+
+void input_close(struct input *in) {
+    if (in->map)
+	munmap(in->map, in->size);
+    free(in->buf);
+    if (in->fd != STDIN_FILENO)
+	close(in->fd);
+    free(in);
+}
+
+
+/* what the line loop needs; a -j worker has its own stack, bitmap
+ * and VM */
+struct engine {
+    struct prog *prog;
+    struct skip *sk;
+    struct filter *flt;
+    struct dict *dict;
+    struct sstack *stack;
+    struct bitstate *bs;	/* NULL with -a or -M 0 */
+    struct pike *vm;
+    enum infer_mode mode;
+    int all;
+};
+
+/* the bitmap for the line if it fits the budget, else NULL */
+struct bitstate * line_bitstate(struct engine *e, char *line, size_t n) {
+    if (e->bs == NULL || !bitstate_line(e->bs, e->prog, line, n))
+	return NULL;
+    stats.bs_lines++;
+    return e->bs;
+}
+
+/* the output of the whole line; 0 if it does not match */
+int match_line(struct engine *e, char *line, size_t n) {
+    if (!filter_pass(e->flt, line, n, 1))
+	return 0;
+    if (e->vm)
+	return infer_pike(e->prog, line, n, e->vm, e->mode) >= 0;
+    return infer_backtrack(e->prog, line, n, e->stack, e->mode, e->all, line_bitstate(e, line, n)) >= 0;
+}
+
+/* the line with its matches replaced, without the end of line */
+void scan_line(struct engine *e, char *line, size_t n) {
+    char *ch = line, *end = line + n, *next;
+    struct bitstate *bs;
+    ssize_t ioffset;
+    size_t start, tape;
+
+    if (!filter_pass(e->flt, line, n, 0)) {
+	out_write(line, n);
+	return;
+    }
+    if (e->dict) {
+	dict_scan(e->dict, (unsigned char*)line, (unsigned char*)end);
+	return;
+    }
+
+    bs = e->vm ? NULL : line_bitstate(e, line, n);
+    while (ch < end) {
+	if (e->vm) {		/* one pass up to the next match */
+	    ioffset = pike_run(e->prog, ch, end - ch, e->vm, e->mode, e->sk, &start, &tape);
+	    if (ioffset < 0) {
+		out_write(ch, end - ch);
+		ch = end;
+		break;
+	    }
+	    out_write(ch, start);
+	    pike_print(e->vm, tape);
+	    ch += start;
+	    ioffset -= start;
+	} else {
+	    if (e->sk->enabled) {	/* copy what no match can start at */
+		next = skip_next(e->sk, ch, end);
+		out_write(ch, next - ch);
+		if ((ch = next) == end)
+		    break;
+	    }
+	    ioffset = infer_backtrack(e->prog, ch, end - ch, e->stack, e->mode, e->all, bs);
+	}
+	if (ioffset > 0)
+	    ch += ioffset;
+	else
+	    out_byte(*ch++);
+    }
+    // even if we have empty string we still need to run the inference
+    if (e->vm)
+	infer_pike(e->prog, ch, 0, e->vm, e->mode);
+    else
+	infer_backtrack(e->prog, ch, 0, e->stack, e->mode, e->all, bs);
+}
+
+void process_line(struct engine *e, char *line, size_t n) {
+    if (e->mode == MODE_MATCH) {
+	if (match_line(e, line, n))
+	    out_newline();
+	return;
+    }
+    scan_line(e, line, n);
+    out_newline();
+}
+
+/* Library interface, see trre.h. A compiled expression owns the arena
+ * its program was built in; a call gets its own stack or VM, output
+ * tape and writer, and puts back the ones of the thread when done, so
+ * it can also run inside a write callback. The stack, the VM and the
+ * tape are kept per thread for the next call, as a client calls once
+ * per line. */
+
+#define EXEC_BLOCK	4096	/* output handed to the callback at once */
+
+struct trre {
+    struct arena arena;		/* the AST, the NFT and the program */
+    struct prog *prog;
+    struct skip sk;
+    struct filter flt;
+    struct dict *dict;		/* NULL unless a dictionary */
+    int bs_pays;		/* bitstate_pays() of the program */
+};
+
+/* the scratch of the trre_exec() calls of a thread */
+struct exec_scratch {
+    struct engine e;
+    uint32_t n;			/* the program size the bitmap and VM are for */
+    struct sstack *stack;
+    struct bitstate *bs;
+    struct pike *vm;
+    char *output;
+    size_t output_capacity;
+};
+
+static pthread_key_t exec_key;
+static pthread_once_t exec_once = PTHREAD_ONCE_INIT;
+static int exec_key_ok;
+
+void exec_scratch_free(void *p) {
+    struct exec_scratch *sc = p;
+
+    if (sc == NULL)
+	return;
+    sfree(sc->stack);
+    bitstate_free(sc->bs);
+    pike_free(sc->vm);
+    free(sc->output);
+    free(sc);
+}
+
+void exec_key_create(void) {
+    exec_key_ok = pthread_key_create(&exec_key, exec_scratch_free) == 0;
+}
+
+/* the scratch of the thread, taken off it while in use, so that a call
+ * from a write callback gets a new one */
+struct exec_scratch * exec_scratch_take(void) {
+    struct exec_scratch *sc = NULL;
+
+    pthread_once(&exec_once, exec_key_create);
+    if (exec_key_ok && (sc = pthread_getspecific(exec_key)) != NULL)
+	pthread_setspecific(exec_key, NULL);
+    return sc ? sc : calloc(1, sizeof *sc);
+}
+
+/* keep the scratch for the next call, unless a nested call did */
+void exec_scratch_put(struct exec_scratch *sc) {
+    if (exec_key_ok && pthread_getspecific(exec_key) == NULL
+	    && pthread_setspecific(exec_key, sc) == 0)
+	return;
+    exec_scratch_free(sc);
+}
+
+struct trre * trre_compile(const char *expr, int *err) {
+    struct arena saved_arena = arena;
+    size_t saved_states = n_states;
+    jmp_buf env, *saved_jmp = bail_jmp;
+    struct trre *volatile re;
+    int code;
+
+    if (expr == NULL || (re = calloc(1, sizeof *re)) == NULL) {
+	if (err)
+	    *err = expr ? TRRE_ENOMEM : TRRE_EINVAL;
+	return NULL;
+    }
+    memset(&arena, 0, sizeof arena);
+    n_states = 0;
+    bail_jmp = &env;
+    if (setjmp(env) == 0) {
+	re->prog = compile(create_nft(parse((char*)expr)));
+	skip_analyze(re->prog, &re->sk);
+	filter_analyze(re->prog, &re->flt);
+	dict_create(re->prog, &re->dict);
+	re->bs_pays = bitstate_pays(re->prog);
+	re->arena = arena;
+	code = TRRE_OK;
+    } else {			/* free what is built so far */
+	code = bail_code;
+	re->arena = arena;
+	trre_free(re);
+	re = NULL;
+    }
+    bail_jmp = saved_jmp;
+    parse_free();
+    compile_free();
+    arena = saved_arena;
+    n_states = saved_states;
+    if (err)
+	*err = code;
+    return re;
+}
+
+int trre_exec(const struct trre *re, const char *input, size_t len, int flags,
+	      trre_write_fn write, void *arg) {
+    struct writer saved_out = out;
+    char *saved_output = output, block[EXEC_BLOCK];
+    size_t saved_capacity = output_capacity;
+    jmp_buf env, *saved_jmp = bail_jmp;
+    struct exec_scratch *volatile sc;
+    struct engine *e;
+    int ret;
+
+    if (re == NULL || write == NULL || (input == NULL && len))
+	return TRRE_EINVAL;
+    /* on the heap, so that it survives the longjmp intact */
+    if ((sc = exec_scratch_take()) == NULL)
+	return TRRE_ENOMEM;
+    e = &sc->e;
+    memset(e, 0, sizeof *e);
+    e->prog = re->prog;
+    e->sk = (struct skip*)&re->sk;
+    e->flt = (struct filter*)&re->flt;
+    e->mode = flags & TRRE_MATCH ? MODE_MATCH : MODE_SCAN;
+    e->dict = e->mode == MODE_SCAN ? re->dict : NULL;
+
+    memset(&out, 0, sizeof out);
+    out.p = block;
+    out.capacity = sizeof block;
+    out.fn = write;
+    out.arg = arg;
+    bail_jmp = &env;
+    if (setjmp(env) == 0) {
+	if (sc->n != re->prog->n) {	/* sized for another program */
+	    bitstate_free(sc->bs);
+	    pike_free(sc->vm);
+	    sc->bs = NULL;
+	    sc->vm = NULL;
+	    sc->n = re->prog->n;
+	}
+	if (sc->output == NULL) {
+	    sc->output_capacity = 32;
+	    if ((sc->output = malloc(sc->output_capacity)) == NULL)
+		bail(TRRE_ENOMEM, "error: memory allocation failed\n");
+	}
+	output = sc->output;
+	output_capacity = sc->output_capacity;
+	if (flags & TRRE_PIKE) {
+	    if (sc->vm == NULL)
+		sc->vm = pike_create(re->prog->n);
+	    e->vm = sc->vm;
+	} else {
+	    if (sc->stack == NULL)
+		sc->stack = screate(STACK_INIT_CAPACITY);
+	    if (sc->bs == NULL && re->bs_pays)
+		sc->bs = bitstate_create(BITSTATE_BUDGET);
+	    e->stack = sc->stack;
+	    e->bs = sc->bs;
+	    e->stack->n_items = 0;
+	}
+	if (e->mode == MODE_MATCH)
+	    ret = match_line(e, (char*)input, len);
+	else {
+	    scan_line(e, (char*)input, len);
+	    ret = 0;
+	}
+	out_flush();
+	sc->output = output;	/* grown by the run */
+	sc->output_capacity = output_capacity;
+    } else {
+	ret = bail_code;
+	sc->output = output;	/* may be half built */
+	exec_scratch_free(sc);
+	sc = NULL;
+    }
+
+    bail_jmp = saved_jmp;
+    output = saved_output;
+    output_capacity = saved_capacity;
+    out = saved_out;
+    if (sc)
+	exec_scratch_put(sc);
+    return ret;
+}
+
+struct exec_buf {
+    char *p;
+    size_t cap, n;
+};
+
+void exec_buf_write(void *arg, const char *p, size_t n) {
+    struct exec_buf *b = arg;
+
+    if (b->n < b->cap)
+	memcpy(b->p + b->n, p, n < b->cap - b->n ? n : b->cap - b->n);
+    b->n += n;
+}
+
+int trre_exec_buf(const struct trre *re, const char *input, size_t len, int flags,
+		  char *buf, size_t cap, size_t *n) {
+    struct exec_buf b = { buf, cap, 0 };
+    int ret;
+
+    if (buf == NULL && cap)
+	return TRRE_EINVAL;
+    ret = trre_exec(re, input, len, flags, exec_buf_write, &b);
+    if (n)
+	*n = b.n;
+    return ret >= 0 && b.n > cap ? TRRE_ESPACE : ret;
+}
+
+void trre_free(struct trre *re) {
+    if (re == NULL)
+	return;
+    arena_free(&re->arena);
+    dict_free(re->dict);
+    free(re);
+}
+
+const char * trre_strerror(int err) {
+    switch (err) {
+	case TRRE_OK:		return "success";
+	case TRRE_ESYNTAX:	return "malformed expression";
+	case TRRE_ENOMEM:	return "out of memory";
+	case TRRE_ELIMIT:	return "backtracking stack limit reached";
+	case TRRE_ESPACE:	return "output buffer too small";
+	case TRRE_EINVAL:	return "invalid argument";
+    }
+    return "unknown error";
+}
+
+/* Parallel lines, -j N. The main thread cuts the input into batches
+ * of whole lines, hands them to N workers through a ring and writes
+ * the outputs back in the input order, so the ring slot to refill is
+ * always the one to write next. Lines of a mapped file are used in
+ * place; the lines of a pipe are copied, as its buffer moves. */
+
+#define BATCH_BYTES	(1 << 18)
+#define BATCH_RING	4		/* batches per worker */
+
+enum batch_state { BATCH_FREE, BATCH_READY, BATCH_DONE };
+
+struct batch {
+    char *p;			/* the lines, separated by newlines */
+    size_t len, n_lines;
+    char *copy;			/* owned lines of a pipe */
+    size_t copy_capacity;
+    char *out;			/* the output of the lines */
+    size_t out_len, out_capacity;
+    enum batch_state state;
+};
+
+struct pool {
+    struct engine *e;		/* copied by every worker */
+    struct batch *b;
+    size_t n_b;
+    size_t filled, taken;	/* batches handed out and picked up */
+    int eof;
+    struct stats stats;		/* of the workers that are done */
+    pthread_mutex_t lock;
+    pthread_cond_t ready, done;
+};
+
+/* the next batch of lines; 0 at the end of the input */
+int batch_fill(struct batch *b, struct input *in, size_t max) {
+    char *line, *first = NULL;
+    size_t n;
+
+    b->len = b->n_lines = 0;
+    while (b->len < max && input_line(in, &line, &n)) {
+	if (in->map) {		/* the lines lie in the map in a row */
+	    if (first == NULL)
+		first = line;
+	    b->p = first;
+	    b->len = line + n - first;
+	} else {
+	    if (b->len + n + 1 > b->copy_capacity) {
+		b->copy_capacity = 2 * (b->len + n + 1);
+		b->copy = realloc(b->copy, b->copy_capacity);
+		if (b->copy == NULL) {
+		    fprintf(stderr, "error: batch re-allocation failed\n");
+		    exit(EXIT_FAILURE);
+		}
+	    }
+	    if (b->n_lines)
+		b->copy[b->len++] = '\n';
+	    memcpy(b->copy + b->len, line, n);
+	    b->len += n;
+	    b->p = b->copy;
+	}
+	b->n_lines++;
+    }
+    return b->n_lines > 0;
+}
+
+void * pool_worker(void *arg) {
+    struct pool *pl = arg;
+    struct engine e = *pl->e;
+    struct batch *b;
+    char *line, *end, *q;
+
+    output = malloc(output_capacity * sizeof(char));
+    if (output == NULL) {
+	fprintf(stderr, "error: memory allocation failed\n");
+	exit(EXIT_FAILURE);
+    }
+    e.stack = screate(STACK_INIT_CAPACITY);
+    if (e.bs)
+	e.bs = bitstate_create(e.bs->budget);
+    if (e.vm)
+	e.vm = pike_create(e.prog->n);
+    out.mem = 1;
+
+    for (;;) {
+	pthread_mutex_lock(&pl->lock);
+	while (pl->taken == pl->filled && !pl->eof)
+	    pthread_cond_wait(&pl->ready, &pl->lock);
+	if (pl->taken == pl->filled) {
+	    stats_add(&pl->stats, &stats);
+	    pthread_mutex_unlock(&pl->lock);
+	    sfree(e.stack);
+	    bitstate_free(e.bs);
+	    pike_free(e.vm);
+	    free(output);
+	    return NULL;
+	}
+	b = &pl->b[pl->taken++ % pl->n_b];
+	pthread_mutex_unlock(&pl->lock);
+
+	out.p = b->out;
+	out.capacity = b->out_capacity;
+	out.n = 0;
+	line = b->p;
+	end = b->p + b->len;
+	for (size_t k = 0; k < b->n_lines; k++) {
+	    q = memchr(line, '\n', end - line);
+	    q = q ? q : end;
+	    process_line(&e, line, q - line);
+	    line = q + 1;
+	}
+	b->out = out.p;
+	b->out_capacity = out.capacity;
+	b->out_len = out.n;
+
+	pthread_mutex_lock(&pl->lock);
+	b->state = BATCH_DONE;
+	pthread_cond_broadcast(&pl->done);
+	pthread_mutex_unlock(&pl->lock);
+    }
+}
+
+/* write batch b once its worker is done */
+void pool_write(struct pool *pl, struct batch *b) {
+    struct iovec v;
+
+    pthread_mutex_lock(&pl->lock);
+    while (b->state != BATCH_DONE)
+	pthread_cond_wait(&pl->done, &pl->lock);
+    pthread_mutex_unlock(&pl->lock);
+
+    v.iov_base = b->out;
+    v.iov_len = b->out_len;
+    if (v.iov_len)
+	out_writev(&v, 1);
+    b->state = BATCH_FREE;
+}
+
+void run_pool(struct engine *e, struct input *in, int jobs, int line_buf) {
+    struct pool pl;
+    pthread_t *th;
+    struct batch *b;
+    size_t seq;
+
+    memset(&pl, 0, sizeof pl);
+    pl.e = e;
+    pl.n_b = (size_t)jobs * BATCH_RING;
+    pl.b = calloc(pl.n_b, sizeof(struct batch));
+    th = malloc(jobs * sizeof(pthread_t));
+    if (!pl.b || !th) {
+	fprintf(stderr, "error: memory allocation failed\n");
+	exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&pl.lock, NULL);
+    pthread_cond_init(&pl.ready, NULL);
+    pthread_cond_init(&pl.done, NULL);
+    for (int k = 0; k < jobs; k++)
+	if (pthread_create(&th[k], NULL, pool_worker, &pl) != 0) {
+	    fprintf(stderr, "error: can not start a thread\n");
+	    exit(EXIT_FAILURE);
+	}
+
+    out_flush();
+    for (seq = 0; ; seq++) {
+	b = &pl.b[seq % pl.n_b];
+	if (seq >= pl.n_b)
+	    pool_write(&pl, b);
+	/* one line per batch when every line is awaited */
+	if (!batch_fill(b, in, line_buf ? 1 : BATCH_BYTES))
+	    break;
+	pthread_mutex_lock(&pl.lock);
+	b->state = BATCH_READY;
+	pl.filled++;
+	pthread_cond_signal(&pl.ready);
+	pthread_mutex_unlock(&pl.lock);
+    }
+
+    pthread_mutex_lock(&pl.lock);
+    pl.eof = 1;
+    pthread_cond_broadcast(&pl.ready);
+    pthread_mutex_unlock(&pl.lock);
+    for (size_t k = seq >= pl.n_b ? seq - pl.n_b + 1 : 0; k < seq; k++)
+	pool_write(&pl, &pl.b[k % pl.n_b]);
+    for (int k = 0; k < jobs; k++)
+	pthread_join(th[k], NULL);
+    stats_add(&stats, &pl.stats);
+
+    for (size_t k = 0; k < pl.n_b; k++) {
+	free(pl.b[k].copy);
+	free(pl.b[k].out);
+    }
+    free(pl.b);
+    free(th);
+}
+
+
+#ifndef TRRE_LIB
+/* a byte count with an optional k, m or g suffix */
+size_t parse_size(char *arg) {
+    char *end;
+    size_t n = strtoul(arg, &end, 10);
+
+    switch (*end) {
+	case 'k': case 'K':	n <<= 10; end++; break;
+	case 'm': case 'M':	n <<= 20; end++; break;
+	case 'g': case 'G':	n <<= 30; end++; break;
+    }
+    if (end == arg || *end != '\0') {
+	fprintf(stderr, "error: invalid size %s\n", arg);
+	exit(EXIT_FAILURE);
+    }
+    return n;
+}
+
+/* the output of trre_exec() for a plain expression, through stdio */
+void cli_write(void *arg, const char *p, size_t n) {
+    (void)arg;
+    if (fwrite(p, 1, n, stdout) != n) {
+	fprintf(stderr, "error: can not write the output\n");
+	exit(EXIT_FAILURE);
+    }
+}
+
+/* A plain expression runs through libtrre as any client does: it is
+ * compiled by trre_compile() and every line is passed to trre_exec().
+ * The options the library has no flag for keep the driver in main. */
+int cli_run(char *expr, char *fn, int flags, int line_buf) {
+    struct trre *re;
+    struct input *in;
+    char *line;
+    size_t n;
+    int err, ret;
+
+    if ((re = trre_compile(expr, &err)) == NULL) {
+	fprintf(stderr, "error: %s\n", trre_strerror(err));
+	exit(EXIT_FAILURE);
+    }
+    setvbuf(stdout, NULL, line_buf || isatty(STDOUT_FILENO) ? _IOLBF : _IOFBF, OUT_BLOCK);
+    in = input_open(fn);
+    while (input_line(in, &line, &n)) {
+	if ((ret = trre_exec(re, line, n, flags, cli_write, NULL)) < 0) {
+	    fprintf(stderr, "error: %s\n", trre_strerror(ret));
+	    exit(EXIT_FAILURE);
+	}
+	if (ret || !(flags & TRRE_MATCH))
+	    cli_write(NULL, "\n", 1);
+    }
+    input_close(in);
+    trre_free(re);
+    return 0;
+}
+
+/* -s: t holds the start and the ends of the parse, the nft, the
+ * analyses and the run; with -f the rules are parsed with the nft */
+void stats_print(struct engine *e, struct input *in, double *t) {
+    double run = t[4] - t[3];
+
+    fprintf(stderr, "parse: %.3f ms\n", 1e3 * (t[1] - t[0]));
+    fprintf(stderr, "nft: %.3f ms, %u states, %zu bytes\n", 1e3 * (t[2] - t[1]),
+	    e->prog->n, arena_used(&arena));
+    fprintf(stderr, "analyze: %.3f ms\n", 1e3 * (t[3] - t[2]));
+    fprintf(stderr, "run: %.3f ms\n", 1e3 * run);
+    if (e->dict)
+	fprintf(stderr, "dict: %u entries, %u nodes\n", e->dict->n_e, e->dict->n);
+    else if (e->vm)
+	fprintf(stderr, "pike: %zu thread steps\n", stats.steps);
+    else
+	fprintf(stderr, "backtrack: %zu steps, stack high-water %zu, %zu lines on the bit-state\n",
+		stats.steps, stats.stack_max, stats.bs_lines);
+    fprintf(stderr, "in: %zu bytes, %zu lines, %.2f MB/s, %.0f lines/s\n", in->total, in->lines,
+	    run > 0 ? in->total / run / (1 << 20) : 0, run > 0 ? in->lines / run : 0);
+    fprintf(stderr, "out: %zu bytes\n", out.written);
+}
+
 int main(int argc, char **argv)
 {
     FILE *fp;
     char *expr;
-    ssize_t read, ioffset;
-    size_t input_len;
-    char *line = NULL, *input_fn, *ch;
+    size_t n;
+    char *line;
+    struct input *in;
+    struct engine e;
+    struct skip sk;
+    struct filter flt;
+    struct dict *dict = NULL;
     struct node *root;
-    struct nstate *start;
-    struct sstack *stack = screate(STACK_INIT_CAPACITY);
+    struct prog *prog;
+    struct sstack *stack;
+    struct pike *vm = NULL;
     enum infer_mode mode = MODE_SCAN;
     int all = 0;	// 1 = generate all the
+    int pike = 0;	// 1 = use the linear-time Pike VM
+    int line_buf = 0;	// 1 = write the output at every end of line
+    int jobs = 1;	// worker threads
+    int stat = 0;	// 1 = print the statistics
+    size_t budget = BITSTATE_BUDGET;	// bit-state bytes per line, 0 = off
+    double t[5];
 
     int opt, debug=0;
+    char *save_fn = NULL, *load_fn = NULL, *rules_fn = NULL;
+    struct trreb_header *h, hdr;
+    size_t len;
 
-    while ((opt = getopt(argc, argv, "dma")) != -1) {
+    while ((opt = getopt(argc, argv, "dmaplsj:B:c:C:f:")) != -1) {
 	switch (opt) {
 	    case 'd':
 		debug = 1;
@@ -736,68 +3328,126 @@ int main(int argc, char **argv)
 	    case 'a':
 		all = 1;
 		break;
+	    case 'p':
+		pike = 1;
+		break;
+	    case 'l':
+		line_buf = 1;
+		break;
+	    case 's':
+		stat = 1;
+		break;
+	    case 'B':
+		budget = parse_size(optarg);
+		break;
+	    case 'j':
+		if ((jobs = atoi(optarg)) < 1) {
+		    fprintf(stderr, "error: bad number of jobs %s\n", optarg);
+		    exit(EXIT_FAILURE);
+		}
+		break;
+	    case 'c':
+		save_fn = optarg;
+		break;
+	    case 'C':
+		load_fn = optarg;
+		break;
+	    case 'f':
+		rules_fn = optarg;
+		break;
 	    default: /* '?' */
-		fprintf(stderr, "Usage: %s [-d] [-m] expr [file]\n",
-		       argv[0]);
+		fprintf(stderr, "Usage: %s [-d] [-m] [-a] [-p] [-l] [-s] [-j n] [-B bytes] [-c file] expr [file]\n"
+				"       %s [-d] [-m] [-a] [-p] [-l] [-s] [-j n] [-B bytes] [-c file] -f rules [file]\n"
+				"       %s [-d] [-m] [-a] [-p] [-l] [-s] [-j n] [-B bytes] -C file [file]\n",
+		       argv[0], argv[0], argv[0]);
 		exit(EXIT_FAILURE);
 	}
     }
 
-    if (optind >= argc) {
-       fprintf(stderr, "error: missing trre expression\n");
-       exit(EXIT_FAILURE);
+    t[0] = t[1] = now();
+    if (load_fn) {			/* precompiled by -c */
+	h = trreb_map(load_fn, TRREB_NFT, &len);
+	prog = trreb_load_prog(h, len, load_fn);
+    } else if (rules_fn) {		/* one expression per line */
+	prog = compile(create_nft_rules(rules_fn, debug));
+    } else {
+	if (optind >= argc) {
+	   fprintf(stderr, "error: missing trre expression\n");
+	   exit(EXIT_FAILURE);
+	}
+	expr = argv[optind++];
+	if (!save_fn && !all && !debug && !stat && jobs == 1 && budget == BITSTATE_BUDGET)
+	    return cli_run(expr, optind < argc ? argv[optind] : NULL,
+			   (mode == MODE_MATCH ? TRRE_MATCH : 0) | (pike ? TRRE_PIKE : 0), line_buf);
+	root = parse(expr);
+	t[1] = now();
+
+	prog = compile(create_nft(root));
     }
-
-    expr = argv[optind];
-    root = parse(expr);
-
-    start = create_nft(root);
+    t[2] = now();
 
     if (debug) {
 	//plot_ast(root);
-	plot_nft(start);
+	plot_nft(prog);
+	fflush(stdout);		/* before the writer takes over */
+	fprintf(stderr, "arena: %zu bytes\n", arena_used(&arena));
     }
 
-
-    output = malloc(output_capacity*sizeof(char));
-
-    if (optind == argc - 2) {		// filename provided
-	input_fn = argv[optind + 1];
-
-	fp = fopen(input_fn, "r");
-	if (fp == NULL) {
-	    fprintf(stderr, "error: can not open file %s\n", input_fn);
-	    exit(EXIT_FAILURE);
-	}
-    } else
-    	fp = stdin;
-
-    if (mode == MODE_SCAN) {
-	while ((read = getline(&line, &input_len, fp)) != -1) {
-	    line[read-1] = '\0';
-	    ch = line;
-
-	    while (*ch != '\0') {
-		ioffset = infer_backtrack(start, ch, stack, mode, all);
-		if (ioffset > 0)
-		    ch += ioffset;
-		else
-		    fputc(*ch++, stdout);
-	    }
-	    // even if we have empty string we still need to run the inference
-	    infer_backtrack(start, ch, stack, mode, all);
-	    fputc('\n', stdout);
-	}
-    } else {	/* MATCH mode */
-	while ((read = getline(&line, &input_len, fp)) != -1) {
-	    line[read-1] = '\0';
-	    infer_backtrack(start, line, stack, mode, all);
-	    //fputc('\n', stdout);
-	}
+    if (save_fn) {
+	fp = trreb_create(save_fn);
+	trreb_save_prog(fp, prog, &hdr, TRREB_NFT);
+	trreb_finish(fp, &hdr, save_fn);
+	arena_free(&arena);
+	return 0;
     }
 
-    fclose(fp);
-    if (line)
-        free(line);
+    stack = screate(STACK_INIT_CAPACITY);
+    output = malloc(output_capacity*sizeof(char));
+    out_init(line_buf || isatty(STDOUT_FILENO));
+
+    /* all the outputs can only be enumerated by backtracking */
+    if (pike && !all)
+	vm = pike_create(prog->n);
+
+    skip_analyze(prog, &sk);
+    filter_analyze(prog, &flt);
+    if (debug)
+	filter_print(&flt);
+
+    /* the backtracker stops at the first match, so does the automaton */
+    if (mode == MODE_SCAN && !all)
+	dict_create(prog, &dict);
+    if (dict && debug)
+	fprintf(stderr, "dict: %u entries, %u nodes, %u classes\n", dict->n_e, dict->n, dict->n_cls);
+
+    in = input_open(optind < argc ? argv[optind] : NULL);
+
+    e.prog = prog;
+    e.sk = &sk;
+    e.flt = &flt;
+    e.dict = dict;
+    e.stack = stack;
+    e.bs = vm || all || budget == 0 || !bitstate_pays(prog) ? NULL : bitstate_create(budget);
+    e.vm = vm;
+    e.mode = mode;
+    e.all = all;
+    t[3] = now();
+    if (jobs > 1)
+	run_pool(&e, in, jobs, line_buf);
+    else
+	while (input_line(in, &line, &n))
+	    process_line(&e, line, n);
+
+    out_flush();
+    t[4] = now();
+    if (stat)
+	stats_print(&e, in, t);
+    sfree(stack);
+    bitstate_free(e.bs);
+    pike_free(vm);
+    dict_free(dict);
+    input_close(in);
+    arena_free(&arena);
     return 0;
 }
+#endif